@@ -12,14 +12,11 @@
 
 /// Length of string: "tcp!ip!port"
 #define ADDR_MAX   (64)
-/// Length of string: "<objid>/meta"
-#define PATH_MAX   (128)
 /// Length of string: "put <mrl>"
 #define MRL_MAX    (128)
-/// Size of obj meta data buffer
-#define META_MAX   (1024)
-/// Length of fav command
-#define FAV_MAX    (128)
+/// Length of fav command, ommserve applies each command in one transaction.
+/// Must fit into one 9P message, otherwise ommserve receives it in pieces
+#define FAV_MAX    (4096)
 // #define COL_SEP    "|"
 #define COL_SEP    "│"
 
@@ -73,57 +70,33 @@ void msec2time(struct time *t, uint64_t ms)
 int write_sqry_cmdbuf(char *buf);
 
 
+/// Index record fields preceding the meta data
+enum {
+	IDX_OBJID = 0,
+	IDX_SIZE,
+	IDX_META,
+};
+
+
 void
-print_direntry(Stat *stat)
+print_record(char *rec, int len)
 {
-	char path[PATH_MAX] = {0};
-	char *buf;
-	int count;
-	IxpCFid *fid;
-	/// Entry is a file, we're looking for dirs, only
-	if ((stat->mode & P9_DMDIR) == 0) return;
-	/// Stat data file
-	sprintf(path, "/%s/data", stat->name);
-	Stat *dstat = ixp_stat(serve, path);
-	if(dstat == NULL) {
-		fprintf(stderr, "failed to stat '%s', skipping ...\n", path);
-		return;
-	}
-	uint64_t fsize = dstat->length;
-	ixp_freestat(dstat);
-	/// Read meta file
-	sprintf(path, "/%s/meta", stat->name);
-	fid = ixp_open(serve, path, P9_OREAD);
-	if(fid == NULL) {
-		fprintf(stderr, "failed to open '%s', skipping ...\n", path);
-		return;
-	}
-	int meta_len = 0;
-	char meta[META_MAX] = {0};
-	buf = ixp_emalloc(fid->iounit);
-	while((count = ixp_read(fid, buf, fid->iounit)) > 0) {
-		memcpy(meta + meta_len, buf, count);
-		meta_len += count;
-	}
-	ixp_close(fid);
-	free(buf);
-	if(count == -1) {
-		fprintf(stderr, "failed to read from '%s': %s\n", path, ixp_errbuf());
-		return;
-	}
-	if(meta_len == 0) {
-		fprintf(stderr, "'%s' is empty\n", path);
-		return;
-	}
-	char *metargs[MET_CNT] = {0};
-	metargs[0] = meta;
-	char *ma = meta;
-	for (int m = 1; m < MET_CNT; ++m) {
-		ma = memchr(ma, LIST_SEP, meta_len - (ma - meta));
-		*(ma) = '\0';
-		ma++;
-		metargs[m] = ma;
+	char *args[IDX_META + MET_CNT] = {0};
+	args[0] = rec;
+	char *ra = rec;
+	for (int a = 1; a < IDX_META + MET_CNT; ++a) {
+		ra = memchr(ra, LIST_SEP, len - (ra - rec));
+		if (!ra) {
+			fprintf(stderr, "malformed index record '%s', skipping ...\n", rec);
+			return;
+		}
+		*(ra) = '\0';
+		ra++;
+		args[a] = ra;
 	}
+	char **metargs = args + IDX_META;
+	int64_t fsize = atoll(args[IDX_SIZE]);
+	if (fsize < 0) fsize = 0;
 	struct time t = {0};
 	uint64_t ms = atol(metargs[MET_DUR]);
 	msec2time(&t, ms);
@@ -131,7 +104,7 @@ print_direntry(Stat *stat)
 		"%2s " COL_SEP " %4.1f MB " \
 		COL_SEP " %02d:%02d:%02d " COL_SEP \
 		" %16s " COL_SEP " %s\n",
-			stat->name, fsize / 1e6,
+			args[IDX_OBJID], fsize / 1e6,
 			t.h, t.m, t.s,
 			metargs[MET_ORIG], metargs[MET_TITLE]);
 }
@@ -149,54 +122,41 @@ xls(int argc, char *argv[])
 		return 1;
 	}
 
-	IxpMsg m;
-	Stat *stat;
 	IxpCFid *fid;
-	char *file, *buf;
-	int count, i;
-
-	int ret = 1;
+	char *file, *buf, *rec, *end, *nl;
+	int count;
 
-	file = "/";
-	stat = ixp_stat(serve, file);
-	if(stat == NULL) {
-		fprintf(stderr, "failed to stat file '%s': %s\n", file, ixp_errbuf());
-		goto cleanup;
-	}
-	if((stat->mode & P9_DMDIR) == 0) {
-		fprintf(stderr, "root is a file, skipping ...");
-		goto cleanup;
-	}
-	ixp_freestat(stat);
+	/// The index file holds the meta data of all objs of the query result,
+	/// so a page of entries costs one read instead of a stat, open and read per obj
+	file = "/index";
 	fid = ixp_open(serve, file, P9_OREAD);
 	if(fid == NULL) {
-		fprintf(stderr, "failed to open dir '%s': %s\n", file, ixp_errbuf());
-		goto cleanup;
+		fprintf(stderr, "failed to open '%s': %s\n", file, ixp_errbuf());
+		return 1;
 	}
-	/// Read the root dir and stat each entry
-	stat = ixp_emalloc(sizeof(*stat));
 	buf = ixp_emalloc(fid->iounit);
+	/// Each read returns whole records, one per line
 	while((count = ixp_read(fid, buf, fid->iounit)) > 0) {
-		m = ixp_message(buf, count, MsgUnpack);
-		while(m.pos < m.end) {
-			ixp_pstat(&m, stat);
-			print_direntry(stat);
+		rec = buf;
+		end = buf + count;
+		while(rec < end && (nl = memchr(rec, '\n', end - rec))) {
+			*nl = '\0';
+			print_record(rec, nl - rec);
+			rec = nl + 1;
 		}
 	}
 	ixp_close(fid);
 	free(buf);
 	if(count == -1) {
-		fprintf(stderr, "failed to read dir '%s': %s\n", file, ixp_errbuf());
-		goto cleanup;
+		fprintf(stderr, "failed to read '%s': %s\n", file, ixp_errbuf());
+		return 1;
 	}
-	ret = 0;
-cleanup:
-	ixp_freestat(stat);
-	return ret;
+	return 0;
 }
 
 
-void
+/// write_buf() returns -1 if the server answered the write with an error
+int
 write_buf(IxpCFid *fid, char *buf, int len)
 {
 	/// FIXME ixp_write() seems to write even though count == 0, 
@@ -206,6 +166,7 @@ write_buf(IxpCFid *fid, char *buf, int len)
 	while (pos < len && (count = ixp_write(fid, buf + pos, len - pos)) > 0) {
 		pos += count;
 	}
+	return count < 0 ? -1 : 0;
 }
 
 
@@ -248,9 +209,13 @@ write_sctl_cmdbuf(char *buf)
 		fprintf(stderr, "failed to open ommserve ctl file: %s\n", ixp_errbuf());
 		return 1;
 	}
-	write_buf(fid, buf, strlen(buf));
+	int ret = 0;
+	if (write_buf(fid, buf, strlen(buf)) == -1) {
+		fprintf(stderr, "ommserve ctl command failed: %s\n", ixp_errbuf());
+		ret = 1;
+	}
 	ixp_close(fid);
-	return 0;
+	return ret;
 }
 
 
@@ -320,14 +285,30 @@ static int
 xfav(int argc, char *argv[])
 {
 	char buf[FAV_MAX] = {0};
-	if (argc == 4) {
-		sprintf(buf, "%s %s %s %s", argv[0], argv[1], argv[2], argv[3]);
+	if (argc >= 4 && (strcmp(argv[1], "add") == 0 || strcmp(argv[1], "del") == 0)) {
+		/// Send as many media ids per command as fit into the buffer
+		int i = 3;
+		while (i < argc) {
+			int len = snprintf(buf, FAV_MAX, "%s %s %s", argv[0], argv[1], argv[2]);
+			int start = i;
+			while (i < argc && len + 1 + strlen(argv[i]) < FAV_MAX) {
+				len += sprintf(buf + len, " %s", argv[i++]);
+			}
+			if (i == start) {
+				fprintf(stderr, "fav command too long\n");
+				return 1;
+			}
+			if (write_sctl_cmdbuf(buf)) {
+				return 1;
+			}
+		}
+		return 0;
 	} else if (argc == 3) {
 		sprintf(buf, "%s %s %s", argv[0], argv[1], argv[2]);
 	} else if (argc == 2) {
 		sprintf(buf, "%s %s", argv[0], argv[1]);
 	} else {
-		fprintf(stderr, "usage:\n  %s add|del <favlist id> <media id>\n  %s set <favlist id>\n",
+		fprintf(stderr, "usage:\n  %s add|del <favlist id> <media id> ...\n  %s set <favlist id>\n",
 		  argv[0], argv[0]);
 		return 1;
 	}
@@ -385,7 +366,6 @@ main(int argc, char *argv[]) {
 	} else {
 		ret = tab->fn(argc - 1, argv + 1);
 	}
-	ret = 0;
 	ixp_unmount(serve);
 	if (render) {
 		ixp_unmount(render);
@@ -91,6 +91,16 @@ RingBuffer::clear()
 }
 
 
+void
+RingBuffer::resize(int size)
+{
+    delete [] _ringBuffer;
+    _ringBuffer = new char[size];
+    _size = size;
+    clear();
+}
+
+
 ByteQueue::ByteQueue(int size) :
 _ringBuffer(size),
 _size(size),
@@ -177,6 +187,20 @@ ByteQueue::writeSome(const char* buffer, int num)
 }
 
 
+bool
+ByteQueue::tryWrite(const char* buffer, int num)
+{
+    Poco::ScopedLock<Poco::FastMutex> lock(_lock);
+    if (_size - _level < num) {
+        return false;
+    }
+    _ringBuffer.write(buffer, num);
+    _level += num;
+    _readCondition.broadcast();
+    return true;
+}
+
+
 int
 ByteQueue::size()
 {
@@ -197,8 +221,21 @@ void
 ByteQueue::clear()
 {
     LOG(avstream, trace, "byte queue clear");
-    char buf[_level];
-    read(buf, _level);
+    // don't copy the queued bytes to a buffer on the stack, queues can be several MB large
+    Poco::ScopedLock<Poco::FastMutex> lock(_lock);
+    _ringBuffer.clear();
+    _level = 0;
+    _writeCondition.broadcast();
+}
+
+
+void
+ByteQueue::resize(int size)
+{
+    Poco::ScopedLock<Poco::FastMutex> lock(_lock);
+    _ringBuffer.resize(size);
+    _size = size;
+    _level = 0;
 }
 
 
@@ -70,6 +70,7 @@ public:
     void write(const char* buffer, int num);
 
     void clear();
+    void resize(int size);
 
 private:
     char*                   _ringBuffer;
@@ -99,10 +100,16 @@ public:
     **/
     int readSome(char* buffer, int num);
     int writeSome(const char* buffer, int num);
+    /**
+    tryWrite() writes all num bytes or nothing without blocking, returns false if there's not enough room
+    **/
+    bool tryWrite(const char* buffer, int num);
 
     int size();
     int level();
     void clear();
+    // clears the queue, must not be called while readers or writers are blocked on the queue
+    void resize(int size);
 
     bool full();
     bool empty();
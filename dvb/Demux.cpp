@@ -155,11 +155,11 @@ Demux::selectStream(Stream* pStream, Target target, bool blocking)
 
     int flag = blocking ? O_RDWR : O_RDWR | O_NONBLOCK;
     int fileDesc;
-    if ((fileDesc = open(_deviceName.c_str(), flag)) < 0) {
+    if ((fileDesc = _pAdapter->openDevice(_deviceName, flag)) < 0) {
         LOG(dvb, error, "demuxer failed to open stream: " + std::string(strerror(errno)));
         return false;
     }
-    if (ioctl(fileDesc, DMX_SET_PES_FILTER, &pesfilter) == -1) {
+    if (_pAdapter->ioctlDevice(fileDesc, DMX_SET_PES_FILTER, &pesfilter) == -1) {
         LOG(dvb, error, "DMX_SET_PES_FILTER failed: " + std::string(strerror(errno)));
         return false;
     }
@@ -181,7 +181,7 @@ Demux::unselectStream(Stream* pStream)
         return false;
     }
     if (it->second->_refCount == 1) {
-        if (close(_pidSelectors[pid]->_fileDesc)) {
+        if (_pAdapter->closeDevice(_pidSelectors[pid]->_fileDesc)) {
             LOG(dvb, error, "demuxer closing stream: " + std::string(strerror(errno)));
             return false;
         }
@@ -209,7 +209,7 @@ Demux::runStream(Stream* pStream, bool run)
         return true;
     }
 
-    if (ioctl(_pidSelectors[pid]->_fileDesc, run ? DMX_START : DMX_STOP) == -1) {
+    if (_pAdapter->ioctlDevice(_pidSelectors[pid]->_fileDesc, run ? DMX_START : DMX_STOP, 0) == -1) {
         LOG(dvb, error, "demuxer failed to " + std::string(run ? "start" : "stop") + " stream with pid: " + Poco::NumberFormatter::format(pid));
         return false;
     }
@@ -231,7 +231,7 @@ Demux::setSectionFilter(Stream* pStream, Poco::UInt8 tableId)
     sectionFilter.filter.mask[0] = 0xff;
     sectionFilter.flags |= DMX_CHECK_CRC;
 
-    if (ioctl(_pidSelectors[pid]->_fileDesc, DMX_SET_FILTER, &sectionFilter) == -1) {
+    if (_pAdapter->ioctlDevice(_pidSelectors[pid]->_fileDesc, DMX_SET_FILTER, &sectionFilter) == -1) {
         LOG(dvb, error, "DMX_SET_PES_FILTER failed: " + std::string(strerror(errno)));
         return false;
     }
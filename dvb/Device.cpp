@@ -59,6 +59,7 @@
 #include "Mux.h"
 #include "Remux.h"
 #include "Dvr.h"
+#include "Loopback.h"
 #include "Device.h"
 
 
@@ -66,7 +67,8 @@ namespace Omm {
 namespace Dvb {
 
 
-Adapter::Adapter(int num)
+Adapter::Adapter(int num) :
+_num(num)
 {
     _deviceName = "/dev/dvb/adapter" + Poco::NumberFormatter::format(num);
 }
@@ -118,6 +120,27 @@ Adapter::closeAdapter()
 }
 
 
+int
+Adapter::openDevice(const std::string& deviceName, int flags)
+{
+    return ::open(deviceName.c_str(), flags);
+}
+
+
+int
+Adapter::ioctlDevice(int fileDesc, unsigned long request, void* pArg)
+{
+    return ::ioctl(fileDesc, request, pArg);
+}
+
+
+int
+Adapter::closeDevice(int fileDesc)
+{
+    return ::close(fileDesc);
+}
+
+
 std::string
 Adapter::getId()
 {
@@ -467,6 +490,39 @@ Device::freeByteQueue(AvStream::ByteQueue* pIstream)
 }
 
 
+Service*
+Device::getPacketStream(const std::string& serviceName)
+{
+    LOG(dvb, debug, "get packet stream: " + serviceName);
+
+    Poco::ScopedLock<Poco::FastMutex> lock(_deviceLock);
+
+    // scrambled services are not supported, yet
+    Transponder* pTransponder = tuneToService(serviceName, true);
+    if (!pTransponder) {
+        return 0;
+    }
+    Service* pService = pTransponder->getService(serviceName);
+    return startService(pService, true);
+}
+
+
+void
+Device::freePacketStream(Service* pService)
+{
+    LOG(dvb, debug, "free packet stream ...");
+
+    Poco::ScopedLock<Poco::FastMutex> lock(_deviceLock);
+
+    if (!pService) {
+        return;
+    }
+    stopService(pService);
+
+    LOG(dvb, debug, "free packet stream finished.");
+}
+
+
 void
 Device::detectAdapters()
 {
@@ -505,6 +561,41 @@ Device::detectAdapters()
             LOG(dvb, error, "failed to detect dvb device numbers: " + e.message());
         }
     }
+
+    // colon separated list of recorded TS files, each one is replayed on a loopback adapter.
+    // The frontend type (dvb-t, dvb-s, ...) must match the transponder config of the recordings
+    const char* loopbackFiles = ::getenv("OMM_DVB_LOOPBACK");
+    const char* loopbackType = ::getenv("OMM_DVB_LOOPBACK_TYPE");
+    if (loopbackFiles) {
+        Poco::StringTokenizer fileNames(loopbackFiles, ":", Poco::StringTokenizer::TOK_IGNORE_EMPTY);
+        for (Poco::StringTokenizer::Iterator it = fileNames.begin(); it != fileNames.end(); ++it) {
+            addLoopbackAdapter(*it, loopbackType ? loopbackType : Frontend::DVBT);
+        }
+    }
+}
+
+
+LoopbackAdapter*
+Device::addLoopbackAdapter(const std::string& fileName, const std::string& frontendType)
+{
+    int adapterNum = 0;
+    while (_adapters.find(LoopbackAdapter::IdPrefix + Poco::NumberFormatter::format(adapterNum)) != _adapters.end()) {
+        adapterNum++;
+    }
+    std::string adapterId = LoopbackAdapter::IdPrefix + Poco::NumberFormatter::format(adapterNum);
+    LOG(dvb, debug, "add loopback adapter with id: " + adapterId + ", replaying file: " + fileName);
+
+    LoopbackAdapter* pAdapter = new LoopbackAdapter(adapterNum, fileName, frontendType);
+    pAdapter->setId(adapterId);
+    _adapters[adapterId] = pAdapter;
+    Frontend* pFrontend = Frontend::detectFrontend(pAdapter, 0);
+    if (pFrontend) {
+        pAdapter->addFrontend(pFrontend);
+    }
+    else {
+        LOG(dvb, error, "failed to detect loopback frontend");
+    }
+    return pAdapter;
 }
 
 
@@ -642,7 +733,7 @@ Device::tuneToService(const std::string& serviceName, bool unscrambledOnly)
 
 
 Service*
-Device::startService(Service* pService)
+Device::startService(Service* pService, bool directRead)
 {
     LOG(dvb, debug, "reading service stream " + pService->getName() + " ...");
 
@@ -651,7 +742,7 @@ Device::startService(Service* pService)
     Demux* pDemux = pFrontend->_pDemux;
     Dvr* pDvr = pFrontend->_pDvr;
 
-    pService = pDvr->addService(pService);
+    pService = pDvr->addService(pService, directRead);
     pDemux->selectService(pService, Demux::TargetDvr, false);
     pDemux->runService(pService, true);
     pTransponder->markServiceStarted(pService);
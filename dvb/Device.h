@@ -48,6 +48,7 @@ class Demux;
 class Mux;
 class Dvr;
 class Adapter;
+class LoopbackAdapter;
 
 
 class ScanNotification : public Poco::Notification
@@ -72,7 +73,7 @@ class Adapter
 
 public:
     Adapter(int num);
-    ~Adapter();
+    virtual ~Adapter();
 
     typedef std::vector<Frontend*>::iterator FrontendIterator;
     FrontendIterator frontendBegin();
@@ -88,7 +89,13 @@ public:
     void readXml(Poco::XML::Node* pXmlAdapter);
     void writeXml(Poco::XML::Element* pDvbDevice);
 
-private:
+    // device backend for frontend, demux and dvr devices of the adapter. Default are the
+    // linux dvb device nodes, LoopbackAdapter emulates them.
+    virtual int openDevice(const std::string& deviceName, int flags);
+    virtual int ioctlDevice(int fileDesc, unsigned long request, void* pArg);
+    virtual int closeDevice(int fileDesc);
+
+protected:
     int                         _num;
     std::string                 _id;
     std::string                 _deviceName;
@@ -129,7 +136,12 @@ public:
     AvStream::ByteQueue* getByteQueue(const std::string& serviceName);
     void freeStream(std::istream* pIstream);
     void freeByteQueue(AvStream::ByteQueue* pIstream);
+    // started service in direct read mode, read it with Service::readSlices()
+    Service* getPacketStream(const std::string& serviceName);
+    void freePacketStream(Service* pService);
     void stopService(Service* pService);
+    // replay recorded TS file on a virtual adapter with a frontend of frontendType, see Loopback.h
+    LoopbackAdapter* addLoopbackAdapter(const std::string& fileName, const std::string& frontendType);
 
 private:
     Device();
@@ -140,7 +152,7 @@ private:
     void clearServiceMap();
     void clearAdapters();
     Transponder* tuneToService(const std::string& serviceName, bool unscrambledOnly = true);
-    Service* startService(Service* pService);
+    Service* startService(Service* pService, bool directRead = false);
     void stopServiceStreamsOnTransponder(Transponder* pTransponder);
 
     static Device*                                      _pInstance;
@@ -40,7 +40,7 @@ Dvr::~Dvr()
 void
 Dvr::openDvr()
 {
-    if ((_fileDescDvr = open(_deviceName.c_str(), O_RDONLY | O_NONBLOCK)) < 0) {
+    if ((_fileDescDvr = _pAdapter->openDevice(_deviceName, O_RDONLY | O_NONBLOCK)) < 0) {
         LOG(dvb, error, "failed to open dvb rec device \"" + _deviceName + "\": " + strerror(errno));
     }
     _pRemux = new Remux(_fileDescDvr);
@@ -56,7 +56,7 @@ Dvr::closeDvr()
         _pRemux->waitForStopRemux();
         _pRemux->flush();
         delete _pRemux;
-        if (close(_fileDescDvr)) {
+        if (_pAdapter->closeDevice(_fileDescDvr)) {
             LOG(dvb, error, "failed to close dvb rec device \"" + _deviceName + "\": " + strerror(errno));
         }
         _fileDescDvr = -1;
@@ -65,10 +65,10 @@ Dvr::closeDvr()
 
 
 Service*
-Dvr::addService(Service* pService)
+Dvr::addService(Service* pService, bool directRead)
 {
     if (_pRemux) {
-        return _pRemux->addService(pService);
+        return _pRemux->addService(pService, directRead);
     }
     else {
         return 0;
@@ -40,7 +40,7 @@ public:
     void stopReadThread();
     bool readThreadRunning();
 
-    Service* addService(Service* pService);
+    Service* addService(Service* pService, bool directRead = false);
     void delService(Service* pService);
 
     std::istream* getStream();
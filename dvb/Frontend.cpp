@@ -103,10 +103,10 @@ const std::string Frontend::ATSC("atsc");
 
 Frontend::Frontend(Adapter* pAdapter, int num) :
 _fileDescFrontend(-1),
-_pAdapter(pAdapter),
-_num(num),
 _frontendTimeout(2000000),
-_pTunedTransponder(0)
+_pTunedTransponder(0),
+_pAdapter(pAdapter),
+_num(num)
 {
     _deviceName = _pAdapter->_deviceName + "/frontend" + Poco::NumberFormatter::format(_num);
     _pDemux = new Demux(pAdapter, 0);
@@ -131,17 +131,17 @@ Frontend::detectFrontend(Adapter* pAdapter, int num)
 
     LOG(dvb, debug, "open frontend");
     int fileDescFrontend;
-    if ((fileDescFrontend = open(deviceName.c_str(), O_RDONLY | O_NONBLOCK)) < 0) {
+    if ((fileDescFrontend = pAdapter->openDevice(deviceName, O_RDONLY | O_NONBLOCK)) < 0) {
         LOG(dvb, error, "open frontend failed: " + std::string(strerror(errno)));
         return 0;
     }
 
     struct dvb_frontend_info feInfo;
-    int result = ioctl(fileDescFrontend, FE_GET_INFO, &feInfo);
+    int result = pAdapter->ioctlDevice(fileDescFrontend, FE_GET_INFO, &feInfo);
 
     if (result < 0) {
         LOG(dvb, error, "ioctl FE_GET_INFO failed");
-        if (close(fileDescFrontend)) {
+        if (pAdapter->closeDevice(fileDescFrontend)) {
             LOG(dvb, error, "failed to close frontend: " + std::string(strerror(errno)));
         }
         return 0;
@@ -165,7 +165,7 @@ Frontend::detectFrontend(Adapter* pAdapter, int num)
     pFrontend->_name = std::string(feInfo.name);
 
     LOG(dvb, debug, "close frontend");
-    if (close(fileDescFrontend)) {
+    if (pAdapter->closeDevice(fileDescFrontend)) {
         LOG(dvb, error, "failed to close frontend: " + std::string(strerror(errno)));
     }
     if (pFrontend) {
@@ -192,12 +192,12 @@ Frontend::openFrontend()
 {
     LOG(dvb, debug, "open frontend");
 
-    if ((_fileDescFrontend = open(_deviceName.c_str(), O_RDWR | O_NONBLOCK)) < 0) {
+    if ((_fileDescFrontend = _pAdapter->openDevice(_deviceName, O_RDWR | O_NONBLOCK)) < 0) {
         LOG(dvb, error, "open frontend failed: " + std::string(strerror(errno)));
         return;
     }
 
-    int result = ioctl(_fileDescFrontend, FE_GET_INFO, &_feInfo);
+    int result = _pAdapter->ioctlDevice(_fileDescFrontend, FE_GET_INFO, &_feInfo);
 
     if (result < 0) {
         LOG(dvb, error, "ioctl FE_GET_INFO failed");
@@ -243,7 +243,7 @@ Frontend::closeFrontend()
 //    dvb_frontend_event event;
 //    while (!ioctl(_fileDescFrontend, FE_GET_EVENT, &event)) {
 //    }
-    if (close(_fileDescFrontend)) {
+    if (_pAdapter->closeDevice(_fileDescFrontend)) {
         LOG(dvb, error, "failed to close frontend: " + std::string(strerror(errno)));
     }
 }
@@ -465,21 +465,21 @@ Frontend::checkFrontend()
     uint32_t ber, uncorrected_blocks;
 //     int timeout = 0;
 
-    if (ioctl(_fileDescFrontend, FE_READ_STATUS, &status) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_READ_STATUS, &status) == -1) {
         LOG(dvb, error, "FE_READ_STATUS failed");
     }
     /* some frontends might not support all these ioctls, thus we
     * avoid printing errors */
-    if (ioctl(_fileDescFrontend, FE_READ_SIGNAL_STRENGTH, &signal) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_READ_SIGNAL_STRENGTH, &signal) == -1) {
         signal = -2;
     }
-    if (ioctl(_fileDescFrontend, FE_READ_SNR, &snr) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_READ_SNR, &snr) == -1) {
         snr = -2;
     }
-    if (ioctl(_fileDescFrontend, FE_READ_BER, &ber) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_READ_BER, &ber) == -1) {
         ber = -2;
     }
-    if (ioctl(_fileDescFrontend, FE_READ_UNCORRECTED_BLOCKS, &uncorrected_blocks) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_READ_UNCORRECTED_BLOCKS, &uncorrected_blocks) == -1) {
         uncorrected_blocks = -2;
     }
 
@@ -538,7 +538,7 @@ bool
 Frontend::hasLock()
 {
     fe_status_t status;
-    if (!ioctl(_fileDescFrontend, FE_READ_STATUS, &status) && (status & FE_HAS_LOCK)) {
+    if (!_pAdapter->ioctlDevice(_fileDescFrontend, FE_READ_STATUS, &status) && (status & FE_HAS_LOCK)) {
         return true;
     }
     else {
@@ -811,7 +811,7 @@ SatFrontend::tune(Transponder* pTransponder)
         tuneto.u.qpsk.symbol_rate = pTrans->_symbolRate;
         tuneto.u.qpsk.fec_inner = FEC_AUTO;
 
-        if (ioctl(_fileDescFrontend, FE_SET_FRONTEND, &tuneto) == -1) {
+        if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_SET_FRONTEND, &tuneto) == -1) {
             LOG(dvb, debug, "sat frontend tuning failed.");
             continue;
         }
@@ -967,23 +967,23 @@ SatFrontend::diseqc(unsigned int satNum, const std::string& polarization, bool h
     fe_sec_tone_mode_t tone = hiBand ? SEC_TONE_ON : SEC_TONE_OFF;
     fe_sec_mini_cmd_t burst = satNum % 2 ? SEC_MINI_B : SEC_MINI_A;
 
-    if (ioctl(_fileDescFrontend, FE_SET_TONE, SEC_TONE_OFF) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_SET_TONE, (void*)(long)SEC_TONE_OFF) == -1) {
         LOG(dvb, error, "FE_SET_TONE failed");
     }
-    if (ioctl(_fileDescFrontend, FE_SET_VOLTAGE, voltage) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_SET_VOLTAGE, (void*)(long)voltage) == -1) {
         LOG(dvb, error, "FE_SET_VOLTAGE failed");
     }
     usleep(15 * 1000);
-    if (ioctl(_fileDescFrontend, FE_DISEQC_SEND_MASTER_CMD, &cmd.cmd) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_DISEQC_SEND_MASTER_CMD, &cmd.cmd) == -1) {
         LOG(dvb, error, "FE_DISEQC_SEND_MASTER_CMD failed");
     }
     usleep(cmd.wait * 1000);
     usleep(15 * 1000);
-    if (ioctl(_fileDescFrontend, FE_DISEQC_SEND_BURST, burst) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_DISEQC_SEND_BURST, (void*)(long)burst) == -1) {
         LOG(dvb, error, "FE_DISEQC_SEND_BURST failed");
     }
     usleep(15 * 1000);
-    if (ioctl(_fileDescFrontend, FE_SET_TONE, tone) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_SET_TONE, (void*)(long)tone) == -1) {
         LOG(dvb, error, "FE_SET_TONE failed");
     }
 
@@ -1032,7 +1032,7 @@ TerrestrialFrontend::tune(Transponder* pTransponder)
     tuneto.u.ofdm.guard_interval = pTrans->_guard_interval;
     tuneto.u.ofdm.hierarchy_information = pTrans->_hierarchy_information;
 
-    if (ioctl(_fileDescFrontend, FE_SET_FRONTEND, &tuneto) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_SET_FRONTEND, &tuneto) == -1) {
         LOG(dvb, debug, "terrestrial frontend tuning failed.");
         return false;
     }
@@ -1059,7 +1059,7 @@ CableFrontend::tune(Transponder* pTransponder)
     CableTransponder* pTrans = static_cast<CableTransponder*>(pTransponder);
     struct dvb_frontend_parameters tuneto;
 
-    if (ioctl(_fileDescFrontend, FE_SET_FRONTEND, &tuneto) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_SET_FRONTEND, &tuneto) == -1) {
         LOG(dvb, debug, "cable frontend tuning failed.");
         return false;
     }
@@ -1086,7 +1086,7 @@ AtscFrontend::tune(Transponder* pTransponder)
     AtscTransponder* pTrans = static_cast<AtscTransponder*>(pTransponder);
     struct dvb_frontend_parameters tuneto;
 
-    if (ioctl(_fileDescFrontend, FE_SET_FRONTEND, &tuneto) == -1) {
+    if (_pAdapter->ioctlDevice(_fileDescFrontend, FE_SET_FRONTEND, &tuneto) == -1) {
         LOG(dvb, debug, "atsc frontend tuning failed.");
         return false;
     }
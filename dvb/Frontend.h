@@ -80,12 +80,12 @@ protected:
     Poco::Timestamp::TimeDiff           _frontendTimeout;
     Poco::AutoPtr<Poco::XML::Element>   _pXmlFrontend;
     Transponder*                        _pTunedTransponder;
+    Adapter*                            _pAdapter;
 
 private:
     void checkFrontend();
     bool addKnownTransponder(Transponder* pTransponder);
 
-    Adapter*                            _pAdapter;
     std::string                         _deviceName;
     std::string                         _name;
     int                                 _num;
@@ -0,0 +1,547 @@
+/***************************************************************************|
+|  OMM - Open Multimedia                                                    |
+|                                                                           |
+|  Copyright (C) 2009, 2010, 2011, 2012, 2022                               |
+|  Jörg Bakker                                                              |
+|                                                                           |
+|  This file is part of OMM.                                                |
+|                                                                           |
+|  OMM is free software: you can redistribute it and/or modify              |
+|  it under the terms of the MIT License                                    |
+ ***************************************************************************/
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <string.h>
+#include <linux/dvb/frontend.h>
+#include <linux/dvb/dmx.h>
+
+#include <Poco/NumberFormatter.h>
+
+#include "Log.h"
+#include "TransportStream.h"
+#include "Section.h"
+#include "Transponder.h"
+#include "Frontend.h"
+#include "Loopback.h"
+
+
+namespace Omm {
+namespace Dvb {
+
+
+class LoopbackFilter
+{
+    friend class LoopbackAdapter;
+
+private:
+    enum Type { TypeNone, TypePes, TypeSection, TypeDvr };
+
+    LoopbackFilter(Type type, int readFileDesc, int writeFileDesc);
+    ~LoopbackFilter();
+
+    void write(const void* pData, int size);
+    void putPayload(const Poco::UInt8* pPacket);
+    void putSectionPayload(const Poco::UInt8* pPacket);
+    void writeSections();
+
+    Type                        _type;
+    int                         _readFileDesc;
+    int                         _writeFileDesc;
+    Poco::UInt16                _pid;
+    bool                        _running;
+    bool                        _toDvr;
+    Poco::UInt8                 _tableId;
+    Poco::UInt8                 _tableIdMask;
+    bool                        _checkCrc;
+    std::vector<Poco::UInt8>    _section;
+    Poco::UInt64                _overflows;
+};
+
+
+LoopbackFilter::LoopbackFilter(Type type, int readFileDesc, int writeFileDesc) :
+_type(type),
+_readFileDesc(readFileDesc),
+_writeFileDesc(writeFileDesc),
+_pid(0),
+_running(false),
+_toDvr(false),
+_tableId(0),
+_tableIdMask(0),
+_checkCrc(false),
+_overflows(0)
+{
+}
+
+
+LoopbackFilter::~LoopbackFilter()
+{
+    if (_overflows) {
+        LOG(dvb, warning, "loopback filter for pid " + Poco::NumberFormatter::format(_pid) + " overflows: " + Poco::NumberFormatter::format(_overflows));
+    }
+    ::close(_writeFileDesc);
+    ::close(_readFileDesc);
+}
+
+
+void
+LoopbackFilter::write(const void* pData, int size)
+{
+    // like the kernel buffers of a dvb device, data is lost if the reader doesn't keep up
+    if (::write(_writeFileDesc, pData, size) != size) {
+        _overflows++;
+    }
+}
+
+
+void
+LoopbackFilter::putPayload(const Poco::UInt8* pPacket)
+{
+    int payloadStart = TransportStreamPacket::HeaderSize;
+    if (pPacket[3] & 0x20) {
+        payloadStart += pPacket[4] + 1;
+    }
+    if ((pPacket[3] & 0x10) && payloadStart < TransportStreamPacket::Size) {
+        write(pPacket + payloadStart, TransportStreamPacket::Size - payloadStart);
+    }
+}
+
+
+void
+LoopbackFilter::putSectionPayload(const Poco::UInt8* pPacket)
+{
+    int payloadStart = TransportStreamPacket::HeaderSize;
+    if (pPacket[3] & 0x20) {
+        payloadStart += pPacket[4] + 1;
+    }
+    if (!(pPacket[3] & 0x10) || payloadStart >= TransportStreamPacket::Size) {
+        return;
+    }
+    const Poco::UInt8* pPayload = pPacket + payloadStart;
+    const Poco::UInt8* pEnd = pPacket + TransportStreamPacket::Size;
+    if (pPacket[1] & 0x40) {
+        // payload unit start, pointer field gives the start of the next section
+        int pointer = pPayload[0];
+        pPayload++;
+        if (pPayload + pointer > pEnd) {
+            _section.clear();
+            return;
+        }
+        if (!_section.empty()) {
+            _section.insert(_section.end(), pPayload, pPayload + pointer);
+            writeSections();
+        }
+        _section.assign(pPayload + pointer, pEnd);
+    }
+    else if (!_section.empty()) {
+        _section.insert(_section.end(), pPayload, pEnd);
+    }
+    writeSections();
+}
+
+
+void
+LoopbackFilter::writeSections()
+{
+    while (_section.size() >= 3) {
+        if (_section[0] == 0xff) {
+            // stuffing after the last section in the packet
+            _section.clear();
+            return;
+        }
+        int sectionSize = 3 + (((_section[1] & 0x0f) << 8) | _section[2]);
+        if (_section.size() < sectionSize) {
+            return;
+        }
+        if ((_section[0] & _tableIdMask) == (_tableId & _tableIdMask)
+                && (!_checkCrc || !Section::crc32(&_section[0], sectionSize))) {
+            // sections are smaller than PIPE_BUF, so they are written atomically
+            write(&_section[0], sectionSize);
+        }
+        _section.erase(_section.begin(), _section.begin() + sectionSize);
+    }
+}
+
+
+const std::string LoopbackAdapter::IdPrefix("loopback");
+const std::string LoopbackAdapter::FrontendName("OMM loopback");
+
+LoopbackAdapter::LoopbackAdapter(int num, const std::string& fileName, const std::string& frontendType) :
+Adapter(num),
+_fileName(fileName),
+_pFile(0),
+_frontendType(FE_OFDM),
+_paced(true),
+_replayThreadRunnable(*this, &LoopbackAdapter::replayThread),
+_replayThreadRunning(false),
+_pcrPid(-1),
+_pcrValid(false),
+_pcrBase(0)
+{
+    // virtual device names, only used to tell frontend, demux and dvr apart
+    _deviceName = IdPrefix + Poco::NumberFormatter::format(num);
+    if (frontendType == Frontend::DVBS) {
+        _frontendType = FE_QPSK;
+    }
+    else if (frontendType == Frontend::DVBC) {
+        _frontendType = FE_QAM;
+    }
+    else if (frontendType == Frontend::ATSC) {
+        _frontendType = FE_ATSC;
+    }
+    else if (frontendType != Frontend::DVBT) {
+        LOG(dvb, error, "loopback adapter frontend type unknown: " + frontendType + ", using " + Frontend::DVBT);
+    }
+    _pFile = ::fopen(_fileName.c_str(), "rb");
+    if (!_pFile) {
+        LOG(dvb, error, "loopback adapter failed to open file " + _fileName + ": " + std::string(strerror(errno)));
+        return;
+    }
+    _replayThreadRunning = true;
+    _replayThread.start(_replayThreadRunnable);
+}
+
+
+LoopbackAdapter::~LoopbackAdapter()
+{
+    if (_pFile) {
+        _loopbackLock.lock();
+        _replayThreadRunning = false;
+        _loopbackLock.unlock();
+        _replayThread.join();
+        ::fclose(_pFile);
+    }
+    for (std::map<int, LoopbackFilter*>::iterator it = _filters.begin(); it != _filters.end(); ++it) {
+        delete it->second;
+    }
+    for (std::set<int>::iterator it = _frontendFileDescs.begin(); it != _frontendFileDescs.end(); ++it) {
+        ::close(*it);
+    }
+}
+
+
+void
+LoopbackAdapter::setPaced(bool paced)
+{
+    _paced = paced;
+}
+
+
+int
+LoopbackAdapter::openDevice(const std::string& deviceName, int flags)
+{
+    Poco::ScopedLock<Poco::FastMutex> lock(_loopbackLock);
+
+    std::string device = deviceName.substr(_deviceName.length() + 1);
+    if (device.substr(0, std::string("frontend").length()) == "frontend") {
+        // a file descriptor that can be closed, all ioctls are emulated
+        int fileDesc = ::open("/dev/null", O_RDONLY);
+        if (fileDesc >= 0) {
+            _frontendFileDescs.insert(fileDesc);
+        }
+        return fileDesc;
+    }
+
+    LoopbackFilter::Type type;
+    if (device.substr(0, std::string("demux").length()) == "demux") {
+        type = LoopbackFilter::TypeNone;
+    }
+    else if (device.substr(0, std::string("dvr").length()) == "dvr") {
+        type = LoopbackFilter::TypeDvr;
+    }
+    else {
+        errno = ENODEV;
+        return -1;
+    }
+    int pipeFileDesc[2];
+    if (::pipe2(pipeFileDesc, O_CLOEXEC) == -1) {
+        return -1;
+    }
+    // the replay thread never blocks on a reader
+    ::fcntl(pipeFileDesc[1], F_SETFL, O_NONBLOCK);
+    if (flags & O_NONBLOCK) {
+        ::fcntl(pipeFileDesc[0], F_SETFL, O_NONBLOCK);
+    }
+    if (type == LoopbackFilter::TypeDvr) {
+        // make room for a couple of packet blocks, as the dvr device does
+        ::fcntl(pipeFileDesc[1], F_SETPIPE_SZ, 1024 * 1024);
+    }
+    _filters[pipeFileDesc[0]] = new LoopbackFilter(type, pipeFileDesc[0], pipeFileDesc[1]);
+    updatePidFilters();
+    return pipeFileDesc[0];
+}
+
+
+int
+LoopbackAdapter::ioctlDevice(int fileDesc, unsigned long request, void* pArg)
+{
+    Poco::ScopedLock<Poco::FastMutex> lock(_loopbackLock);
+
+    if (_frontendFileDescs.find(fileDesc) != _frontendFileDescs.end()) {
+        return frontendIoctl(request, pArg);
+    }
+    std::map<int, LoopbackFilter*>::iterator it = _filters.find(fileDesc);
+    if (it == _filters.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    int res = demuxIoctl(it->second, request, pArg);
+    updatePidFilters();
+    return res;
+}
+
+
+int
+LoopbackAdapter::closeDevice(int fileDesc)
+{
+    Poco::ScopedLock<Poco::FastMutex> lock(_loopbackLock);
+
+    if (_frontendFileDescs.erase(fileDesc)) {
+        return ::close(fileDesc);
+    }
+    std::map<int, LoopbackFilter*>::iterator it = _filters.find(fileDesc);
+    if (it == _filters.end()) {
+        errno = EBADF;
+        return -1;
+    }
+    delete it->second;
+    _filters.erase(it);
+    updatePidFilters();
+    return 0;
+}
+
+
+int
+LoopbackAdapter::frontendIoctl(unsigned long request, void* pArg)
+{
+    switch (request) {
+        case FE_GET_INFO: {
+            struct dvb_frontend_info* pInfo = (struct dvb_frontend_info*)pArg;
+            ::memset(pInfo, 0, sizeof(struct dvb_frontend_info));
+            ::strncpy(pInfo->name, FrontendName.c_str(), sizeof(pInfo->name) - 1);
+            pInfo->type = (fe_type_t)_frontendType;
+            pInfo->frequency_min = 0;
+            pInfo->frequency_max = 0xffffffff;
+            return 0;
+        }
+        case FE_READ_STATUS:
+            // locked to whatever transponder is requested, as long as there is something to replay
+            *(fe_status_t*)pArg = _pFile ? (fe_status_t)(FE_HAS_SIGNAL | FE_HAS_CARRIER | FE_HAS_VITERBI | FE_HAS_SYNC | FE_HAS_LOCK) : (fe_status_t)0;
+            return 0;
+        case FE_READ_SIGNAL_STRENGTH:
+        case FE_READ_SNR:
+            *(Poco::UInt16*)pArg = _pFile ? 0xffff : 0;
+            return 0;
+        case FE_READ_BER:
+        case FE_READ_UNCORRECTED_BLOCKS:
+            *(Poco::UInt32*)pArg = 0;
+            return 0;
+        case FE_SET_FRONTEND:
+        case FE_SET_TONE:
+        case FE_SET_VOLTAGE:
+        case FE_DISEQC_SEND_MASTER_CMD:
+        case FE_DISEQC_SEND_BURST:
+            return 0;
+        default:
+            errno = ENOTTY;
+            return -1;
+    }
+}
+
+
+int
+LoopbackAdapter::demuxIoctl(LoopbackFilter* pFilter, unsigned long request, void* pArg)
+{
+    switch (request) {
+        case DMX_SET_PES_FILTER: {
+            struct dmx_pes_filter_params* pParams = (struct dmx_pes_filter_params*)pArg;
+            if (pParams->input != DMX_IN_FRONTEND) {
+                errno = EINVAL;
+                return -1;
+            }
+            pFilter->_type = LoopbackFilter::TypePes;
+            pFilter->_pid = pParams->pid & 0x1fff;
+            pFilter->_toDvr = (pParams->output == DMX_OUT_TS_TAP);
+            pFilter->_running = pParams->flags & DMX_IMMEDIATE_START;
+            pFilter->_section.clear();
+            return 0;
+        }
+        case DMX_SET_FILTER: {
+            struct dmx_sct_filter_params* pParams = (struct dmx_sct_filter_params*)pArg;
+            pFilter->_type = LoopbackFilter::TypeSection;
+            pFilter->_pid = pParams->pid & 0x1fff;
+            pFilter->_toDvr = false;
+            pFilter->_tableId = pParams->filter.filter[0];
+            pFilter->_tableIdMask = pParams->filter.mask[0];
+            pFilter->_checkCrc = pParams->flags & DMX_CHECK_CRC;
+            pFilter->_running = pParams->flags & DMX_IMMEDIATE_START;
+            pFilter->_section.clear();
+            return 0;
+        }
+        case DMX_START:
+            if (pFilter->_type == LoopbackFilter::TypeNone || pFilter->_type == LoopbackFilter::TypeDvr) {
+                errno = EINVAL;
+                return -1;
+            }
+            pFilter->_running = true;
+            return 0;
+        case DMX_STOP:
+            pFilter->_running = false;
+            pFilter->_section.clear();
+            return 0;
+        case DMX_SET_BUFFER_SIZE:
+            return 0;
+        default:
+            errno = ENOTTY;
+            return -1;
+    }
+}
+
+
+void
+LoopbackAdapter::updatePidFilters()
+{
+    // called with _loopbackLock held
+    for (int pid = 0; pid < 8192; ++pid) {
+        _pidFilters[pid].clear();
+    }
+    _dvrFilters.clear();
+    for (std::map<int, LoopbackFilter*>::iterator it = _filters.begin(); it != _filters.end(); ++it) {
+        LoopbackFilter* pFilter = it->second;
+        if (pFilter->_type == LoopbackFilter::TypeDvr) {
+            _dvrFilters.push_back(pFilter);
+        }
+        else if (pFilter->_type != LoopbackFilter::TypeNone && pFilter->_running) {
+            _pidFilters[pFilter->_pid].push_back(pFilter);
+        }
+    }
+}
+
+
+bool
+LoopbackAdapter::replayThreadRunning()
+{
+    Poco::ScopedLock<Poco::FastMutex> lock(_loopbackLock);
+    return _replayThreadRunning;
+}
+
+
+void
+LoopbackAdapter::replayThread()
+{
+    LOG(dvb, debug, "loopback replay thread started.");
+
+    Poco::UInt8 packet[TransportStreamPacket::Size];
+    while (replayThreadRunning()) {
+        if (!readPacket(packet)) {
+            if (::feof(_pFile)) {
+                LOG(dvb, debug, "loopback replay reached end of file, rewind");
+                ::rewind(_pFile);
+                _pcrValid = false;
+            }
+            else {
+                LOG(dvb, error, "loopback replay failed to read file: " + std::string(strerror(errno)));
+                Poco::Thread::sleep(1000);
+                ::clearerr(_pFile);
+            }
+            continue;
+        }
+        if (_paced) {
+            pacePacket(packet);
+        }
+        Poco::ScopedLock<Poco::FastMutex> lock(_loopbackLock);
+        dispatchPacket(packet);
+    }
+
+    LOG(dvb, debug, "loopback replay thread finished.");
+}
+
+
+bool
+LoopbackAdapter::readPacket(Poco::UInt8* pPacket)
+{
+    int c;
+    int skipped = 0;
+    while ((c = ::fgetc(_pFile)) != EOF && c != TransportStreamPacket::SyncByte) {
+        skipped++;
+    }
+    if (skipped) {
+        LOG(dvb, warning, "loopback replay lost sync, skipped " + Poco::NumberFormatter::format(skipped) + " bytes");
+    }
+    if (c == EOF) {
+        return false;
+    }
+    pPacket[0] = c;
+    return ::fread(pPacket + 1, 1, TransportStreamPacket::Size - 1, _pFile) == TransportStreamPacket::Size - 1;
+}
+
+
+void
+LoopbackAdapter::pacePacket(const Poco::UInt8* pPacket)
+{
+    // only packets with adaption field that carries a PCR
+    if (!(pPacket[3] & 0x20) || pPacket[4] < 7 || !(pPacket[5] & 0x10)) {
+        return;
+    }
+    int pid = ((pPacket[1] & 0x1f) << 8) | pPacket[2];
+    if (_pcrPid == -1) {
+        LOG(dvb, debug, "loopback replay paced by PCR of pid: " + Poco::NumberFormatter::format(pid));
+        _pcrPid = pid;
+    }
+    else if (pid != _pcrPid) {
+        return;
+    }
+    // PCR in 27 MHz ticks
+    Poco::Int64 pcrBase = ((Poco::Int64)pPacket[6] << 25) | (pPacket[7] << 17) | (pPacket[8] << 9) | (pPacket[9] << 1) | (pPacket[10] >> 7);
+    Poco::Int64 pcr = pcrBase * 300 + (((pPacket[10] & 0x01) << 8) | pPacket[11]);
+    Poco::Int64 pcrElapsed = pcr - _pcrBase;
+    // rebase on start, end of file, PCR wrap around or discontinuity (jump of more than 10 sec)
+    if (!_pcrValid || pcrElapsed < 0 || pcrElapsed > 10 * 27000000LL) {
+        _pcrBase = pcr;
+        _pcrBaseTime.update();
+        _pcrValid = true;
+        return;
+    }
+    Poco::Timestamp::TimeDiff wait = pcrElapsed / 27 - _pcrBaseTime.elapsed();
+    if (wait > 0) {
+        ::usleep(wait);
+    }
+    else if (wait < -1000000) {
+        // more than one sec late, don't try to catch up with a burst
+        LOG(dvb, warning, "loopback replay late, rebase PCR");
+        _pcrValid = false;
+    }
+}
+
+
+void
+LoopbackAdapter::dispatchPacket(const Poco::UInt8* pPacket)
+{
+    // called with _loopbackLock held
+    int pid = ((pPacket[1] & 0x1f) << 8) | pPacket[2];
+    bool toDvr = false;
+    std::vector<LoopbackFilter*>& filters = _pidFilters[pid];
+    for (std::vector<LoopbackFilter*>::iterator it = filters.begin(); it != filters.end(); ++it) {
+        LoopbackFilter* pFilter = *it;
+        if (pFilter->_type == LoopbackFilter::TypeSection) {
+            pFilter->putSectionPayload(pPacket);
+        }
+        else if (pFilter->_toDvr) {
+            toDvr = true;
+        }
+        else {
+            pFilter->putPayload(pPacket);
+        }
+    }
+    if (toDvr) {
+        for (std::vector<LoopbackFilter*>::iterator it = _dvrFilters.begin(); it != _dvrFilters.end(); ++it) {
+            (*it)->write(pPacket, TransportStreamPacket::Size);
+        }
+    }
+}
+
+
+}  // namespace Omm
+}  // namespace Dvb
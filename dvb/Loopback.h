@@ -0,0 +1,97 @@
+/***************************************************************************|
+|  OMM - Open Multimedia                                                    |
+|                                                                           |
+|  Copyright (C) 2009, 2010, 2011, 2012, 2022                               |
+|  Jörg Bakker                                                              |
+|                                                                           |
+|  This file is part of OMM.                                                |
+|                                                                           |
+|  OMM is free software: you can redistribute it and/or modify              |
+|  it under the terms of the MIT License                                    |
+ ***************************************************************************/
+
+#ifndef Loopback_INCLUDED
+#define Loopback_INCLUDED
+
+#include <cstdio>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+
+#include <Poco/Thread.h>
+#include <Poco/Mutex.h>
+#include <Poco/RunnableAdapter.h>
+#include <Poco/Timestamp.h>
+
+#include "Device.h"
+
+namespace Omm {
+namespace Dvb {
+
+class LoopbackFilter;
+
+
+/**
+class LoopbackAdapter - virtual dvb adapter that replays a recorded transport stream file.
+Frontend, demux and dvr devices are emulated in user space with pipes, so the real Frontend,
+Demux, Dvr and Remux code runs on top of it without dvb hardware. PES and section filters
+(DMX_SET_PES_FILTER, DMX_SET_FILTER) are applied to the replayed packets. The file is replayed
+in a loop and paced by its PCR, like a transponder that is always on air. The frontend reports
+lock as long as the file can be read. The frontend has the type given to the constructor
+(Frontend::DVBT by default, see OMM_DVB_LOOPBACK_TYPE), only transponder configs of that type
+are read for the loopback adapter, as for real adapters.
+**/
+class LoopbackAdapter : public Adapter
+{
+public:
+    static const std::string IdPrefix;
+    static const std::string FrontendName;
+
+    LoopbackAdapter(int num, const std::string& fileName, const std::string& frontendType);
+    virtual ~LoopbackAdapter();
+
+    // replay paced by PCR (default) or as fast as the readers can take it
+    void setPaced(bool paced);
+
+    virtual int openDevice(const std::string& deviceName, int flags);
+    virtual int ioctlDevice(int fileDesc, unsigned long request, void* pArg);
+    virtual int closeDevice(int fileDesc);
+
+private:
+    int frontendIoctl(unsigned long request, void* pArg);
+    int demuxIoctl(LoopbackFilter* pFilter, unsigned long request, void* pArg);
+    void updatePidFilters();
+    void replayThread();
+    bool replayThreadRunning();
+    bool readPacket(Poco::UInt8* pPacket);
+    void pacePacket(const Poco::UInt8* pPacket);
+    void dispatchPacket(const Poco::UInt8* pPacket);
+
+    std::string                                 _fileName;
+    FILE*                                       _pFile;
+    int                                         _frontendType;      // fe_type_t reported by FE_GET_INFO
+    // read by the replay thread without holding _loopbackLock
+    std::atomic<bool>                           _paced;
+    std::set<int>                               _frontendFileDescs;
+    // demux and dvr filters by file descriptor of the reading end
+    std::map<int, LoopbackFilter*>              _filters;
+    // running demux filters by pid, rebuilt when filters change
+    std::vector<LoopbackFilter*>                _pidFilters[8192];
+    std::vector<LoopbackFilter*>                _dvrFilters;
+    Poco::FastMutex                             _loopbackLock;
+
+    Poco::Thread                                _replayThread;
+    Poco::RunnableAdapter<LoopbackAdapter>      _replayThreadRunnable;
+    bool                                        _replayThreadRunning;
+
+    int                                         _pcrPid;
+    bool                                        _pcrValid;
+    Poco::Int64                                 _pcrBase;
+    Poco::Timestamp                             _pcrBaseTime;
+};
+
+}  // namespace Omm
+}  // namespace Dvb
+
+#endif
@@ -34,6 +34,8 @@ TsPacketBlock::free()
 
 Remux::Remux(int multiplex) :
 _multiplex(multiplex),
+_pDispatchTable(new PidDispatchTable),
+_pActiveDispatchTable(0),
 _readTimeout(1000),
 _pReadThread(0),
 _readThreadRunnable(*this, &Remux::readThread),
@@ -41,10 +43,17 @@ _readThreadRunning(false),
 _pQueueThread(0),
 _queueThreadRunnable(*this, &Remux::queueThread),
 _queueThreadRunning(false),
-_packetBlockQueueSize(100)
+_packetBlockQueueSize(100),
+_residualSize(0),
+_inSync(true),
+_statInterval(10000000),
+_statPackets(0),
+_statSyscalls(0),
+_statSyncLosses(0)
 {
     _fileDescPoll[0].fd = multiplex;
     _fileDescPoll[0].events = POLLIN;
+    _pResidualData = new Poco::UInt8[TransportStreamPacket::Size];
 
 //    _packetPool.push(new TsPacketBlock(this));
 }
@@ -52,11 +61,13 @@ _packetBlockQueueSize(100)
 
 Remux::~Remux()
 {
+    delete _pDispatchTable.load();
+    delete [] _pResidualData;
 }
 
 
 Service*
-Remux::addService(Service* pService)
+Remux::addService(Service* pService, bool directRead)
 {
     Poco::ScopedLock<Poco::FastMutex> lock(_remuxLock);
     std::vector<Service*>::iterator it = std::find(_services.begin(), _services.end(), pService);
@@ -65,8 +76,14 @@ Remux::addService(Service* pService)
         LOG(dvb, debug, "clone service " + pService->getName());
         pService = new Service(*pService);
     }
-    pService->startQueueThread();
+    if (directRead) {
+        pService->startDirectRead();
+    }
+    else {
+        pService->startQueueThread();
+    }
     _services.push_back(pService);
+    updateDispatchTable();
     return pService;
 }
 
@@ -79,8 +96,12 @@ Remux::delService(Service* pService)
     if (it != _services.end()) {
         _services.erase(it);
     }
+    // after this, the read thread doesn't queue any packets to the service
+    updateDispatchTable();
     pService->stopQueueThread();
     pService->waitForStopQueueThread();
+    // a direct reader may still be blocked in readSlices(), the clone is deleted below
+    pService->waitForReaders();
     pService->flush();
     if (pService->_clone) {
         delete pService;
@@ -88,6 +109,54 @@ Remux::delService(Service* pService)
 }
 
 
+void
+Remux::updateDispatchTable()
+{
+    // called with _remuxLock held
+    PidDispatchTable* pTable = new PidDispatchTable;
+    pTable->_services = _services;
+    for (std::vector<Service*>::iterator it = _services.begin(); it != _services.end(); ++it) {
+        for (std::set<Poco::UInt16>::iterator pit = (*it)->_pids.begin(); pit != (*it)->_pids.end(); ++pit) {
+            if (*pit < PidDispatchTable::PidCount) {
+                pTable->_subscribers[*pit].push_back(*it);
+            }
+        }
+    }
+    PidDispatchTable* pOldTable = _pDispatchTable.exchange(pTable);
+    // wait until the read thread finished dispatching the current packet block with the old table
+    while (_pActiveDispatchTable.load() == pOldTable) {
+        Poco::Thread::yield();
+    }
+    delete pOldTable;
+}
+
+
+void
+Remux::dispatchPacketBlock(TsPacketBlock* pPacketBlock)
+{
+    // announce the table in use and check that it is still the current one,
+    // otherwise updateDispatchTable() may already have deleted it
+    PidDispatchTable* pTable = _pDispatchTable.load();
+    _pActiveDispatchTable.store(pTable);
+    while (pTable != _pDispatchTable.load()) {
+        pTable = _pDispatchTable.load();
+        _pActiveDispatchTable.store(pTable);
+    }
+
+    while (TransportStreamPacket* pTsPacket = pPacketBlock->getPacket()) {
+        const std::vector<Service*>& subscribers = pTable->_subscribers[pTsPacket->getPacketIdentifier()];
+        for (std::vector<Service*>::const_iterator it = subscribers.begin(); it != subscribers.end(); ++it) {
+            (*it)->queueTsPacket(pTsPacket);
+        }
+    }
+    // wake up service queue threads once per block instead of once per packet
+    for (std::vector<Service*>::const_iterator it = pTable->_services.begin(); it != pTable->_services.end(); ++it) {
+        (*it)->signalQueueThread();
+    }
+    _pActiveDispatchTable.store(0);
+}
+
+
 void
 Remux::startRemux()
 {
@@ -165,6 +234,8 @@ Remux::flush()
             LOG(dvb, warning, "flush remux input stream: " + std::string(strerror(errno)));
         }
     } while (bytes > 0);
+    _residualSize = 0;
+    _inSync = true;
 
 //    LOG(dvb, debug, "flush remux packet block queue: " + Poco::NumberFormatter::format(_packetBlockQueue.size()) + " packet blocks");
 //    while (_packetBlockQueue.size()) {
@@ -190,57 +261,12 @@ Remux::queueThreadRunning()
 }
 
 
-TransportStreamPacket*
-Remux::getTransportStreamPacket()
-{
-    TransportStreamPacket* pPacket = new TransportStreamPacket;
-    int bytesToRead = TransportStreamPacket::Size;
-    int bytesRead = 0;
-
-    while (bytesToRead > 0) {
-        int pollRes = poll(_fileDescPoll, 1, _readTimeout);
-        if (pollRes > 0) {
-            if (_fileDescPoll[0].revents & POLLIN){
-                bytesRead += ::read(_multiplex, (Poco::UInt8*)pPacket->getData() + bytesRead, bytesToRead);
-                if (bytesRead > 0) {
-                    bytesToRead -= bytesRead;
-                    if (pPacket->getBytes<Poco::UInt8>(0) != TransportStreamPacket::SyncByte) {
-                        LOG(dvb, error, "TS packet wrong sync byte: " + Poco::NumberFormatter::formatHex(pPacket->getBytes<Poco::UInt8>(0)));
-                        delete pPacket;
-                        return 0;
-                    }
-                }
-                else if (bytesRead == -1) {
-                    LOG(dvb, error, "remux read thread failed to read from device: " + std::string(strerror(errno)));
-                    delete pPacket;
-                    return 0;
-                }
-            }
-            else {
-                LOG(dvb, warning, "remux read thread uncatched poll event");
-            }
-        }
-        else if (pollRes == 0) {
-            LOG(dvb, trace, "remux read thread poll timeout");
-            delete pPacket;
-            return 0;
-        }
-        else if (pollRes == -1) {
-            LOG(dvb, error, "remux read thread failed to read TS packet: " + std::string(strerror(errno)));
-            delete pPacket;
-            return 0;
-        }
-    }
-    return pPacket;
-}
-
-
 TsPacketBlock*
 Remux::getFreePacketBlock()
 {
 //    LOG(dvb, debug, "remux get free packet block, pool size: " + Poco::NumberFormatter::format(_packetPool.size()));
 
-    Poco::ScopedLock<Poco::FastMutex> lock(_remuxLock);
+    Poco::ScopedLock<Poco::FastMutex> lock(_packetPoolLock);
 
     if (_packetPool.size()) {
         TsPacketBlock* pRes = _packetPool.top();
@@ -259,7 +285,7 @@ Remux::putFreePacketBlock(TsPacketBlock* pPacketBlock)
 {
 //    LOG(dvb, debug, "remux put free packet block, pool size: " + Poco::NumberFormatter::format(_packetPool.size()));
 
-    Poco::ScopedLock<Poco::FastMutex> lock(_remuxLock);
+    Poco::ScopedLock<Poco::FastMutex> lock(_packetPoolLock);
 
     _packetPool.push(pPacketBlock);
 }
@@ -284,47 +310,114 @@ Remux::queuePacketBlock(TsPacketBlock* pPacketBlock)
 TsPacketBlock*
 Remux::readPacketBlock()
 {
+    // NOTE: dvr device is opened non-blocking, so read() returns whatever is available
+    // in the kernel buffer up to the size of one packet block, instead of one packet per syscall
+    int pollRes = poll(_fileDescPoll, 1, _readTimeout);
+    _statSyscalls++;
+    if (pollRes == 0) {
+        LOG(dvb, trace, "remux read thread poll timeout");
+        return 0;
+    }
+    else if (pollRes == -1) {
+        LOG(dvb, error, "remux read thread failed to read TS packet block: " + std::string(strerror(errno)));
+        return 0;
+    }
+    else if (!(_fileDescPoll[0].revents & POLLIN)) {
+        LOG(dvb, warning, "remux read thread uncatched poll event");
+        return 0;
+    }
+
     TsPacketBlock* pPacketBlock = getFreePacketBlock();
     Poco::UInt8* pPacketBlockData = pPacketBlock->getPacketData();
+    if (_residualSize) {
+        ::memcpy(pPacketBlockData, _pResidualData, _residualSize);
+    }
+    int bytesRead = ::read(_multiplex, pPacketBlockData + _residualSize, TsPacketBlock::Size - _residualSize);
+    _statSyscalls++;
+    if (bytesRead == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            LOG(dvb, error, "remux read thread failed to read from device: " + std::string(strerror(errno)));
+        }
+        putFreePacketBlock(pPacketBlock);
+        return 0;
+    }
+    else if (bytesRead == 0) {
+        putFreePacketBlock(pPacketBlock);
+        return 0;
+    }
 
-    int bytesToRead = TsPacketBlock::Size;
-    int bytesRead = 0;
-
-    while (bytesToRead > 0) {
-        int pollRes = poll(_fileDescPoll, 1, _readTimeout);
-        if (pollRes > 0) {
-            if (_fileDescPoll[0].revents & POLLIN){
-                bytesRead += ::read(_multiplex, pPacketBlockData + bytesRead, bytesToRead);
-                if (bytesRead > 0) {
-                    bytesToRead -= bytesRead;
-                    if (*pPacketBlockData != TransportStreamPacket::SyncByte) {
-                        LOG(dvb, error, "TS packet wrong sync byte: " + Poco::NumberFormatter::formatHex(*pPacketBlockData));
-                        putFreePacketBlock(pPacketBlock);
-                        return 0;
-                    }
-                }
-                else if (bytesRead == -1) {
-                    LOG(dvb, error, "remux read thread failed to read from device: " + std::string(strerror(errno)));
-                    putFreePacketBlock(pPacketBlock);
-                    return 0;
-                }
-            }
-            else {
-                LOG(dvb, warning, "remux read thread uncatched poll event");
+    int bytes = _residualSize + bytesRead;
+    int packetCount = alignPackets(pPacketBlockData, bytes);
+    int packetBytes = packetCount * TransportStreamPacket::Size;
+    // keep the incomplete last packet for the next read
+    _residualSize = bytes - packetBytes;
+    if (_residualSize) {
+        ::memcpy(_pResidualData, pPacketBlockData + packetBytes, _residualSize);
+    }
+    if (!packetCount) {
+        putFreePacketBlock(pPacketBlock);
+        return 0;
+    }
+    pPacketBlock->setPacketCount(packetCount);
+    _statPackets += packetCount;
+    return pPacketBlock;
+}
+
+
+int
+Remux::alignPackets(Poco::UInt8* pData, int& size)
+{
+    // move all packets in pData that start with a sync byte to the start of pData,
+    // skipping bytes in between when the sync is lost. A packet is only accepted
+    // if the following packet (if already read) starts with a sync byte, too.
+    // Returns the number of packets found, the bytes after these packets contain
+    // the (possibly incomplete) next packet. size is reduced by the skipped bytes.
+    const int packetSize = TransportStreamPacket::Size;
+    int readPos = 0;
+    int writePos = 0;
+    while (size - readPos >= packetSize) {
+        if (pData[readPos] != TransportStreamPacket::SyncByte
+                || (readPos + packetSize < size && pData[readPos + packetSize] != TransportStreamPacket::SyncByte)) {
+            if (_inSync) {
+                LOG(dvb, error, "TS packet wrong sync byte: " + Poco::NumberFormatter::formatHex(pData[readPos]) + ", resync");
+                _inSync = false;
+                _statSyncLosses++;
             }
+            readPos++;
+            continue;
         }
-        else if (pollRes == 0) {
-            LOG(dvb, trace, "remux read thread poll timeout");
-            putFreePacketBlock(pPacketBlock);
-            return 0;
-        }
-        else if (pollRes == -1) {
-            LOG(dvb, error, "remux read thread failed to read TS packet block: " + std::string(strerror(errno)));
-            putFreePacketBlock(pPacketBlock);
-            return 0;
+        _inSync = true;
+        if (readPos != writePos) {
+            ::memmove(pData + writePos, pData + readPos, packetSize);
         }
+        readPos += packetSize;
+        writePos += packetSize;
     }
-    return pPacketBlock;
+    // the remaining bytes are (the start of) the next packet, move them behind the aligned packets
+    if (readPos != writePos) {
+        ::memmove(pData + writePos, pData + readPos, size - readPos);
+        size -= readPos - writePos;
+    }
+    return writePos / packetSize;
+}
+
+
+void
+Remux::logStatistics()
+{
+    Poco::Timestamp::TimeDiff elapsed = _statTimestamp.elapsed();
+    if (elapsed < _statInterval) {
+        return;
+    }
+    float seconds = elapsed / 1000000.0;
+    LOG(dvb, information, "remux read " + Poco::NumberFormatter::format(_statPackets / seconds, 0) + " packets/sec, "
+            + Poco::NumberFormatter::format(_statSyscalls / seconds, 0) + " syscalls/sec, "
+            + Poco::NumberFormatter::format(_statSyscalls ? (float)_statPackets / _statSyscalls : 0.0, 2) + " packets/syscall, "
+            + Poco::NumberFormatter::format(_statSyncLosses) + " sync losses");
+    _statPackets = 0;
+    _statSyscalls = 0;
+    _statSyncLosses = 0;
+    _statTimestamp.update();
 }
 
 
@@ -366,14 +459,7 @@ Remux::queueThread()
             continue;
         }
 
-        while (TransportStreamPacket* pTsPacket = pPacketBlock->getPacket()) {
-            Poco::UInt16 pid = pTsPacket->getPacketIdentifier();
-            for (std::vector<Service*>::const_iterator it = _services.begin(); it != _services.end(); ++it) {
-                if ((*it)->hasPacketIdentifier(pid)) {
-                    (*it)->queueTsPacket(pTsPacket);
-                }
-            }
-        }
+        dispatchPacketBlock(pPacketBlock);
         // NOTE: enabling queue thread reduces cpu load but introduces interrupts in stream
         // no interrupts when:
         // 1. TransportStreamPacketBlock::SizeInPackets = 1 (but then no cpu load decrease, either)
@@ -391,19 +477,17 @@ Remux::readThread()
     // NOTE: the remuxer loop is very performance critical (do more optimizing?)
     LOG(dvb, debug, "remux thread started.");
 
+    _statTimestamp.update();
     while (readThreadRunning()) {
-        TransportStreamPacket* pTsPacket = getTransportStreamPacket();
-        if (!pTsPacket) {
+        TsPacketBlock* pPacketBlock = readPacketBlock();
+        logStatistics();
+        if (!pPacketBlock) {
 //            LOG(dvb, warning, "remux thread could not read packet.");
             continue;
         }
-        Poco::UInt16 pid = pTsPacket->getPacketIdentifier();
-        for (std::vector<Service*>::const_iterator it = _services.begin(); it != _services.end(); ++it) {
-            if ((*it)->hasPacketIdentifier(pid)) {
-                (*it)->queueTsPacket(pTsPacket);
-            }
-        }
-        pTsPacket->decRefCounter();
+        dispatchPacketBlock(pPacketBlock);
+        // services keep a reference on the block for each queued packet
+        pPacketBlock->decRefCounter();
     }
 
     LOG(dvb, debug, "remux thread finished.");
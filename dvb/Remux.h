@@ -14,9 +14,11 @@
 #define Remux_INCLUDED
 
 #include <sys/poll.h>
+#include <atomic>
 
 #include <Poco/Thread.h>
 #include <Poco/Mutex.h>
+#include <Poco/Timestamp.h>
 
 #include "TransportStream.h"
 #include "Service.h"
@@ -42,6 +44,19 @@ private:
 };
 
 
+// routing of TS packets to services, indexed by the 13 bit packet identifier.
+// A table is never modified after it is published to the read thread,
+// adding or removing a service builds and publishes a new table.
+class PidDispatchTable
+{
+public:
+    static const int PidCount = 8192;
+
+    std::vector<Service*>   _services;
+    std::vector<Service*>   _subscribers[PidCount];
+};
+
+
 class Remux
 {
     friend class TsPacketBlock;
@@ -50,7 +65,7 @@ public:
     Remux(int multiplex);
     ~Remux();
 
-    Service* addService(Service* pService);
+    Service* addService(Service* pService, bool directRead = false);
     void delService(Service* pService);
 
     void startRemux();
@@ -59,11 +74,14 @@ public:
     void flush();
 
 private:
-    TransportStreamPacket* getTransportStreamPacket();
     TsPacketBlock* getFreePacketBlock();
     void putFreePacketBlock(TsPacketBlock* pPacketBlock);
     void queuePacketBlock(TsPacketBlock* pPacketBlock);
+    void updateDispatchTable();
+    void dispatchPacketBlock(TsPacketBlock* pPacketBlock);
     TsPacketBlock* readPacketBlock();
+    int alignPackets(Poco::UInt8* pData, int& size);
+    void logStatistics();
     void readThread();
     bool readThreadRunning();
     void queueThread();
@@ -71,6 +89,10 @@ private:
 
     int                                                 _multiplex;
     std::vector<Service*>                               _services;
+    // table used by the read thread, _services is only accessed with _remuxLock held
+    std::atomic<PidDispatchTable*>                      _pDispatchTable;
+    // table the read thread is currently dispatching with, must not be deleted
+    std::atomic<PidDispatchTable*>                      _pActiveDispatchTable;
 //    std::map<Poco::UInt16, ElementaryTransportStream*>  _pStreams;
 
     Poco::FastMutex                                     _remuxLock;
@@ -86,7 +108,19 @@ private:
     const int                                           _packetBlockQueueSize;
     Poco::Condition                                     _packetBlockQueueReadCondition;
     std::queue<TsPacketBlock*>                          _packetBlockQueue;
+    Poco::FastMutex                                     _packetPoolLock;
     std::stack<TsPacketBlock*>                          _packetPool;
+
+    // incomplete packet at the end of the last read, completed by the next read
+    Poco::UInt8*                                        _pResidualData;
+    int                                                 _residualSize;
+    bool                                                _inSync;
+
+    const Poco::Timestamp::TimeDiff                     _statInterval;
+    Poco::Timestamp                                     _statTimestamp;
+    Poco::UInt64                                        _statPackets;
+    Poco::UInt64                                        _statSyscalls;
+    Poco::UInt64                                        _statSyncLosses;
 };
 
 
@@ -286,12 +286,8 @@ Section::setCrc()
 //	data[_size - 2] = crc32 >> 8;
 //	data[_size - 1] = crc32;
 
-    unsigned int crc32 = 0xffffffff;
     char* data = (char*) getData();
-    for (int i = 0; i < (_size - 4); ++i) {
-		unsigned char byte = data[i];
-		crc32 = (crc32 << 8) ^ crc32Table[(crc32 >> 24) ^ byte];
-	}
+    unsigned int crc32 = Section::crc32(data, _size - 4);
 
 	data[_size - 4] = crc32 >> 24;
 	data[_size - 3] = crc32 >> 16;
@@ -314,6 +310,18 @@ Section::timeout()
 }
 
 
+unsigned int
+Section::crc32(const void* pData, int size)
+{
+    unsigned int crc32 = 0xffffffff;
+    const unsigned char* data = (const unsigned char*) pData;
+    for (int i = 0; i < size; ++i) {
+		crc32 = (crc32 << 8) ^ crc32Table[(crc32 >> 24) ^ data[i]];
+	}
+    return crc32;
+}
+
+
 const unsigned int Section::crc32Table[] =
 {
 	0x00000000, 0x04c11db7, 0x09823b6e, 0x0d4326d9,
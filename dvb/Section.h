@@ -73,6 +73,8 @@ public:
     void setSectionNumber(Poco::UInt8 section);
     void setLastSectionNumber(Poco::UInt8 lastSection);
     void setCrc();
+    // MPEG-2 CRC32, a section including its CRC gives 0
+    static unsigned int crc32(const void* pData, int size);
 
     unsigned int size();
     unsigned int timeout();
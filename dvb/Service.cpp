@@ -29,6 +29,8 @@
 #include <Poco/DOM/AutoPtr.h>
 #include <Poco/DOM/Document.h>
 
+#include <algorithm>
+#include <cstring>
 #include <queue>
 #include <stack>
 
@@ -78,6 +80,12 @@ const std::string Service::StatusPausing("Pausing");
 const std::string Service::StatusRunning("Running");
 const std::string Service::StatusOffAir("OffAir");
 
+// about 16 secs of a 256 kbit/s radio, 4 Mbit/s SD and 12 Mbit/s HD stream
+int Service::_audioQueueSize(512 * 1024);
+int Service::_sdVideoQueueSize(8 * 1024 * 1024);
+int Service::_hdVideoQueueSize(24 * 1024 * 1024);
+Service::OverflowPolicy Service::_defaultOverflowPolicy(Service::OverflowBlock);
+
 Service::Service(Transponder* pTransponder, const std::string& name, unsigned int sid, unsigned int pmtid) :
 _clone(false),
 _pTransponder(pTransponder),
@@ -89,13 +97,34 @@ _status(StatusUndefined),
 _scrambled(false),
 _byteQueue(2 * 1024),
 _pIStream(0),
-_packetQueueTimeout(100),
+_patPacketCounter(0),
+_patContinuityCounter(0),
 // FIXME currently need a large queue, because the renderer needs a long startup time
-// until it begins to actually render the stream
-_packetQueueSize(100000),
+// until it begins to actually render the stream. Queue is resized to the size configured
+// for the service type, when the service is started
+_packetQueue(100000),
+_packetQueueTimeout(100),
+_packetQueueDropped(0),
+_pinnedBlocks(0),
+_maxPinnedBlocks(1),
+_pLastQueuedBlock(0),
+_pLastPoppedBlock(0),
+_copiedPackets(0),
+_overflowPolicy(_defaultOverflowPolicy),
+_highWatermark(0),
+_lowWatermark(0),
+_aboveHighWatermark(false),
+_droppingGop(false),
+_gopPid(0),
+_gopPidIsVideo(false),
+_maxLevel(0),
+_highWatermarkHits(0),
+_overflowDropped(0),
 _pQueueThread(0),
 _queueThreadRunnable(*this, &Service::queueThread),
-_queueThreadRunning(false)
+_queueThreadRunning(false),
+_directRead(false),
+_activeReaders(0)
 {
     _pPat = PatSection::create();
     _pPat->setTableIdExtension(0x0001);  // artificial transport stream id for a TS with one service
@@ -128,13 +157,33 @@ _streams(service._streams),
 _pids(service._pids),
 _byteQueue(2 * 1024),
 _pIStream(0),
+_patPacketCounter(0),
+_patContinuityCounter(0),
 //_pPat(new PatSection(*service._pPat)),
 //_pPatTsPacket(new TransportStreamPacket(*service._pPatTsPacket)),
+_packetQueue(10000),
 _packetQueueTimeout(100),
-_packetQueueSize(10000),
+_packetQueueDropped(0),
+_pinnedBlocks(0),
+_maxPinnedBlocks(1),
+_pLastQueuedBlock(0),
+_pLastPoppedBlock(0),
+_copiedPackets(0),
+_overflowPolicy(_defaultOverflowPolicy),
+_highWatermark(0),
+_lowWatermark(0),
+_aboveHighWatermark(false),
+_droppingGop(false),
+_gopPid(0),
+_gopPidIsVideo(false),
+_maxLevel(0),
+_highWatermarkHits(0),
+_overflowDropped(0),
 _pQueueThread(0),
 _queueThreadRunnable(*this, &Service::queueThread),
-_queueThreadRunning(false)
+_queueThreadRunning(false),
+_directRead(false),
+_activeReaders(0)
 {
     // these ad hoc copy ctors for PAT and PAT-TS packet crash on stop of service
 //    ::memcpy(_pPat->getData(), service._pPat->getData(), service._pPat->size());
@@ -489,16 +538,18 @@ Service::stopStream()
 void
 Service::flush()
 {
-    _serviceLock.lock();
+    // NOTE: queue thread must be stopped, as it is the only reader of the packet queue
+    Poco::ScopedLock<Poco::FastMutex> readLock(_readLock);
     LOG(dvb, debug, "flush count packets from service queue: " + Poco::NumberFormatter::format(_packetQueue.size()));
-    while (_packetQueue.size()) {
-        TransportStreamPacket* pPacket = _packetQueue.front();
-        if (pPacket && pPacket->getPacketIdentifier()) {
-            pPacket->decRefCounter();
-        }
-        _packetQueue.pop();
+    TransportStreamPacket* pPacket;
+    while (popPackets(&pPacket, 1)) {
+        pPacket->decRefCounter();
+    }
+    for (std::vector<TransportStreamPacket*>::iterator it = _readPackets.begin(); it != _readPackets.end(); ++it) {
+        (*it)->decRefCounter();
     }
-    _serviceLock.unlock();
+    _readPackets.clear();
+    logQueueStats();
     LOG(dvb, debug, "flush count bytes from service byte queue: " + Poco::NumberFormatter::format(_byteQueue.size()));
     _byteQueue.clear();
     LOG(dvb, debug, "service stream flushed");
@@ -508,28 +559,53 @@ Service::flush()
 void
 Service::queueTsPacket(TransportStreamPacket* pPacket)
 {
-    Poco::ScopedLock<Poco::FastMutex> queueLock(_serviceLock);
 //    LOG(dvb, debug, "queue packet to service " + _name + std::string(_clone ? "(clone)" : ""));
 
-    if (_packetQueue.size() < _packetQueueSize) {
-//        LOG(dvb, trace, "service queue, queue packet");
+    TransportStreamPacketBlock* pBlock = pPacket->getPacketBlock();
+    bool newBlock = pBlock && pBlock != _pLastQueuedBlock;
+    if (newBlock && _pinnedBlocks.load(std::memory_order_relaxed) >= _maxPinnedBlocks) {
+        // queue holds as many blocks as its size allows, copy the packet instead of pinning another block
+        TransportStreamPacket* pCopy = new TransportStreamPacket;
+        ::memcpy(pCopy->getData(), pPacket->getData(), TransportStreamPacket::Size);
+        pPacket = pCopy;
+        newBlock = false;
+        _copiedPackets++;
+    }
+    else {
+        // take the reference before the packet is visible to the queue thread
         pPacket->incRefCounter();
-        _packetQueue.push(pPacket);
-        _queueReadCondition.broadcast();
+    }
+    if (_packetQueue.push(pPacket)) {
+        if (newBlock) {
+            _pLastQueuedBlock = pBlock;
+            _pinnedBlocks++;
+        }
     }
     else {
-        LOG(dvb, error, "service queue full, discard packet.");
         pPacket->decRefCounter();
+        // log only once per 1000 dropped packets, logging each one would slow down the remux thread even more
+        if (!(_packetQueueDropped++ % 1000)) {
+            LOG(dvb, error, "service queue full, discard packet (dropped: " + Poco::NumberFormatter::format(_packetQueueDropped) + ")");
+        }
     }
 }
 
 
+void
+Service::signalQueueThread()
+{
+    _packetQueue.signal();
+}
+
+
 void
 Service::startQueueThread()
 {
     LOG(dvb, debug, "start service queue thread ...");
 
     if (!_pQueueThread) {
+        _directRead = false;
+        initQueues();
         _queueThreadRunning = true;
         _pQueueThread = new Poco::Thread;
         _pQueueThread->start(_queueThreadRunnable);
@@ -537,6 +613,275 @@ Service::startQueueThread()
 }
 
 
+void
+Service::startDirectRead()
+{
+    LOG(dvb, debug, "start service direct read ...");
+
+    Poco::ScopedLock<Poco::FastMutex> lock(_serviceLock);
+    _directRead = true;
+    initQueues();
+    _queueThreadRunning = true;
+    _patPacketCounter = 0;
+}
+
+
+void
+Service::initQueues()
+{
+    // called before the service is added to the remux dispatch table, so no packets are queued
+    int size = _hdVideoQueueSize;
+    if (isAudio()) {
+        size = _audioQueueSize;
+    }
+    else if (isSdVideo()) {
+        size = _sdVideoQueueSize;
+    }
+    _packetQueue.resize(size / TransportStreamPacket::Size);
+    _maxPinnedBlocks = std::max(1, size / TransportStreamPacketBlock::Size);
+    _pinnedBlocks = 0;
+    _pLastQueuedBlock = 0;
+    _pLastPoppedBlock = 0;
+    _copiedPackets = 0;
+    // the byte queue is only used by the queue thread, direct readers take the packets with readSlices()
+    if (!_directRead && _byteQueue.size() != size) {
+        _byteQueue.resize(size);
+    }
+    _overflowPolicy = _defaultOverflowPolicy;
+    _highWatermark = _packetQueue.capacity() * 3 / 4;
+    _lowWatermark = _packetQueue.capacity() / 4;
+    _aboveHighWatermark = false;
+    _droppingGop = false;
+    Stream* pGopStream = getFirstVideoStream();
+    _gopPidIsVideo = pGopStream;
+    if (!pGopStream) {
+        pGopStream = getFirstAudioStream();
+    }
+    _gopPid = pGopStream ? pGopStream->getPid() : 0;
+    _maxLevel = 0;
+    _highWatermarkHits = 0;
+    _packetQueueDropped = 0;
+    _overflowDropped = 0;
+    LOG(dvb, debug, "service " + _name + " queue size: " + Poco::NumberFormatter::format(size) + " bytes, overflow policy: "
+            + Poco::NumberFormatter::format(_overflowPolicy));
+}
+
+
+int
+Service::popPackets(TransportStreamPacket** pPackets, int count)
+{
+    int packetCount = _packetQueue.pop(pPackets, count);
+    // a packet from another block ends the run of the previous block, copies don't pin a block
+    for (int i = 0; i < packetCount; ++i) {
+        TransportStreamPacketBlock* pBlock = pPackets[i]->getPacketBlock();
+        if (pBlock && pBlock != _pLastPoppedBlock) {
+            if (_pLastPoppedBlock) {
+                _pinnedBlocks--;
+            }
+            _pLastPoppedBlock = pBlock;
+        }
+    }
+    return packetCount;
+}
+
+
+int
+Service::applyOverflowPolicy(TransportStreamPacket** pPackets, int packetCount)
+{
+    // level in packets, including the packets just taken out of the queue
+    int level = _packetQueue.size() + packetCount;
+    if (level > _maxLevel) {
+        _maxLevel = level;
+    }
+    if (!_aboveHighWatermark && level >= _highWatermark) {
+        LOG(dvb, warning, "service " + _name + " queue above high watermark: " + Poco::NumberFormatter::format(level) + " packets");
+        _aboveHighWatermark = true;
+        _highWatermarkHits++;
+        _droppingGop = (_overflowPolicy == OverflowDropOldestGop);
+    }
+    else if (_aboveHighWatermark && level <= _lowWatermark) {
+        _aboveHighWatermark = false;
+    }
+    if (!_droppingGop) {
+        return packetCount;
+    }
+    // discard packets until the level is below the low watermark and the next GOP starts
+    int kept = 0;
+    for (int i = 0; i < packetCount; ++i) {
+        if (_droppingGop && level - i <= _lowWatermark && isGopStart(pPackets[i])) {
+            LOG(dvb, warning, "service " + _name + " dropped oldest GOPs, total dropped packets: "
+                    + Poco::NumberFormatter::format(_overflowDropped));
+            _droppingGop = false;
+        }
+        if (_droppingGop) {
+            pPackets[i]->decRefCounter();
+            _overflowDropped++;
+        }
+        else {
+            pPackets[kept++] = pPackets[i];
+        }
+    }
+    return kept;
+}
+
+
+bool
+Service::isGopStart(TransportStreamPacket* pPacket)
+{
+    if (pPacket->getPacketIdentifier() != _gopPid) {
+        return false;
+    }
+    // video GOPs start at a random access point, for radio any audio frame will do
+    return _gopPidIsVideo ? pPacket->getRandomAccessIndicator() : pPacket->getPayloadUnitStartIndicator();
+}
+
+
+void
+Service::getQueueStats(QueueStats& stats)
+{
+    stats.policy = _overflowPolicy;
+    stats.size = _packetQueue.capacity() * TransportStreamPacket::Size;
+    stats.level = _packetQueue.size() * TransportStreamPacket::Size + (_directRead ? 0 : _byteQueue.level());
+    stats.maxLevel = _maxLevel * TransportStreamPacket::Size;
+    stats.highWatermark = _highWatermark * TransportStreamPacket::Size;
+    stats.lowWatermark = _lowWatermark * TransportStreamPacket::Size;
+    stats.highWatermarkHits = _highWatermarkHits;
+    stats.droppedPackets = _packetQueueDropped + _overflowDropped;
+    stats.copiedPackets = _copiedPackets;
+}
+
+
+void
+Service::logQueueStats()
+{
+    QueueStats stats;
+    getQueueStats(stats);
+    LOG(dvb, information, "service " + _name + " queue stats, size: " + Poco::NumberFormatter::format(stats.size)
+            + ", max level: " + Poco::NumberFormatter::format(stats.maxLevel)
+            + ", high/low watermark: " + Poco::NumberFormatter::format(stats.highWatermark)
+            + "/" + Poco::NumberFormatter::format(stats.lowWatermark)
+            + ", high watermark hits: " + Poco::NumberFormatter::format(stats.highWatermarkHits)
+            + ", dropped packets: " + Poco::NumberFormatter::format(stats.droppedPackets)
+            + ", copied packets: " + Poco::NumberFormatter::format(stats.copiedPackets));
+}
+
+
+void
+Service::setQueueSizes(int audioSize, int sdVideoSize, int hdVideoSize)
+{
+    _audioQueueSize = audioSize;
+    _sdVideoQueueSize = sdVideoSize;
+    _hdVideoQueueSize = hdVideoSize;
+}
+
+
+void
+Service::setOverflowPolicy(OverflowPolicy policy)
+{
+    _defaultOverflowPolicy = policy;
+}
+
+
+namespace {
+
+// counts a reader for the lifetime of the scope
+class ScopedReader
+{
+public:
+    ScopedReader(std::atomic<int>& readers) : _readers(readers) { ++_readers; }
+    ~ScopedReader() { --_readers; }
+
+private:
+    std::atomic<int>&   _readers;
+};
+
+}
+
+
+int
+Service::readSlices(struct iovec* pSlices, int count, int size)
+{
+    ScopedReader reader(_activeReaders);
+    Poco::ScopedLock<Poco::FastMutex> readLock(_readLock);
+
+    releaseReadPackets();
+    // packets of other services are interleaved in the blocks, worst case is one slice per packet
+    int maxPackets = std::min(std::min(size / TransportStreamPacket::Size, count), TransportStreamPacketBlock::SizeInPackets);
+    if (maxPackets <= 0) {
+        return 0;
+    }
+    // all PAT slices point to the same PAT packet, so at most one PAT packet with the current
+    // continuity counter may be handed out per read. Leave room for it only if it is injected
+    // before one of the packets of this read
+    if (maxPackets >= patPacketsDue()) {
+        if (maxPackets == 1) {
+            // no room for a packet after the PAT, the PAT alone is the read
+            if (!queueThreadRunning()) {
+                return -1;
+            }
+            injectPat();
+            pSlices[0].iov_base = _pPatTsPacket->getData();
+            pSlices[0].iov_len = TransportStreamPacket::Size;
+            return 1;
+        }
+        maxPackets--;
+    }
+    _readPackets.resize(maxPackets);
+    int packetCount = 0;
+    while (!packetCount) {
+        packetCount = popPackets(&_readPackets[0], maxPackets);
+        if (packetCount) {
+            // all packets may be dropped, then try again
+            packetCount = applyOverflowPolicy(&_readPackets[0], packetCount);
+            continue;
+        }
+        if (!queueThreadRunning()) {
+            _readPackets.clear();
+            return -1;
+        }
+        _packetQueue.wait(_packetQueueTimeout);
+    }
+    _readPackets.resize(packetCount);
+
+    int sliceCount = 0;
+    for (int i = 0; i < packetCount; ++i) {
+        if (injectPat()) {
+            pSlices[sliceCount].iov_base = _pPatTsPacket->getData();
+            pSlices[sliceCount].iov_len = TransportStreamPacket::Size;
+            sliceCount++;
+        }
+        char* pData = (char*)_readPackets[i]->getData();
+        if (sliceCount && (char*)pSlices[sliceCount - 1].iov_base + pSlices[sliceCount - 1].iov_len == pData) {
+            pSlices[sliceCount - 1].iov_len += TransportStreamPacket::Size;
+        }
+        else {
+            pSlices[sliceCount].iov_base = pData;
+            pSlices[sliceCount].iov_len = TransportStreamPacket::Size;
+            sliceCount++;
+        }
+    }
+    return sliceCount;
+}
+
+
+void
+Service::releaseSlices()
+{
+    Poco::ScopedLock<Poco::FastMutex> readLock(_readLock);
+    releaseReadPackets();
+}
+
+
+void
+Service::releaseReadPackets()
+{
+    for (std::vector<TransportStreamPacket*>::iterator it = _readPackets.begin(); it != _readPackets.end(); ++it) {
+        (*it)->decRefCounter();
+    }
+    _readPackets.clear();
+}
+
+
 void
 Service::stopQueueThread()
 {
@@ -546,8 +891,7 @@ Service::stopQueueThread()
 
     _queueThreadRunning = false;
     _byteQueue.clear();
-    _packetQueue.push(0);
-    _queueReadCondition.broadcast();
+    _packetQueue.signal(true);
 }
 
 
@@ -564,6 +908,17 @@ Service::waitForStopQueueThread()
 }
 
 
+void
+Service::waitForReaders()
+{
+    // readers waiting for packets wake up, see that the service is stopped and return -1
+    while (_activeReaders.load() > 0) {
+        _packetQueue.signal(true);
+        Poco::Thread::yield();
+    }
+}
+
+
 bool
 Service::queueThreadRunning()
 {
@@ -579,46 +934,74 @@ Service::queueThread()
 
     Poco::Timestamp t;
     long unsigned int tsPacketCounter = 0;
-    Poco::UInt8 continuityCounter = 0;
+    _patPacketCounter = 0;
 
+    const int batchSize = TransportStreamPacketBlock::SizeInPackets;
+    TransportStreamPacket* packets[batchSize];
     while (queueThreadRunning()) {
-        _serviceLock.lock();
-        if (_packetQueue.size() == 0) {
+        int packetCount = popPackets(packets, batchSize);
+        if (!packetCount) {
 //            LOG(dvb, trace, "service queue thread wait for packet");
-            _queueReadCondition.wait<Poco::FastMutex>(_serviceLock);
-        }
-        TransportStreamPacket* pPacket = _packetQueue.front();
-        _packetQueue.pop();
-        _serviceLock.unlock();
-        if (!pPacket) {
-            LOG(dvb, trace, "service queue thread got NULL packet, end of stream");
-            // null packet means end of stream
-            break;
+            _packetQueue.wait(_packetQueueTimeout);
+            continue;
         }
-        tsPacketCounter++;
-       LOG(dvb, information, "service " + _name + std::string(_clone ? "(clone)" : "")
-               + " write packet no: " + Poco::NumberFormatter::format(tsPacketCounter)
-               + ", queue size: " + Poco::NumberFormatter::format(_packetQueue.size())
-               + ", pid: " + Poco::NumberFormatter::format(pPacket->getPacketIdentifier()));
-
-        if (!(tsPacketCounter & 0x7f)) {
-//        if (t.elapsed() % 100000 == 0) { // PAT has 15,000 bps, that's 9 PAT packets per second (let's make 10)
-            // inject PAT packet
-            _pPatTsPacket->setContinuityCounter(continuityCounter);
-            continuityCounter++;
-            continuityCounter %= 16;
-            _byteQueue.write((char*)_pPatTsPacket->getData(), TransportStreamPacket::Size);
+        packetCount = applyOverflowPolicy(packets, packetCount);
+        for (int i = 0; i < packetCount; ++i) {
+            TransportStreamPacket* pPacket = packets[i];
+            tsPacketCounter++;
+//            LOG(dvb, information, "service " + _name + std::string(_clone ? "(clone)" : "")
+//                    + " write packet no: " + Poco::NumberFormatter::format(tsPacketCounter)
+//                    + ", queue size: " + Poco::NumberFormatter::format(_packetQueue.size())
+//                    + ", pid: " + Poco::NumberFormatter::format(pPacket->getPacketIdentifier()));
+
+            if (_overflowPolicy == OverflowDropNewest) {
+                // never block on a slow consumer, drop what doesn't fit into the byte queue
+                if (injectPat()) {
+                    _byteQueue.tryWrite((char*)_pPatTsPacket->getData(), TransportStreamPacket::Size);
+                }
+                if (!_byteQueue.tryWrite((char*)pPacket->getData(), TransportStreamPacket::Size)) {
+                    _overflowDropped++;
+                }
+            }
+            else {
+                if (injectPat()) {
+                    _byteQueue.write((char*)_pPatTsPacket->getData(), TransportStreamPacket::Size);
+                }
+                _byteQueue.write((char*)pPacket->getData(), TransportStreamPacket::Size);
+            }
+            pPacket->decRefCounter();
         }
-        _byteQueue.write((char*)pPacket->getData(), TransportStreamPacket::Size);
-        pPacket->decRefCounter();
     }
 
     LOG(dvb, information, "service " + _name + " received " + Poco::NumberFormatter::format(tsPacketCounter) + " TS packets in "
             + Poco::NumberFormatter::format(t.elapsed() / 1000) + " msec ("
-            + Poco::NumberFormatter::format((float)tsPacketCounter * 1000 / t.elapsed(), 2) + " packets/msec)");
+            + Poco::NumberFormatter::format((float)tsPacketCounter * 1000 / t.elapsed(), 2) + " packets/msec), dropped " + Poco::NumberFormatter::format(_packetQueueDropped) + " packets");
     LOG(dvb, debug, "service queue thread finished.");
 }
 
 
+int
+Service::patPacketsDue()
+{
+    // number of the next packet, that injectPat() puts a PAT packet in front of
+    return 0x80 - (_patPacketCounter & 0x7f);
+}
+
+
+bool
+Service::injectPat()
+{
+    // PAT has 15,000 bps, that's 9 PAT packets per second (let's make 10)
+    // but for simplicity inject one PAT packet every 128 packets
+    if (++_patPacketCounter & 0x7f) {
+        return false;
+    }
+    _pPatTsPacket->setContinuityCounter(_patContinuityCounter);
+    _patContinuityCounter++;
+    _patContinuityCounter %= 16;
+    return true;
+}
+
+
 }  // namespace Omm
 }  // namespace Dvb
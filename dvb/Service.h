@@ -15,6 +15,8 @@
 
 #include <queue>
 #include <stack>
+#include <atomic>
+#include <sys/uio.h>
 
 #include <Poco/DOM/DOMException.h>
 #include <Poco/DOM/DOMParser.h>
@@ -35,6 +37,7 @@
 #include <Poco/Condition.h>
 
 #include "AvStream.h"
+#include "TransportStream.h"
 
 namespace Omm {
 namespace Dvb {
@@ -42,7 +45,6 @@ namespace Dvb {
 class Transponder;
 class Stream;
 class PatSection;
-class TransportStreamPacket;
 class ByteQueueIStream;
 
 class Service
@@ -87,6 +89,34 @@ public:
     static const std::string StatusRunning;
     static const std::string StatusOffAir;
 
+    /**
+    Overflow policies, applied when a consumer doesn't keep up with the stream:
+    OverflowBlock (default): queue thread blocks on the byte queue until the consumer reads,
+        packets are only discarded when the packet queue is completely full.
+    OverflowDropOldestGop: when the packet queue reaches the high watermark, queued packets
+        are discarded up to the next GOP (random access point) below the low watermark.
+    OverflowDropNewest: packets that don't fit into the byte queue or packet queue are discarded.
+    **/
+    enum OverflowPolicy { OverflowBlock, OverflowDropOldestGop, OverflowDropNewest };
+
+    struct QueueStats
+    {
+        OverflowPolicy  policy;
+        int             size;               // size of packet queue in bytes
+        int             level;              // bytes in packet queue (and byte queue)
+        int             maxLevel;
+        int             highWatermark;
+        int             lowWatermark;
+        Poco::UInt64    highWatermarkHits;  // how often level rose above the high watermark
+        Poco::UInt64    droppedPackets;
+        Poco::UInt64    copiedPackets;      // packets copied out of their block, see queueTsPacket()
+    };
+
+    // queue sizes in bytes per service type, used for services started afterwards. The size
+    // limits the packet slots and the packet blocks that queued packets keep from being reused
+    static void setQueueSizes(int audioSize, int sdVideoSize, int hdVideoSize);
+    static void setOverflowPolicy(OverflowPolicy policy);
+
     Service(Transponder* pTransponder, const std::string& name, unsigned int sid, unsigned int pmtid);
     Service(const Service& service);
     ~Service();
@@ -115,13 +145,44 @@ public:
     void stopStream();
     void flush();
     void queueTsPacket(TransportStreamPacket* pPacket);
+    void signalQueueThread();
     void startQueueThread();
+    // direct read mode: no queue thread and byte queue, the reader takes the packets
+    // out of the packet queue with readSlices()
+    void startDirectRead();
+    /**
+    readSlices() is the zero copy alternative to reading the byte queue. It fills up to count
+    slices with pointers into the packet blocks read by the remux, packets that are adjacent in
+    one block are merged into one slice. The total size is at most size bytes and at most one
+    packet block (128 packets), including an injected PAT packet. A size of one packet is enough,
+    the PAT packet then is returned on its own. Slices stay valid
+    until releaseSlices() or the next call to readSlices(). Blocks until packets are available.
+    Returns the number of slices, or -1 if the service is stopped.
+    **/
+    int readSlices(struct iovec* pSlices, int count, int size);
+    void releaseSlices();
     void stopQueueThread();
     void waitForStopQueueThread();
+    // waits until readers blocked in readSlices() noticed the stop and returned
+    void waitForReaders();
+    void getQueueStats(QueueStats& stats);
 
 private:
     void queueThread();
     bool queueThreadRunning();
+    int patPacketsDue();
+    bool injectPat();
+    void releaseReadPackets();
+    void initQueues();
+    int popPackets(TransportStreamPacket** pPackets, int count);
+    int applyOverflowPolicy(TransportStreamPacket** pPackets, int packetCount);
+    bool isGopStart(TransportStreamPacket* pPacket);
+    void logQueueStats();
+
+    static int                          _audioQueueSize;
+    static int                          _sdVideoQueueSize;
+    static int                          _hdVideoQueueSize;
+    static OverflowPolicy               _defaultOverflowPolicy;
 
     bool                                _clone;
     Transponder*                        _pTransponder;
@@ -142,14 +203,44 @@ private:
     ByteQueueIStream*                   _pIStream;
     PatSection*                         _pPat;
     TransportStreamPacket*              _pPatTsPacket;
-    std::queue<TransportStreamPacket*>  _packetQueue;
+    long unsigned int                   _patPacketCounter;
+    Poco::UInt8                         _patContinuityCounter;
+    // only the remux read thread writes into the packet queue and only the queue thread
+    // (or the reader in direct read mode) reads from it
+    TransportStreamPacketQueue          _packetQueue;
     const int                           _packetQueueTimeout;
-    const int                           _packetQueueSize;
+    Poco::UInt64                        _packetQueueDropped;
+    // each queued packet keeps its whole packet block (128 packets) from being reused, a sparse
+    // pid with one packet per block would pin a block per packet. Blocks are counted per run of
+    // packets from the same block, _pLastQueuedBlock is only touched by the remux read thread,
+    // _pLastPoppedBlock only by the packet queue reader
+    std::atomic<int>                    _pinnedBlocks;
+    int                                 _maxPinnedBlocks;
+    TransportStreamPacketBlock*         _pLastQueuedBlock;
+    TransportStreamPacketBlock*         _pLastPoppedBlock;
+    Poco::UInt64                        _copiedPackets;
+    // overflow policy state and stats, only touched by the packet queue reader
+    OverflowPolicy                      _overflowPolicy;
+    int                                 _highWatermark;
+    int                                 _lowWatermark;
+    bool                                _aboveHighWatermark;
+    bool                                _droppingGop;
+    Poco::UInt16                        _gopPid;
+    bool                                _gopPidIsVideo;
+    int                                 _maxLevel;
+    Poco::UInt64                        _highWatermarkHits;
+    Poco::UInt64                        _overflowDropped;
     Poco::Thread*                       _pQueueThread;
     Poco::RunnableAdapter<Service>      _queueThreadRunnable;
     bool                                _queueThreadRunning;
-    Poco::Condition                     _queueReadCondition;
     Poco::FastMutex                     _serviceLock;
+
+    bool                                _directRead;
+    // packets referenced by the slices of the last readSlices(), protected by _readLock
+    std::vector<TransportStreamPacket*> _readPackets;
+    Poco::FastMutex                     _readLock;
+    // readers inside readSlices(), including those waiting for _readLock
+    std::atomic<int>                    _activeReaders;
 };
 
 }  // namespace Omm
@@ -13,7 +13,12 @@
 #include <vector>
 #include <Poco/Types.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
 
+#include "Log.h"
 #include "Stream.h"
 #include "TransportStream.h"
 
@@ -21,11 +26,14 @@ namespace Omm {
 namespace Dvb {
 
 
-const int TransportStreamPacketBlock::SizeInPackets = 1;
+// one block is read from the dvr device with one read(), so this is the maximum number
+// of packets that can be read per syscall
+const int TransportStreamPacketBlock::SizeInPackets = 128;
 const int TransportStreamPacketBlock::Size = SizeInPackets * TransportStreamPacket::Size;
 
 TransportStreamPacketBlock::TransportStreamPacketBlock() :
 _packetIndex(0),
+_packetCount(0),
 _refCounter(1)
 {
     _pPacketData = new Poco::UInt8[TransportStreamPacketBlock::Size];
@@ -40,14 +48,14 @@ _refCounter(1)
 
 TransportStreamPacketBlock::~TransportStreamPacketBlock()
 {
-    delete _pPacketData;
+    delete [] _pPacketData;
 }
 
 
 TransportStreamPacket*
 TransportStreamPacketBlock::getPacket()
 {
-    if (_packetIndex < SizeInPackets) {
+    if (_packetIndex < _packetCount) {
 //        LOG(dvb, debug, "get packet number: " + Poco::NumberFormatter::format(_packetIndex));
         return _packetBlock[_packetIndex++];
     }
@@ -57,6 +65,124 @@ TransportStreamPacketBlock::getPacket()
 }
 
 
+TransportStreamPacketQueue::TransportStreamPacketQueue(int size) :
+_ring(0),
+_head(0),
+_tail(0),
+_waiting(false)
+{
+    resize(size);
+    _eventFd = ::eventfd(0, EFD_NONBLOCK);
+    if (_eventFd == -1) {
+        LOG(dvb, error, "packet queue failed to create eventfd: " + std::string(strerror(errno)));
+    }
+}
+
+
+TransportStreamPacketQueue::~TransportStreamPacketQueue()
+{
+    if (_eventFd != -1) {
+        ::close(_eventFd);
+    }
+    delete [] _ring;
+}
+
+
+void
+TransportStreamPacketQueue::resize(int size)
+{
+    delete [] _ring;
+    _capacity = 1;
+    while (_capacity < size) {
+        _capacity <<= 1;
+    }
+    _mask = _capacity - 1;
+    _ring = new TransportStreamPacket*[_capacity];
+    _head.store(0);
+    _tail.store(0);
+}
+
+
+int
+TransportStreamPacketQueue::size() const
+{
+    return (_tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire)) & _mask;
+}
+
+
+bool
+TransportStreamPacketQueue::empty() const
+{
+    return _head.load(std::memory_order_acquire) == _tail.load(std::memory_order_acquire);
+}
+
+
+bool
+TransportStreamPacketQueue::push(TransportStreamPacket* pPacket)
+{
+    // one slot is kept free to distinguish a full from an empty queue
+    int tail = _tail.load(std::memory_order_relaxed);
+    int next = (tail + 1) & _mask;
+    if (next == _head.load(std::memory_order_acquire)) {
+        return false;
+    }
+    _ring[tail] = pPacket;
+    _tail.store(next, std::memory_order_release);
+    return true;
+}
+
+
+void
+TransportStreamPacketQueue::signal(bool force)
+{
+    // only wake up the consumer if it went to sleep, otherwise it picks up
+    // the new packets with its next pop() anyway
+    if ((_waiting.exchange(false) || force) && _eventFd != -1) {
+        Poco::UInt64 one = 1;
+        if (::write(_eventFd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+            LOG(dvb, error, "packet queue failed to signal consumer: " + std::string(strerror(errno)));
+        }
+    }
+}
+
+
+int
+TransportStreamPacketQueue::pop(TransportStreamPacket** pPackets, int count)
+{
+    int head = _head.load(std::memory_order_relaxed);
+    int tail = _tail.load(std::memory_order_acquire);
+    int num = 0;
+    while (head != tail && num < count) {
+        pPackets[num++] = _ring[head];
+        head = (head + 1) & _mask;
+    }
+    _head.store(head, std::memory_order_release);
+    return num;
+}
+
+
+void
+TransportStreamPacketQueue::wait(int timeout)
+{
+    _waiting.store(true);
+    // recheck after announcing to wait, the producer may have pushed in between
+    if (!empty() || _eventFd == -1) {
+        _waiting.store(false);
+        return;
+    }
+    struct pollfd fileDescPoll;
+    fileDescPoll.fd = _eventFd;
+    fileDescPoll.events = POLLIN;
+    if (::poll(&fileDescPoll, 1, timeout) > 0) {
+        Poco::UInt64 count;
+        if (::read(_eventFd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+            LOG(dvb, error, "packet queue failed to read eventfd: " + std::string(strerror(errno)));
+        }
+    }
+    _waiting.store(false);
+}
+
+
 const Poco::UInt8 TransportStreamPacket::SyncByte = 0x47;
 const int TransportStreamPacket::Size = 188;
 const int TransportStreamPacket::HeaderSize = 4;
@@ -127,6 +253,13 @@ TransportStreamPacket::setTransportPriority(bool high)
 }
 
 
+bool
+TransportStreamPacket::getPayloadUnitStartIndicator()
+{
+    return getValue<Poco::UInt8>(9, 1);
+}
+
+
 Poco::UInt16
 TransportStreamPacket::getPacketIdentifier()
 {
@@ -193,6 +326,14 @@ TransportStreamPacket::setDiscontinuityIndicator(bool discontinuity)
 }
 
 
+bool
+TransportStreamPacket::getRandomAccessIndicator()
+{
+    // adaption field must be present and not empty
+    return (getValue<Poco::UInt8>(26, 2) & 0x02) && getValue<Poco::UInt8>(32, 8) && getValue<Poco::UInt8>(41, 1);
+}
+
+
 void
 TransportStreamPacket::setRandomAccessIndicator(bool randomAccess)
 {
@@ -18,6 +18,8 @@
 #include <Poco/ScopedLock.h>
 #include "Poco/AtomicCounter.h"
 
+#include <atomic>
+
 #include "DvbUtil.h"
 
 
@@ -40,6 +42,9 @@ public:
 
     Poco::UInt8* getPacketData() { return _pPacketData; }
     TransportStreamPacket* getPacket();
+    int getPacketCount() { return _packetCount; }
+    // number of valid packets at the start of the block, set after reading the block
+    void setPacketCount(int packetCount) { _packetCount = packetCount; }
 
     virtual void free() {}
 
@@ -64,10 +69,50 @@ private:
     std::vector<TransportStreamPacket*>     _packetBlock;
     Poco::UInt8*                            _pPacketData;
     int                                     _packetIndex;
+    int                                     _packetCount;
     Poco::AtomicCounter                     _refCounter;
 };
 
 
+/**
+class TransportStreamPacketQueue - bounded lock-free queue of TS packets with exactly
+one producer thread (the remux read thread) and one consumer thread (the service
+queue thread). The consumer sleeps on an eventfd, which the producer only signals
+once per batch of packets and only if the consumer is actually waiting.
+**/
+class TransportStreamPacketQueue
+{
+public:
+    // size is rounded up to the next power of two
+    TransportStreamPacketQueue(int size);
+    ~TransportStreamPacketQueue();
+
+    int size() const;
+    int capacity() const { return _capacity; }
+    bool empty() const;
+    // drops all queued packets without releasing them, only call when producer and consumer are idle
+    void resize(int size);
+
+    // producer side, push() returns false if the queue is full
+    bool push(TransportStreamPacket* pPacket);
+    void signal(bool force = false);
+
+    // consumer side, pop() returns the number of packets written into pPackets
+    int pop(TransportStreamPacket** pPackets, int count);
+    void wait(int timeout);
+
+private:
+    TransportStreamPacket**         _ring;
+    int                             _capacity;
+    int                             _mask;
+    int                             _eventFd;
+    // head is only written by the consumer, tail only by the producer
+    alignas(64) std::atomic<int>    _head;
+    alignas(64) std::atomic<int>    _tail;
+    alignas(64) std::atomic<bool>   _waiting;
+};
+
+
 class TransportStreamPacket : public BitField
 {
     friend class TransportStreamPacketBlock;
@@ -92,6 +137,7 @@ public:
     void setTransportErrorIndicator(bool uncorrectableError);
     void setPayloadUnitStartIndicator(bool PesOrPsi);
     void setTransportPriority(bool high);
+    bool getPayloadUnitStartIndicator();
     Poco::UInt16 getPacketIdentifier();
     void setPacketIdentifier(Poco::UInt16 pid);
     void setScramblingControl(Poco::UInt8 scramble);
@@ -103,6 +149,7 @@ public:
     void setAdaptionFieldLength(Poco::UInt8 length);
     void clearAllAdaptionFieldFlags();
     void setDiscontinuityIndicator(bool discontinuity);
+    bool getRandomAccessIndicator();
     void setRandomAccessIndicator(bool randomAccess);
     void setElementaryStreamPriorityIndicator(bool high);
     void setPcrFlag(bool containsPcr);
@@ -114,6 +161,9 @@ public:
     void setSpliceCountdown(Poco::UInt8 countdown);
     void setStuffingBytes(int count);
 
+    // block that holds the packet data, 0 if the packet owns its data
+    TransportStreamPacketBlock* getPacketBlock() const { return _pPacketBlock; }
+
     void incRefCounter() const
     {
         if (_pPacketBlock) {
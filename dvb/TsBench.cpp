@@ -0,0 +1,763 @@
+/***************************************************************************|
+|  OMM - Open Multimedia                                                    |
+|                                                                           |
+|  Copyright (C) 2009, 2010, 2011, 2012, 2022                               |
+|  Jörg Bakker                                                              |
+|                                                                           |
+|  This file is part of OMM.                                                |
+|                                                                           |
+|  OMM is free software: you can redistribute it and/or modify              |
+|  it under the terms of the MIT License                                    |
+ ***************************************************************************/
+
+/**
+tsbench - throughput and latency benchmark of the TS remux path of libommdvb.
+
+A transport stream (synthetic, or a recorded file) is held in memory and written by a
+producer thread into a fifo, that is replayed by a loopback adapter (see Loopback.h).
+So the whole path of dvr device, Remux, Service queues and readers is measured:
+dvb_read_stream() for direct read mode, or Device::getStream() for the service queue
+thread and ByteQueue. The producer stamps each packet with the time it is written,
+consumers compute the latency of each packet they read.
+
+Each scenario reports packets/sec and bytes/sec read by all consumers, packet loss,
+p50/p99 latency, heap allocations per packet read and CPU per service. CPU includes
+the emulated adapter, consumers and all threads of the remux path, but not the producer.
+tsbench exits with 1 if a scenario read no packets, or bad packets. Empty direct reads
+count as bad packets, as dvb_read_stream() blocks until packets are available.
+**/
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <new>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+#include <Poco/Thread.h>
+#include <Poco/Runnable.h>
+#include <Poco/NumberFormatter.h>
+#include <Poco/StringTokenizer.h>
+#include <Poco/NumberParser.h>
+
+#include "Log.h"
+#include "Device.h"
+#include "Transponder.h"
+#include "Frontend.h"
+#include "Loopback.h"
+#include "TransportStream.h"
+#include "dvb.h"
+
+
+// count all heap allocations of the process, including the ones in libommdvb
+static std::atomic<unsigned long> allocCount(0);
+
+void*
+operator new(std::size_t size)
+{
+    allocCount.fetch_add(1, std::memory_order_relaxed);
+    void* p = std::malloc(size ? size : 1);
+    if (!p) {
+        throw std::bad_alloc();
+    }
+    return p;
+}
+
+
+void
+operator delete(void* p) noexcept
+{
+    std::free(p);
+}
+
+
+static const int PacketSize = 188;
+static const int MaxServiceCount = 16;
+// stamp at the end of each packet: magic and time of writing into the adapter
+static const int StampOffset = PacketSize - 12;
+static const Poco::UInt32 StampMagic = 0x4f4d4d42;
+
+
+static Poco::UInt64
+monotonicTime()
+{
+    // nsec
+    struct timespec ts;
+    ::clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (Poco::UInt64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static Poco::UInt64
+cpuTime(clockid_t clockId)
+{
+    // nsec
+    struct timespec ts;
+    ::clock_gettime(clockId, &ts);
+    return (Poco::UInt64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static Poco::UInt16
+packetPid(const Poco::UInt8* pPacket)
+{
+    return ((pPacket[1] & 0x1f) << 8) | pPacket[2];
+}
+
+
+struct BenchService
+{
+    std::string                 name;
+    std::vector<Poco::UInt16>   pids;
+};
+
+
+class LatencyHistogram
+{
+public:
+    // 1 usec resolution below 1 msec, 100 usec resolution below 100 msec, one overflow bucket
+    enum { FineBuckets = 1000, CoarseBuckets = 990, Buckets = FineBuckets + CoarseBuckets + 1 };
+
+    LatencyHistogram() { clear(); }
+
+    void clear()
+    {
+        ::memset(_buckets, 0, sizeof(_buckets));
+        _count = 0;
+        _max = 0;
+    }
+
+    void add(Poco::UInt64 usec)
+    {
+        if (usec < FineBuckets) {
+            _buckets[usec]++;
+        }
+        else if (usec < 100000) {
+            _buckets[FineBuckets + (usec - 1000) / 100]++;
+        }
+        else {
+            _buckets[Buckets - 1]++;
+        }
+        _max = std::max(_max, usec);
+        _count++;
+    }
+
+    void merge(const LatencyHistogram& histogram)
+    {
+        for (int i = 0; i < Buckets; ++i) {
+            _buckets[i] += histogram._buckets[i];
+        }
+        _count += histogram._count;
+        _max = std::max(_max, histogram._max);
+    }
+
+    Poco::UInt64 percentile(float percent) const
+    {
+        Poco::UInt64 rank = _count * percent / 100.0;
+        Poco::UInt64 count = 0;
+        for (int i = 0; i < Buckets; ++i) {
+            count += _buckets[i];
+            if (count > rank) {
+                if (i < FineBuckets) {
+                    return i;
+                }
+                else if (i < Buckets - 1) {
+                    return 1000 + (i - FineBuckets) * 100;
+                }
+                break;
+            }
+        }
+        return _max;
+    }
+
+    Poco::UInt64 count() const { return _count; }
+
+private:
+    Poco::UInt64    _buckets[Buckets];
+    Poco::UInt64    _count;
+    Poco::UInt64    _max;
+};
+
+
+class BenchProducer : public Poco::Runnable
+{
+public:
+    BenchProducer(int fileDesc, std::vector<Poco::UInt8>& stream, int packetRate) :
+    _fileDesc(fileDesc),
+    _stream(stream),
+    _packetRate(packetRate),
+    _clockId(CLOCK_MONOTONIC),
+    _running(true),
+    _packetsWritten(0)
+    {
+        for (int pid = 0; pid < 8192; ++pid) {
+            _pidPackets[pid].store(0);
+        }
+    }
+
+    void run()
+    {
+        ::pthread_getcpuclockid(::pthread_self(), &_clockId);
+        // chunks of the size of one dvr packet block
+        const int chunkPackets = 128;
+        const int packetCount = _stream.size() / PacketSize;
+        Poco::UInt64 startTime = monotonicTime();
+        Poco::UInt64 packetsWritten = 0;
+        int packetIndex = 0;
+        while (_running.load(std::memory_order_relaxed)) {
+            int chunkSize = std::min(chunkPackets, packetCount - packetIndex);
+            Poco::UInt8* pChunk = &_stream[packetIndex * PacketSize];
+            Poco::UInt64 now = monotonicTime();
+            for (int i = 0; i < chunkSize; ++i) {
+                Poco::UInt8* pPacket = pChunk + i * PacketSize;
+                ::memcpy(pPacket + StampOffset, &StampMagic, sizeof(StampMagic));
+                ::memcpy(pPacket + StampOffset + sizeof(StampMagic), &now, sizeof(now));
+                std::atomic<Poco::UInt64>& pidPackets = _pidPackets[packetPid(pPacket)];
+                // only written by this thread, no need for an atomic increment
+                pidPackets.store(pidPackets.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            }
+            int bytes = chunkSize * PacketSize;
+            int bytesWritten = 0;
+            while (bytesWritten < bytes) {
+                int res = ::write(_fileDesc, pChunk + bytesWritten, bytes - bytesWritten);
+                if (res == -1) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    LOG(dvb, error, "tsbench producer failed to write: " + std::string(strerror(errno)));
+                    return;
+                }
+                bytesWritten += res;
+            }
+            packetIndex = (packetIndex + chunkSize) % packetCount;
+            packetsWritten += chunkSize;
+            _packetsWritten.store(packetsWritten, std::memory_order_relaxed);
+            if (_packetRate) {
+                Poco::Int64 ahead = (Poco::Int64)(packetsWritten * 1000000000 / _packetRate) - (Poco::Int64)(monotonicTime() - startTime);
+                if (ahead > 0) {
+                    ::usleep(ahead / 1000);
+                }
+            }
+        }
+    }
+
+    void stop() { _running.store(false); }
+    Poco::UInt64 cpuTime() { return ::cpuTime(_clockId); }
+    Poco::UInt64 packetsWritten() { return _packetsWritten.load(std::memory_order_relaxed); }
+    Poco::UInt64 pidPackets(Poco::UInt16 pid) { return _pidPackets[pid].load(std::memory_order_relaxed); }
+
+private:
+    int                         _fileDesc;
+    std::vector<Poco::UInt8>&   _stream;
+    int                         _packetRate;
+    clockid_t                   _clockId;
+    std::atomic<bool>           _running;
+    std::atomic<Poco::UInt64>   _packetsWritten;
+    std::atomic<Poco::UInt64>   _pidPackets[8192];
+};
+
+
+class BenchConsumer : public Poco::Runnable
+{
+public:
+    enum Mode { ModeRead, ModeStream };
+
+    BenchConsumer(Mode mode, const BenchService& service, int readPackets) :
+    _mode(mode),
+    _service(service),
+    _pStream(0),
+    _pIStream(0),
+    _running(true),
+    _measuring(false),
+    _packets(0),
+    _bytes(0),
+    _badPackets(0)
+    {
+        // direct read returns at most one packet block, stream reads block until the buffer is full
+        _bufSize = (mode == ModeRead ? readPackets : 16) * PacketSize;
+        _pBuf = new char[_bufSize];
+    }
+
+    ~BenchConsumer()
+    {
+        delete [] _pBuf;
+    }
+
+    bool open()
+    {
+        if (_mode == ModeRead) {
+            _pStream = dvb_stream(_service.name.c_str());
+            return _pStream;
+        }
+        else {
+            _pIStream = Omm::Dvb::Device::instance()->getStream(_service.name);
+            return _pIStream;
+        }
+    }
+
+    void close()
+    {
+        if (_pStream) {
+            dvb_free_stream(_pStream);
+            _pStream = 0;
+        }
+        if (_pIStream) {
+            Omm::Dvb::Device::instance()->freeStream(_pIStream);
+            _pIStream = 0;
+        }
+    }
+
+    void run()
+    {
+        while (_running.load(std::memory_order_relaxed)) {
+            int bytes;
+            if (_mode == ModeRead) {
+                bytes = dvb_read_stream(_pStream, _pBuf, _bufSize);
+                if (bytes < 0) {
+                    break;
+                }
+                // the read blocks until packets are available, an empty read is counted as bad packet
+                if (!bytes && _measuring.load(std::memory_order_relaxed)) {
+                    _badPackets++;
+                }
+            }
+            else {
+                _pIStream->read(_pBuf, _bufSize);
+                bytes = _pIStream->gcount();
+                if (!bytes && !_pIStream->good()) {
+                    break;
+                }
+            }
+            if (_measuring.load(std::memory_order_relaxed)) {
+                measure(bytes);
+            }
+        }
+    }
+
+    void stop() { _running.store(false); }
+    void setMeasuring(bool measuring) { _measuring.store(measuring); }
+    const BenchService& getService() { return _service; }
+    Poco::UInt64 packets() { return _packets.load(std::memory_order_relaxed); }
+    Poco::UInt64 bytes() { return _bytes.load(std::memory_order_relaxed); }
+    Poco::UInt64 badPackets() { return _badPackets; }
+    const LatencyHistogram& latency() { return _latency; }
+
+private:
+    void measure(int bytes)
+    {
+        Poco::UInt64 now = monotonicTime();
+        Poco::UInt64 packets = 0;
+        for (int offset = 0; offset + PacketSize <= bytes; offset += PacketSize) {
+            const Poco::UInt8* pPacket = (const Poco::UInt8*)_pBuf + offset;
+            if (pPacket[0] != Omm::Dvb::TransportStreamPacket::SyncByte) {
+                _badPackets++;
+                continue;
+            }
+            // PAT is injected by the service, not written by the producer
+            if (packetPid(pPacket) == 0) {
+                continue;
+            }
+            packets++;
+            Poco::UInt32 magic;
+            Poco::UInt64 stamp;
+            ::memcpy(&magic, pPacket + StampOffset, sizeof(magic));
+            ::memcpy(&stamp, pPacket + StampOffset + sizeof(magic), sizeof(stamp));
+            if (magic != StampMagic || stamp > now) {
+                _badPackets++;
+                continue;
+            }
+            _latency.add((now - stamp) / 1000);
+        }
+        _packets.fetch_add(packets, std::memory_order_relaxed);
+        _bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    Mode                        _mode;
+    BenchService                _service;
+    DvbStream*                  _pStream;
+    std::istream*               _pIStream;
+    char*                       _pBuf;
+    int                         _bufSize;
+    std::atomic<bool>           _running;
+    std::atomic<bool>           _measuring;
+    std::atomic<Poco::UInt64>   _packets;
+    std::atomic<Poco::UInt64>   _bytes;
+    Poco::UInt64                _badPackets;
+    LatencyHistogram            _latency;
+};
+
+
+static void
+putPacketHeader(Poco::UInt8* pPacket, Poco::UInt16 pid, bool unitStart, Poco::UInt8& continuityCounter)
+{
+    pPacket[0] = Omm::Dvb::TransportStreamPacket::SyncByte;
+    pPacket[1] = (unitStart ? 0x40 : 0x00) | (pid >> 8);
+    pPacket[2] = pid & 0xff;
+    pPacket[3] = 0x10 | (continuityCounter++ & 0x0f);
+}
+
+
+static void
+createSyntheticStream(std::vector<Poco::UInt8>& stream, std::vector<BenchService>& services)
+{
+    // multiplex of 16 SD services, each with 15 video packets for one audio packet, and some
+    // null packets. Per pid packet counts are a multiple of 16, so that the continuity
+    // counters are continuous when the stream is repeated.
+    const int cycles = 64;
+    const int videoPackets = 15;
+    const int nullPackets = 16;
+    Poco::UInt8 continuityCounter[8192];
+    ::memset(continuityCounter, 0, sizeof(continuityCounter));
+
+    for (int s = 0; s < MaxServiceCount; ++s) {
+        BenchService service;
+        service.name = "tsbench" + Poco::NumberFormatter::format(s);
+        service.pids.push_back(0x100 + s * 0x10);
+        service.pids.push_back(0x101 + s * 0x10);
+        services.push_back(service);
+    }
+    stream.assign(cycles * (MaxServiceCount * (videoPackets + 1) + nullPackets) * PacketSize, 0xff);
+    Poco::UInt8* pPacket = &stream[0];
+    for (int c = 0; c < cycles; ++c) {
+        for (int s = 0; s < MaxServiceCount; ++s) {
+            for (int v = 0; v < videoPackets; ++v) {
+                Poco::UInt16 pid = services[s].pids[0];
+                // a GOP every 4 cycles, starting with a random access point
+                bool gopStart = (c % 4 == 0) && (v == 0);
+                putPacketHeader(pPacket, pid, gopStart, continuityCounter[pid]);
+                if (gopStart) {
+                    pPacket[3] |= 0x20;
+                    pPacket[4] = 1;
+                    pPacket[5] = 0x40;
+                }
+                pPacket += PacketSize;
+            }
+            Poco::UInt16 pid = services[s].pids[1];
+            putPacketHeader(pPacket, pid, c % 4 == 0, continuityCounter[pid]);
+            pPacket += PacketSize;
+        }
+        for (int n = 0; n < nullPackets; ++n) {
+            putPacketHeader(pPacket, 0x1fff, false, continuityCounter[0x1fff]);
+            pPacket += PacketSize;
+        }
+    }
+}
+
+
+static bool
+loadRecordedStream(const std::string& fileName, std::vector<Poco::UInt8>& stream, std::vector<BenchService>& services)
+{
+    // one service per pid, most frequent pids first. The end of each packet is overwritten
+    // with the stamp, the stream is only remuxed and not decoded, anyway
+    std::ifstream file(fileName.c_str(), std::ios::binary);
+    if (!file) {
+        std::cerr << "tsbench: failed to open " << fileName << std::endl;
+        return false;
+    }
+    std::vector<Poco::UInt8> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    Poco::UInt64 pidPackets[8192];
+    ::memset(pidPackets, 0, sizeof(pidPackets));
+    size_t pos = 0;
+    while (pos + PacketSize <= data.size()) {
+        if (data[pos] != Omm::Dvb::TransportStreamPacket::SyncByte
+                || (pos + PacketSize < data.size() && data[pos + PacketSize] != Omm::Dvb::TransportStreamPacket::SyncByte)) {
+            pos++;
+            continue;
+        }
+        stream.insert(stream.end(), data.begin() + pos, data.begin() + pos + PacketSize);
+        pidPackets[packetPid(&data[pos])]++;
+        pos += PacketSize;
+    }
+    std::vector<std::pair<Poco::UInt64, Poco::UInt16> > pids;
+    // skip PSI tables and null packets
+    for (int pid = 0x20; pid < 0x1fff; ++pid) {
+        if (pidPackets[pid]) {
+            pids.push_back(std::make_pair(pidPackets[pid], (Poco::UInt16)pid));
+        }
+    }
+    if (pids.empty()) {
+        std::cerr << "tsbench: no elementary streams found in " << fileName << std::endl;
+        return false;
+    }
+    std::sort(pids.rbegin(), pids.rend());
+    for (int s = 0; s < MaxServiceCount; ++s) {
+        BenchService service;
+        service.name = "tsbench" + Poco::NumberFormatter::format(s);
+        service.pids.push_back(pids[s % pids.size()].second);
+        services.push_back(service);
+    }
+    return true;
+}
+
+
+static void
+writeDeviceXml(std::ostream& xml, Omm::Dvb::Adapter* pAdapter, const std::vector<BenchService>& services)
+{
+    xml << "<device><adapter id=\"" << pAdapter->getId() << "\">"
+        << "<frontend name=\"" << Omm::Dvb::LoopbackAdapter::FrontendName << "\" type=\"dvb-t\">"
+        << "<transponder frequency=\"474000000\" tsid=\"1\">";
+    for (int s = 0; s < services.size(); ++s) {
+        xml << "<service name=\"" << services[s].name << "\" sid=\"" << s + 1 << "\" pmtid=\"" << 0x1000 + s << "\">";
+        for (int p = 0; p < services[s].pids.size(); ++p) {
+            xml << "<stream type=\"" << (p ? "audio" : "video") << "\" pid=\"" << services[s].pids[p] << "\"/>";
+        }
+        xml << "<type>DigitalTelevision</type><status>Running</status><scrambled>false</scrambled></service>";
+    }
+    xml << "</transponder></frontend></adapter></device>";
+}
+
+
+// returns false if no packets were read or bad packets were read
+static bool
+runScenario(BenchConsumer::Mode mode, int serviceCount, bool clones, const std::vector<BenchService>& services,
+        BenchProducer& producer, int warmup, int duration, int readPackets)
+{
+    std::vector<BenchConsumer*> consumers;
+    std::vector<Poco::Thread*> threads;
+    for (int i = 0; i < serviceCount; ++i) {
+        BenchConsumer* pConsumer = new BenchConsumer(mode, services[clones ? 0 : i], readPackets);
+        if (!pConsumer->open()) {
+            std::cerr << "tsbench: failed to open stream of service " << pConsumer->getService().name << std::endl;
+            delete pConsumer;
+            continue;
+        }
+        consumers.push_back(pConsumer);
+        threads.push_back(new Poco::Thread);
+        threads.back()->start(*pConsumer);
+    }
+    if (consumers.empty()) {
+        return false;
+    }
+
+    Poco::Thread::sleep(warmup * 1000);
+    std::vector<Poco::UInt64> pidPackets0(8192);
+    for (int pid = 0; pid < 8192; ++pid) {
+        pidPackets0[pid] = producer.pidPackets(pid);
+    }
+    struct rusage usage0;
+    ::getrusage(RUSAGE_SELF, &usage0);
+    Poco::UInt64 producerCpu0 = producer.cpuTime();
+    Poco::UInt64 packetsWritten0 = producer.packetsWritten();
+    unsigned long allocs0 = allocCount.load();
+    Poco::UInt64 time0 = monotonicTime();
+    for (int i = 0; i < consumers.size(); ++i) {
+        consumers[i]->setMeasuring(true);
+    }
+
+    Poco::Thread::sleep(duration * 1000);
+
+    for (int i = 0; i < consumers.size(); ++i) {
+        consumers[i]->setMeasuring(false);
+    }
+    Poco::UInt64 time1 = monotonicTime();
+    unsigned long allocs1 = allocCount.load();
+    Poco::UInt64 packetsWritten1 = producer.packetsWritten();
+    Poco::UInt64 producerCpu1 = producer.cpuTime();
+    struct rusage usage1;
+    ::getrusage(RUSAGE_SELF, &usage1);
+
+    for (int i = 0; i < consumers.size(); ++i) {
+        consumers[i]->stop();
+        if (!threads[i]->tryJoin(5000)) {
+            std::cerr << "tsbench: failed to join consumer of service " << consumers[i]->getService().name << std::endl;
+        }
+        consumers[i]->close();
+    }
+
+    Poco::UInt64 packets = 0;
+    Poco::UInt64 bytes = 0;
+    Poco::UInt64 expectedPackets = 0;
+    Poco::UInt64 badPackets = 0;
+    LatencyHistogram latency;
+    for (int i = 0; i < consumers.size(); ++i) {
+        packets += consumers[i]->packets();
+        bytes += consumers[i]->bytes();
+        badPackets += consumers[i]->badPackets();
+        latency.merge(consumers[i]->latency());
+        const std::vector<Poco::UInt16>& pids = consumers[i]->getService().pids;
+        for (int p = 0; p < pids.size(); ++p) {
+            expectedPackets += producer.pidPackets(pids[p]) - pidPackets0[pids[p]];
+        }
+        delete consumers[i];
+        delete threads[i];
+    }
+
+    double seconds = (time1 - time0) / 1e9;
+    double cpu = (usage1.ru_utime.tv_sec - usage0.ru_utime.tv_sec + usage1.ru_stime.tv_sec - usage0.ru_stime.tv_sec)
+            + (usage1.ru_utime.tv_usec - usage0.ru_utime.tv_usec + usage1.ru_stime.tv_usec - usage0.ru_stime.tv_usec) / 1e6
+            - (producerCpu1 - producerCpu0) / 1e9;
+    double loss = expectedPackets ? 100.0 * (1.0 - (double)packets / expectedPackets) : 0.0;
+    std::printf("%-6s %8d %6s %11.0f %11.0f %9.2f %6.2f %8llu %8llu %10.3f %8.1f %6llu\n",
+            mode == BenchConsumer::ModeRead ? "read" : "stream",
+            (int)consumers.size(),
+            clones ? "yes" : "no",
+            (packetsWritten1 - packetsWritten0) / seconds,
+            packets / seconds,
+            bytes / seconds / 1e6,
+            std::max(loss, 0.0),
+            (unsigned long long)latency.percentile(50),
+            (unsigned long long)latency.percentile(99),
+            packets ? (double)(allocs1 - allocs0) / packets : 0.0,
+            100.0 * cpu / seconds / consumers.size(),
+            (unsigned long long)badPackets);
+    std::fflush(stdout);
+    return packets && !badPackets;
+}
+
+
+static void
+usage()
+{
+    std::cerr << "usage: tsbench [-d <seconds>] [-w <warmup seconds>] [-r <packets/sec>] [-m read|stream]" << std::endl
+              << "               [-n <service counts>] [-p block|drop-oldest-gop|drop-newest] [-f <recorded ts file>]" << std::endl
+              << "               [-s <read size in packets>]" << std::endl
+              << "  -d  measured duration of each scenario (default 5)" << std::endl
+              << "  -w  warmup before each scenario is measured (default 1)" << std::endl
+              << "  -r  packets/sec written into the adapter, 0 is as fast as possible (default 0)" << std::endl
+              << "  -m  only read with dvb_read_stream() or only with the service stream (default both)" << std::endl
+              << "  -n  comma separated numbers of concurrent services and clones (default 1,4,16)" << std::endl
+              << "  -p  overflow policy of the service queues (default block)" << std::endl
+              << "  -f  use recorded stream instead of the synthetic multiplex" << std::endl
+              << "  -s  buffer size of dvb_read_stream() in packets, 1 to 128 (default 128)" << std::endl;
+}
+
+
+int
+main(int argc, char** argv)
+{
+    int duration = 5;
+    int warmup = 1;
+    int packetRate = 0;
+    std::string modes = "read,stream";
+    std::string serviceCounts = "1,4,16";
+    std::string recordedFile;
+    int readPackets = Omm::Dvb::TransportStreamPacketBlock::SizeInPackets;
+
+    int opt;
+    try {
+        while ((opt = ::getopt(argc, argv, "d:w:r:m:n:p:f:s:h")) != -1) {
+            switch (opt) {
+                case 'd':
+                    duration = Poco::NumberParser::parse(optarg);
+                    break;
+                case 'w':
+                    warmup = Poco::NumberParser::parse(optarg);
+                    break;
+                case 'r':
+                    packetRate = Poco::NumberParser::parse(optarg);
+                    break;
+                case 'm':
+                    modes = optarg;
+                    break;
+                case 'n':
+                    serviceCounts = optarg;
+                    break;
+                case 'p':
+                    if (dvb_set_overflow_policy(optarg) == -1) {
+                        usage();
+                        return 1;
+                    }
+                    break;
+                case 'f':
+                    recordedFile = optarg;
+                    break;
+                case 's':
+                    readPackets = Poco::NumberParser::parse(optarg);
+                    if (readPackets < 1 || readPackets > Omm::Dvb::TransportStreamPacketBlock::SizeInPackets) {
+                        usage();
+                        return 1;
+                    }
+                    break;
+                default:
+                    usage();
+                    return 1;
+            }
+        }
+    }
+    catch (Poco::Exception& e) {
+        usage();
+        return 1;
+    }
+
+    std::vector<Poco::UInt8> stream;
+    std::vector<BenchService> services;
+    if (recordedFile.length()) {
+        if (!loadRecordedStream(recordedFile, stream, services)) {
+            return 1;
+        }
+    }
+    else {
+        createSyntheticStream(stream, services);
+    }
+
+    std::string fifoName = "/tmp/tsbench-" + Poco::NumberFormatter::format(::getpid()) + ".ts";
+    if (::mkfifo(fifoName.c_str(), 0600) == -1) {
+        std::cerr << "tsbench: failed to create fifo " << fifoName << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+    // opened read-write, so that neither the producer nor the adapter block on open
+    // and the adapter never sees the end of the stream
+    int fifo = ::open(fifoName.c_str(), O_RDWR);
+    if (fifo == -1) {
+        std::cerr << "tsbench: failed to open fifo " << fifoName << ": " << strerror(errno) << std::endl;
+        ::unlink(fifoName.c_str());
+        return 1;
+    }
+
+    Omm::Dvb::Device* pDevice = Omm::Dvb::Device::instance();
+    Omm::Dvb::LoopbackAdapter* pAdapter = pDevice->addLoopbackAdapter(fifoName, Omm::Dvb::Frontend::DVBT);
+    // the producer controls the rate, not the PCR of the stream
+    pAdapter->setPaced(false);
+    std::stringstream deviceXml;
+    writeDeviceXml(deviceXml, pAdapter, services);
+    pDevice->readXml(deviceXml);
+    pDevice->open();
+
+    BenchProducer producer(fifo, stream, packetRate);
+    Poco::Thread producerThread;
+    producerThread.start(producer);
+
+    bool failed = false;
+    std::printf("%-6s %8s %6s %11s %11s %9s %6s %8s %8s %10s %8s %6s\n",
+            "mode", "services", "clones", "in pkt/s", "out pkt/s", "out MB/s", "loss%",
+            "p50 us", "p99 us", "allocs/pkt", "cpu%/svc", "bad");
+    Poco::StringTokenizer modeList(modes, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+    Poco::StringTokenizer countList(serviceCounts, ",", Poco::StringTokenizer::TOK_IGNORE_EMPTY | Poco::StringTokenizer::TOK_TRIM);
+    for (int m = 0; m < modeList.count(); ++m) {
+        BenchConsumer::Mode mode = (modeList[m] == "stream" ? BenchConsumer::ModeStream : BenchConsumer::ModeRead);
+        for (int c = 0; c < countList.count(); ++c) {
+            int serviceCount = 0;
+            if (!Poco::NumberParser::tryParse(countList[c], serviceCount) || serviceCount < 1 || serviceCount > MaxServiceCount) {
+                std::cerr << "tsbench: service count must be between 1 and " << MaxServiceCount << std::endl;
+                continue;
+            }
+            if (!runScenario(mode, serviceCount, false, services, producer, warmup, duration, readPackets)) {
+                failed = true;
+            }
+            if (serviceCount > 1) {
+                if (!runScenario(mode, serviceCount, true, services, producer, warmup, duration, readPackets)) {
+                    failed = true;
+                }
+            }
+        }
+    }
+
+    producer.stop();
+    producerThread.join();
+    pDevice->close();
+    ::unlink(fifoName.c_str());
+    // the replay thread of the adapter is still blocked on the fifo
+    std::fflush(stdout);
+    ::_exit(failed ? 1 : 0);
+}
@@ -12,7 +12,8 @@ const int dvb_transport_stream_packet_size = Omm::Dvb::TransportStreamPacket::Si
 struct DvbStream {
 	Omm::Dvb::Transponder* pTransponder;
 	Omm::Dvb::Service* pService;
-	Omm::AvStream::ByteQueue* pByteQueue;
+	// service started for this stream, a clone of pService if it is already streamed
+	Omm::Dvb::Service* pStreamService;
 };
 
 
@@ -41,6 +42,32 @@ dvb_close()
 }
 
 
+void
+dvb_set_queue_sizes(int radio_size, int sd_size, int hd_size)
+{
+	Omm::Dvb::Service::setQueueSizes(radio_size, sd_size, hd_size);
+}
+
+
+int
+dvb_set_overflow_policy(const char *policy)
+{
+	if (!strcmp(policy, "block")) {
+		Omm::Dvb::Service::setOverflowPolicy(Omm::Dvb::Service::OverflowBlock);
+	}
+	else if (!strcmp(policy, "drop-oldest-gop")) {
+		Omm::Dvb::Service::setOverflowPolicy(Omm::Dvb::Service::OverflowDropOldestGop);
+	}
+	else if (!strcmp(policy, "drop-newest")) {
+		Omm::Dvb::Service::setOverflowPolicy(Omm::Dvb::Service::OverflowDropNewest);
+	}
+	else {
+		return -1;
+	}
+	return 0;
+}
+
+
 DvbStream*
 dvb_stream(const char *service_name)
 {
@@ -59,8 +86,8 @@ dvb_stream(const char *service_name)
 		free(stream);
 		return NULL;
 	}
-	stream->pByteQueue = Omm::Dvb::Device::instance()->getByteQueue(service_name);
-	if (!stream->pByteQueue) {
+	stream->pStreamService = Omm::Dvb::Device::instance()->getPacketStream(service_name);
+	if (!stream->pStreamService) {
 		delete stream->pTransponder;
 		delete stream->pService;
 		free(stream);
@@ -73,10 +100,38 @@ dvb_stream(const char *service_name)
 int
 dvb_read_stream(DvbStream *stream, char *buf, int nbuf)
 {
-	if (!stream->pByteQueue) {
+	struct iovec iov[DVB_MAX_SLICES];
+	int niov = dvb_read_stream_slices(stream, iov, DVB_MAX_SLICES, nbuf);
+	if (niov < 0) {
 		return -1;
 	}
-	return stream->pByteQueue->readSome(buf, nbuf);
+	int bytes = 0;
+	for (int i = 0; i < niov; ++i) {
+		memcpy(buf + bytes, iov[i].iov_base, iov[i].iov_len);
+		bytes += iov[i].iov_len;
+	}
+	dvb_release_stream_slices(stream);
+	return bytes;
+}
+
+
+int
+dvb_read_stream_slices(DvbStream *stream, struct iovec *iov, int niov, int nbuf)
+{
+	if (!stream->pStreamService) {
+		return -1;
+	}
+	return stream->pStreamService->readSlices(iov, niov, nbuf);
+}
+
+
+void
+dvb_release_stream_slices(DvbStream *stream)
+{
+	if (!stream->pStreamService) {
+		return;
+	}
+	stream->pStreamService->releaseSlices();
 }
 
 
@@ -88,6 +143,25 @@ dvb_free_stream(DvbStream *stream)
 	}
 	// delete stream->pTransponder;
 	// delete stream->pService;
-	Omm::Dvb::Device::instance()->stopService(stream->pService);
+	Omm::Dvb::Device::instance()->freePacketStream(stream->pStreamService);
 	free(stream);
 }
+
+
+int
+dvb_stream_stats(DvbStream *stream, DvbStreamStats *stats)
+{
+	if (!stream || !stream->pStreamService) {
+		return -1;
+	}
+	Omm::Dvb::Service::QueueStats queueStats;
+	stream->pStreamService->getQueueStats(queueStats);
+	stats->size = queueStats.size;
+	stats->level = queueStats.level;
+	stats->max_level = queueStats.maxLevel;
+	stats->high_watermark = queueStats.highWatermark;
+	stats->low_watermark = queueStats.lowWatermark;
+	stats->high_watermark_hits = queueStats.highWatermarkHits;
+	stats->dropped_packets = queueStats.droppedPackets;
+	return 0;
+}
@@ -1,21 +1,53 @@
 #ifndef __OMMDVB__
 #define __OMMDVB__
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 extern const int dvb_transport_stream_packet_size;
 
+/* number of slices needed to read a whole packet block plus one PAT packet, as packets
+   of other services are interleaved, each packet may need its own slice */
+#define DVB_MAX_SLICES 130
+
 struct DvbStream;
 
+struct DvbStreamStats {
+	int size;                   /* queue size in bytes */
+	int level;                  /* bytes currently queued */
+	int max_level;
+	int high_watermark;
+	int low_watermark;
+	unsigned long long high_watermark_hits;
+	unsigned long long dropped_packets;
+};
+
 int dvb_init(const char *conf_xml);
 void dvb_open();
 void dvb_close();
 
+/* queue sizes in bytes for radio, SD and HD services started afterwards */
+void dvb_set_queue_sizes(int radio_size, int sd_size, int hd_size);
+/* overflow policy when a reader is too slow: "block" (default), "drop-oldest-gop" or "drop-newest",
+   returns -1 if the policy is unknown */
+int dvb_set_overflow_policy(const char *policy);
+
 struct DvbStream* dvb_stream(const char *service_name);
 int dvb_read_stream(struct DvbStream *stream, char *buf, int nbuf);
+/* zero copy read: iov points into the packet buffers of the stream, they stay valid
+   until dvb_release_stream_slices() or the next read. Returns the number of slices
+   or -1 at end of stream */
+int dvb_read_stream_slices(struct DvbStream *stream, struct iovec *iov, int niov, int nbuf);
+void dvb_release_stream_slices(struct DvbStream *stream);
+/* wakes up readers blocked in dvb_read_stream() or dvb_read_stream_slices(), they return -1,
+   and waits for them before freeing the stream. No read may be started on the stream once
+   dvb_free_stream() is called, callers that read and free from different threads must
+   serialize that themselves */
 void dvb_free_stream(struct DvbStream *stream);
+int dvb_stream_stats(struct DvbStream *stream, struct DvbStreamStats *stats);
 
 #ifdef __cplusplus
 }
@@ -24,6 +24,7 @@
 #include <time.h>  // posix std headers should be included between u.h and libc.h
 #include <errno.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <libc.h>
 #include <fcall.h>
 #include <thread.h>
@@ -57,7 +58,7 @@
 #include <libswresample/swresample.h>
 #include <libavutil/imgutils.h>
 #include <libavutil/time.h>
-#define MAX_AUDIO_FRAME_SIZE 192000
+#include <libavutil/opt.h>
 #endif   /// RENDER_DUMMY
 
 typedef struct RendererCtx
@@ -90,6 +91,8 @@ typedef struct RendererCtx
 	int                server_tid;
 	int                decoder_tid;
 	int                presenter_tid;
+	int                scaler_tid;
+	int                demuxer_tid;
 	int                pause_presenter_thread;
 	Channel           *presq;
 	// Audio output
@@ -101,12 +104,17 @@ typedef struct RendererCtx
 	AVFormatContext   *format_ctx;
 	AVCodecContext    *current_codec_ctx;
 	AVFrame           *decoder_frame;
-	AVPacket          *decoder_packet;
+	// Demuxer
+	Channel           *videopktq;
+	Channel           *audiopktq;
+	Channel           *demuxerq;
+	atomic_int         demuxer_stop;     // Set by the decoder thread, polled by the demuxer thread
+	int                demux_streams;
 	// Audio stream
 	int                audio_stream;
 	AVCodecContext    *audio_ctx;
 	Channel           *audioq;
-	uint8_t            mixed_audio_buf[MAX_AUDIO_FRAME_SIZE];
+	Channel           *samplepool;
 	unsigned int       audio_buf_size;
 	unsigned int       audio_buf_index;
 	int                audio_idx;
@@ -124,10 +132,18 @@ typedef struct RendererCtx
 	AVCodecContext    *video_ctx;
 	Channel           *pictq;
 	struct SwsContext *yuv_ctx;
+	int                yuv_srcw, yuv_srch, yuv_srcfmt, yuv_dstw, yuv_dsth;
+	Channel           *scaleq;
+	Channel           *scalerq;
+	Channel           *framepool;
+	AVFrame          **framepool_frames;
+	int                framepool_size;
 	SDL_AudioSpec      specs;
 	int                video_idx;
 	double             video_pts;
-	uint8_t           *yuvbuffer;
+	Channel           *picpool;
+	AVFrame          **picpool_frames;
+	int                picpool_size;
 	SDL_Rect           blit_copy_rect;
 	AVRational         video_timebase;
 	double             video_tbd;
@@ -135,6 +151,7 @@ typedef struct RendererCtx
 	SDL_Window        *sdl_window;
 	SDL_Renderer      *sdl_renderer;
 	SDL_Texture       *sdl_texture;
+	int                tex_w, tex_h;
 #elif defined RENDER_VLC
 	libvlc_instance_t     *libvlc;
 	libvlc_media_t        *media;
@@ -149,7 +166,13 @@ static RendererCtx rctx;
 /// Environment variables for configuration
 static char *omm_render_fullscreen = "OMM_RENDER_FULLSCREEN";
 static char *omm_render_audiovol = "OMM_RENDER_AUDIOVOL";
+static char *omm_render_decthreads = "OMM_RENDER_DECTHREADS";
+static char *omm_render_decthreadtype = "OMM_RENDER_DECTHREADTYPE";
 static bool fullscreen = false;
+/// Number of video decoder threads, 0 lets the decoder use one thread per core
+static int decoder_threads = 0;
+/// Video decoder threading: DECTHREAD_FRAME, DECTHREAD_SLICE or both
+static int decoder_thread_type = 0;
 
 // State machine
 #define NSTATE 8
@@ -246,6 +269,12 @@ enum
 	CHANGE_STATE,
 };
 
+enum
+{
+	DECTHREAD_FRAME = 1,  // Decode consecutive frames in parallel
+	DECTHREAD_SLICE = 2,  // Decode slices of one frame in parallel
+};
+
 static cmd_func cmds[NCMD] =
 {
 	cmd_put,
@@ -339,6 +368,8 @@ reset_rctx(RendererCtx *rctx, int init)
 		rctx->decoder_tid = 0;
 	}
 	rctx->presenter_tid = 0;
+	rctx->scaler_tid = 0;
+	rctx->demuxer_tid = 0;
 	rctx->pause_presenter_thread = 0;
 	// Presenting
 	rctx->presq = nil;
@@ -353,11 +384,17 @@ reset_rctx(RendererCtx *rctx, int init)
 	rctx->format_ctx = nil;
 	rctx->current_codec_ctx = nil;
 	rctx->decoder_frame = nil;
-	rctx->decoder_packet = nil;
+	// Demuxer
+	rctx->videopktq = nil;
+	rctx->audiopktq = nil;
+	rctx->demuxerq = nil;
+	atomic_init(&rctx->demuxer_stop, 0);
+	rctx->demux_streams = 0;
 	// Audio stream
 	rctx->audio_stream = -1;
 	rctx->audio_ctx = nil;
 	rctx->audioq = nil;
+	rctx->samplepool = nil;
 	rctx->audio_buf_size = 0;
 	rctx->audio_buf_index = 0;
 	rctx->audio_idx = 0;
@@ -375,6 +412,8 @@ reset_rctx(RendererCtx *rctx, int init)
 	if (init) {
 		rctx->sdl_window = nil;
 		rctx->sdl_texture = nil;
+		rctx->tex_w = 0;
+		rctx->tex_h = 0;
 		rctx->sdl_renderer = nil;
 	}
 	rctx->video_stream = -1;
@@ -383,9 +422,21 @@ reset_rctx(RendererCtx *rctx, int init)
 	rctx->video_ctx = nil;
 	rctx->pictq = nil;
 	rctx->yuv_ctx = nil;
+	rctx->yuv_srcw = 0;
+	rctx->yuv_srch = 0;
+	rctx->yuv_srcfmt = AV_PIX_FMT_NONE;
+	rctx->yuv_dstw = 0;
+	rctx->yuv_dsth = 0;
+	rctx->scaleq = nil;
+	rctx->scalerq = nil;
+	rctx->framepool = nil;
+	rctx->framepool_frames = nil;
+	rctx->framepool_size = 0;
 	rctx->video_idx = 0;
 	rctx->video_pts = 0.0;
-	rctx->yuvbuffer = nil;
+	rctx->picpool = nil;
+	rctx->picpool_frames = nil;
+	rctx->picpool_size = 0;
 	if (init) {
 		rctx->w = 0;
 		rctx->h = 0;
@@ -790,6 +841,18 @@ threadmain(int argc, char **argv)
 	if (av && strcmp(av, "PULSE") == 0)
 		cmds[CMD_VOL] = cmd_vol_pulse;
 	LOG("omm render config audio volume channel: %s", av ? "hardware" : "app");
+	char *dt = getenv(omm_render_decthreads);
+	if (dt)
+		decoder_threads = atoi(dt);
+	char *dtt = getenv(omm_render_decthreadtype);
+	if (dtt && strcmp(dtt, "frame") == 0)
+		decoder_thread_type = DECTHREAD_FRAME;
+	else if (dtt && strcmp(dtt, "slice") == 0)
+		decoder_thread_type = DECTHREAD_SLICE;
+	else
+		decoder_thread_type = DECTHREAD_FRAME | DECTHREAD_SLICE;
+	LOG("omm render config decoder threads: %d (%s), type: %s", decoder_threads,
+		decoder_threads ? "fixed" : "auto", dtt ? dtt : "frame and slice");
 	if (init_backend() != 0) {
 		return;
 	}
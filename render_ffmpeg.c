@@ -3,6 +3,8 @@
 
 #define SDL_AUDIO_BUFFER_SIZE 1024
 #define MAX_AUDIOQ_SIZE (5 * 16 * 1024)
+// Sample buffers kept for reuse, more buffers in flight are allocated and freed
+#define AUDIO_SAMPLE_POOL_SIZE 64
 #define MAX_VIDEOQ_SIZE (5 * 256 * 1024)
 // Maximum size of the data read from input for determining the input container format.
 #define AV_FORMAT_MAX_PROBE_SIZE 500000
@@ -14,7 +16,18 @@
 #define AV_NOSYNC_THRESHOLD 1.0
 #define SAMPLE_CORRECTION_PERCENT_MAX 10
 #define AUDIO_DIFF_AVG_NB 20
-#define VIDEO_PICTURE_QUEUE_SIZE 1
+#define VIDEO_PICTURE_QUEUE_SIZE 4
+// Pictures in the queue, plus the one being displayed and the one being scaled
+#define VIDEO_PICTURE_POOL_SIZE (VIDEO_PICTURE_QUEUE_SIZE + 2)
+// Decoded frames waiting for the scaler thread
+#define SCALE_QUEUE_SIZE 2
+// Frames in the scale queue, plus the one being scaled and the one being decoded
+#define SCALE_FRAME_POOL_SIZE (SCALE_QUEUE_SIZE + 2)
+// Max slice threads of the scaler, libswscale >= 6.1 splits the picture into slices
+#define SCALER_MAX_THREADS 4
+// Demuxed packets read ahead per stream, so that the decoder doesn't wait for the 9P reads
+#define VIDEO_PACKET_QUEUE_SIZE 64
+#define AUDIO_PACKET_QUEUE_SIZE 128
 /* #define DEFAULT_AV_SYNC_TYPE AV_SYNC_AUDIO_MASTER */
 #define DEFAULT_AV_SYNC_TYPE AV_SYNC_EXTERNAL_MASTER
 #define avctxBufferSize 8192 * 10
@@ -29,12 +42,15 @@ typedef struct VideoPicture
 	double      pts;
 	int         idx;
 	int         eos;
+	int         stop;
+	int         passthrough;    // frame references the decoder's picture
 } VideoPicture;
 
 typedef struct AudioSample
 {
 	uint8_t	   *sample;
 	int         size;
+	int         capacity;
 	int         idx;
 	double      pts;
 	double      duration;
@@ -65,6 +81,10 @@ struct sample_fmt_entry {
 void send_picture_to_queue(RendererCtx *rctx, VideoPicture *videoPicture);
 void send_sample_to_queue(RendererCtx *rctx, AudioSample *audioSample);
 int  create_yuv_picture_from_frame(RendererCtx *rctx, AVFrame *frame, VideoPicture *videoPicture);
+void release_picture(RendererCtx *rctx, VideoPicture *videoPicture);
+void release_sample(RendererCtx *rctx, AudioSample *audioSample);
+void free_sample_pool(RendererCtx *rctx);
+void free_picture_pool(RendererCtx *rctx);
 int  create_sample_from_frame(RendererCtx *rctx, AVFrame *frame, AudioSample *audioSample);
 int  read_packet(RendererCtx *rctx, AVPacket *packet);
 int  write_packet_to_decoder(RendererCtx *rctx, AVPacket* packet);
@@ -75,6 +95,8 @@ void display_picture(RendererCtx *rctx, VideoPicture *videoPicture);
 int  open_9pconnection(RendererCtx *rctx);
 void close_9pconnection(RendererCtx *rctx);
 void presenter_thread(void *arg);
+void scaler_thread(void *arg);
+void demuxer_thread(void *arg);
 
 int
 clientdial(RendererCtx *rctx)
@@ -311,10 +333,27 @@ open_stream_component(RendererCtx *rctx, int stream_index)
 		LOG("could not copy codec context");
 		return -1;
 	}
+	if (codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) {
+		// Frame threading adds one frame of delay per thread, the decoder is drained at EOF
+		codecCtx->thread_count = decoder_threads;
+		codecCtx->thread_type = 0;
+		if (decoder_thread_type & DECTHREAD_FRAME) {
+			codecCtx->thread_type |= FF_THREAD_FRAME;
+		}
+		if (decoder_thread_type & DECTHREAD_SLICE) {
+			codecCtx->thread_type |= FF_THREAD_SLICE;
+		}
+	}
 	if (avcodec_open2(codecCtx, codec, nil) < 0) {
 		LOG("could not open codec");
 		return -1;
 	}
+	if (codecCtx->codec_type == AVMEDIA_TYPE_VIDEO) {
+		LOG("video decoder threads: %d, frame threading: %s, slice threading: %s",
+			codecCtx->thread_count,
+			codecCtx->active_thread_type & FF_THREAD_FRAME ? "on" : "off",
+			codecCtx->active_thread_type & FF_THREAD_SLICE ? "on" : "off");
+	}
 	switch (codecCtx->codec_type) {
 		case AVMEDIA_TYPE_AUDIO:
 		{
@@ -324,6 +363,7 @@ open_stream_component(RendererCtx *rctx, int stream_index)
 			rctx->audio_buf_size = 0;
 			rctx->audio_buf_index = 0;
 			rctx->audioq = chancreate(sizeof(AudioSample), MAX_AUDIOQ_SIZE);
+			rctx->samplepool = chancreate(sizeof(AudioSample), AUDIO_SAMPLE_POOL_SIZE);
 			rctx->presenter_tid = THREAD_CREATE(presenter_thread, rctx, THREAD_STACK_SIZE);
 			rctx->presq = chancreate(sizeof(ulong), 0);  // blocking channel with one element size
 			rctx->audio_timebase = rctx->format_ctx->streams[stream_index]->time_base;
@@ -451,23 +491,168 @@ open_stream_components(RendererCtx *rctx)
 }
 
 
+int
+alloc_picture_buffer(RendererCtx *rctx, AVFrame *picture, int width, int height)
+{
+	av_frame_unref(picture);
+	picture->format = AV_PIX_FMT_YUV420P;
+	picture->width = width;
+	picture->height = height;
+	int ret = av_frame_get_buffer(picture, 32);
+	if (ret < 0) {
+		LOG("failed to allocate picture buffer: %s", av_err2str(ret));
+	}
+	return ret;
+}
+
+
+// The yuv pictures for displaying to screen are allocated once per stream and recycled
+// through the picpool channel, so that decoding doesn't allocate per frame. Their buffers
+// are allocated when first needed, pictures that are passed through don't need them
+int
+alloc_picture_pool(RendererCtx *rctx)
+{
+	rctx->picpool_size = VIDEO_PICTURE_POOL_SIZE;
+	rctx->picpool_frames = calloc(rctx->picpool_size, sizeof(AVFrame*));
+	rctx->picpool = chancreate(sizeof(AVFrame*), rctx->picpool_size);
+	for (int i = 0; i < rctx->picpool_size; ++i) {
+		AVFrame *picture = av_frame_alloc();
+		if (picture == nil) {
+			LOG("could not allocate picture");
+			return -1;
+		}
+		rctx->picpool_frames[i] = picture;
+		sendp(rctx->picpool, picture);
+	}
+	LOG("allocated %d pictures", rctx->picpool_size);
+	return 0;
+}
+
+
+void
+free_picture_pool(RendererCtx *rctx)
+{
+	if (rctx->picpool_frames) {
+		for (int i = 0; i < rctx->picpool_size; ++i) {
+			av_frame_free(&rctx->picpool_frames[i]);
+		}
+		free(rctx->picpool_frames);
+		rctx->picpool_frames = nil;
+	}
+	if (rctx->picpool) {
+		chanfree(rctx->picpool);
+		rctx->picpool = nil;
+	}
+}
+
+
+// Decoded frames are handed over to the scaler thread in frames from the frame pool,
+// so that the decoder continues with the next packet while the scaler scales the frame
+int
+start_scaler(RendererCtx *rctx)
+{
+	rctx->framepool_size = SCALE_FRAME_POOL_SIZE;
+	rctx->framepool_frames = calloc(rctx->framepool_size, sizeof(AVFrame*));
+	rctx->framepool = chancreate(sizeof(AVFrame*), rctx->framepool_size);
+	for (int i = 0; i < rctx->framepool_size; ++i) {
+		AVFrame *frame = av_frame_alloc();
+		if (frame == nil) {
+			LOG("could not allocate scaler frame");
+			return -1;
+		}
+		rctx->framepool_frames[i] = frame;
+		sendp(rctx->framepool, frame);
+	}
+	rctx->scaleq = chancreate(sizeof(VideoPicture), SCALE_QUEUE_SIZE);
+	rctx->scalerq = chancreate(sizeof(ulong), 0);
+	rctx->scaler_tid = THREAD_CREATE(scaler_thread, rctx, THREAD_STACK_SIZE);
+	LOG("scaler thread created with id: %i", rctx->scaler_tid);
+	return 0;
+}
+
+
+void
+release_decoded_frame(RendererCtx *rctx, VideoPicture *videoPicture)
+{
+	if (videoPicture->frame) {
+		av_frame_unref(videoPicture->frame);
+		sendp(rctx->framepool, videoPicture->frame);
+		videoPicture->frame = nil;
+	}
+}
+
+
+void
+flush_scale_queue(RendererCtx *rctx)
+{
+	if (!rctx->scaleq) {
+		return;
+	}
+	LOG("flushing scale queue ...");
+	VideoPicture videoPicture;
+	while (nbrecv(rctx->scaleq, &videoPicture) == 1) {
+		release_decoded_frame(rctx, &videoPicture);
+	}
+	LOG("scale queue flushed.");
+}
+
+
+// Called by the decoder thread, so that no new frames are queued while stopping
+void
+stop_scaler(RendererCtx *rctx)
+{
+	if (!rctx->scaler_tid) {
+		return;
+	}
+	LOG("sending stop to scaler thread ...");
+	// Make room for the picture that the scaler thread may be about to queue
+	flush_scale_queue(rctx);
+	flush_picture_queue(rctx);
+	VideoPicture videoPicture = {.stop = 1};
+	send(rctx->scaleq, &videoPicture);
+	recvul(rctx->scalerq);
+	rctx->scaler_tid = 0;
+	LOG("scaler thread stopped.");
+}
+
+
+void
+free_scaler(RendererCtx *rctx)
+{
+	if (rctx->framepool_frames) {
+		for (int i = 0; i < rctx->framepool_size; ++i) {
+			av_frame_free(&rctx->framepool_frames[i]);
+		}
+		free(rctx->framepool_frames);
+		rctx->framepool_frames = nil;
+	}
+	if (rctx->framepool) {
+		chanfree(rctx->framepool);
+		rctx->framepool = nil;
+	}
+	if (rctx->scaleq) {
+		chanfree(rctx->scaleq);
+		rctx->scaleq = nil;
+	}
+	if (rctx->scalerq) {
+		chanfree(rctx->scalerq);
+		rctx->scalerq = nil;
+	}
+	if (rctx->yuv_ctx) {
+		sws_freeContext(rctx->yuv_ctx);
+		rctx->yuv_ctx = nil;
+	}
+}
+
+
 int
 alloc_buffers(RendererCtx *rctx)
 {
-	if (rctx->video_ctx) {
-		// yuv buffer for displaying to screen
-	    int yuv_num_bytes = av_image_get_buffer_size(
-			AV_PIX_FMT_YUV420P,
-			rctx->w,
-			rctx->h,
-			32
-			);
-		rctx->yuvbuffer = (uint8_t *) av_malloc(yuv_num_bytes * sizeof(uint8_t));
+	if (rctx->video_ctx && alloc_picture_pool(rctx) == -1) {
+		return -1;
 	}
-	rctx->decoder_packet = av_packet_alloc();
-	if (rctx->decoder_packet == nil) {
-		LOG("Could not allocate AVPacket.");
-		rctx->renderer_state = transitions[CMD_ERR][rctx->renderer_state];
+	if (rctx->video_ctx && start_scaler(rctx) == -1) {
+		return -1;
 	}
 	rctx->decoder_frame = av_frame_alloc();
 	if (rctx->decoder_frame == nil) {
@@ -603,38 +788,200 @@ resize_video(RendererCtx *rctx)
 	rctx->blit_copy_rect.y = 0.5 * (rctx->h - rctx->ah);
 	rctx->blit_copy_rect.w = rctx->aw;
 	rctx->blit_copy_rect.h = rctx->ah;
-	LOG("setting scaling context and texture for video frame to size: %dx%d", rctx->aw, rctx->ah);
-	if (rctx->yuv_ctx != nil) {
-		av_free(rctx->yuv_ctx);
+	// The texture keeps the video size and is scaled to blit_copy_rect by the renderer on the gpu,
+	// so resizing the window doesn't touch the pictures
+	int vw = rctx->video_ctx->width;
+	int vh = rctx->video_ctx->height;
+	if (rctx->sdl_texture != nil && rctx->tex_w == vw && rctx->tex_h == vh) {
+		return 0;
 	}
-	rctx->yuv_ctx = sws_getContext(
-		rctx->video_ctx->width,
-		rctx->video_ctx->height,
-		rctx->video_ctx->pix_fmt,
-		// set video size for the ffmpeg image scaler
-		rctx->aw,
-		rctx->ah,
-		AV_PIX_FMT_YUV420P,
-		SWS_BILINEAR,
-		nil,
-		nil,
-		nil
-	);
+	LOG("setting texture for video frame to size: %dx%d", vw, vh);
 	if (rctx->sdl_texture != nil) {
 		SDL_DestroyTexture(rctx->sdl_texture);
 	}
+	SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "linear");
 	rctx->sdl_texture = SDL_CreateTexture(
 		rctx->sdl_renderer,
 		SDL_PIXELFORMAT_YV12,
 		/* SDL_TEXTUREACCESS_STREAMING, */
 		SDL_TEXTUREACCESS_TARGET,  // fast update w/o locking, can be used as a render target
 		// set video size as the dimensions of the texture
-		rctx->aw,
-		rctx->ah
+		vw,
+		vh
 		);
+	rctx->tex_w = vw;
+	rctx->tex_h = vh;
 	return 0;
 }
 
+// The demuxer thread reads packets ahead into one queue per selected stream,
+// the decoder thread takes them from whichever queue has a packet
+int
+start_demuxer(RendererCtx *rctx)
+{
+	if (rctx->video_ctx) {
+		rctx->videopktq = chancreate(sizeof(AVPacket*), VIDEO_PACKET_QUEUE_SIZE);
+		rctx->demux_streams++;
+	}
+	if (rctx->audio_ctx) {
+		rctx->audiopktq = chancreate(sizeof(AVPacket*), AUDIO_PACKET_QUEUE_SIZE);
+		rctx->demux_streams++;
+	}
+	rctx->demuxerq = chancreate(sizeof(ulong), 0);
+	atomic_store(&rctx->demuxer_stop, 0);
+	rctx->demuxer_tid = THREAD_CREATE(demuxer_thread, rctx, THREAD_STACK_SIZE);
+	LOG("demuxer thread created with id: %i", rctx->demuxer_tid);
+	return 0;
+}
+
+
+Channel*
+packet_queue(RendererCtx *rctx, int stream_index)
+{
+	if (stream_index == rctx->video_stream) {
+		return rctx->videopktq;
+	}
+	if (stream_index == rctx->audio_stream) {
+		return rctx->audiopktq;
+	}
+	return nil;
+}
+
+
+// A nil packet at the end of each packet queue marks the end of the stream, demuxed packets
+// are never nil
+void
+send_eos_packets(RendererCtx *rctx)
+{
+	if (rctx->videopktq) {
+		sendp(rctx->videopktq, nil);
+	}
+	if (rctx->audiopktq) {
+		sendp(rctx->audiopktq, nil);
+	}
+}
+
+
+// Returns the next packet of any stream, blocks until one is demuxed. Sets stream_index to the
+// stream of the queue, or -1 on error. At the end of the stream nil is returned
+AVPacket*
+recv_packet(RendererCtx *rctx, int *stream_index)
+{
+	AVPacket *packet = nil;
+	Alt alts[] = {
+		{.c = rctx->videopktq, .v = &packet, .op = rctx->videopktq ? CHANRCV : CHANNOP},
+		{.c = rctx->audiopktq, .v = &packet, .op = rctx->audiopktq ? CHANRCV : CHANNOP},
+		{.op = CHANEND},
+	};
+	int ret = alt(alts);
+	if (ret == -1) {
+		LOG("<== error receiving packet from packet queues");
+		*stream_index = -1;
+		return nil;
+	}
+	*stream_index = (ret == 0) ? rctx->video_stream : rctx->audio_stream;
+	return packet;
+}
+
+
+void
+flush_packet_queue(Channel *pktq)
+{
+	if (!pktq) {
+		return;
+	}
+	AVPacket *packet;
+	while (nbrecv(pktq, &packet) == 1) {
+		av_packet_free(&packet);
+	}
+}
+
+
+// Called by the decoder thread, the demuxer thread may be blocked on a full packet queue
+void
+stop_demuxer(RendererCtx *rctx)
+{
+	if (!rctx->demuxer_tid) {
+		return;
+	}
+	LOG("sending stop to demuxer thread ...");
+	atomic_store(&rctx->demuxer_stop, 1);
+	AVPacket *packet = nil;
+	ulong ack;
+	Alt alts[] = {
+		{.c = rctx->demuxerq, .v = &ack, .op = CHANRCV},
+		{.c = rctx->videopktq, .v = &packet, .op = rctx->videopktq ? CHANRCV : CHANNOP},
+		{.c = rctx->audiopktq, .v = &packet, .op = rctx->audiopktq ? CHANRCV : CHANNOP},
+		{.op = CHANEND},
+	};
+	// Drop demuxed packets until the demuxer thread acknowledges the stop
+	while (alt(alts) > 0) {
+		av_packet_free(&packet);
+	}
+	flush_packet_queue(rctx->videopktq);
+	flush_packet_queue(rctx->audiopktq);
+	rctx->demuxer_tid = 0;
+	LOG("demuxer thread stopped.");
+}
+
+
+void
+free_demuxer(RendererCtx *rctx)
+{
+	if (rctx->videopktq) {
+		flush_packet_queue(rctx->videopktq);
+		chanfree(rctx->videopktq);
+		rctx->videopktq = nil;
+	}
+	if (rctx->audiopktq) {
+		flush_packet_queue(rctx->audiopktq);
+		chanfree(rctx->audiopktq);
+		rctx->audiopktq = nil;
+	}
+	if (rctx->demuxerq) {
+		chanfree(rctx->demuxerq);
+		rctx->demuxerq = nil;
+	}
+}
+
+
+void
+demuxer_thread(void *arg)
+{
+	RendererCtx *rctx = arg;
+	while (!atomic_load(&rctx->demuxer_stop)) {
+		AVPacket *packet = av_packet_alloc();
+		if (packet == nil) {
+			LOG("could not allocate AVPacket");
+			break;
+		}
+		if (read_packet(rctx, packet) == -1) {
+			av_packet_free(&packet);
+			break;
+		}
+		Channel *pktq = packet_queue(rctx, packet->stream_index);
+		if (pktq == nil) {
+			LOG("skipping packet of size %d, not a selected AV packet", packet->size);
+			av_packet_free(&packet);
+			continue;
+		}
+		// An empty packet would drain the decoder, e.g. the drop frame chunks of AVI files
+		if (packet->size == 0) {
+			LOG("skipping empty packet");
+			av_packet_free(&packet);
+			continue;
+		}
+		sendp(pktq, packet);
+	}
+	if (!atomic_load(&rctx->demuxer_stop)) {
+		send_eos_packets(rctx);
+	}
+	LOG("stopping demuxer thread ...");
+	sendul(rctx->demuxerq, 1);
+	threadexits("stopping demuxer thread");
+}
+
+
 int
 read_packet(RendererCtx *rctx, AVPacket *packet)
 {
@@ -646,10 +993,6 @@ read_packet(RendererCtx *rctx, AVPacket *packet)
 		}
 		return -1;
 	}
-	if (packet->size == 0) {
-		LOG("packet size is zero, exiting demuxer thread");
-		return -1;
-	}
 	char *stream = "not selected";
 	if (packet->stream_index == rctx->audio_stream) {
 		stream = "audio";
@@ -720,8 +1063,8 @@ read_frame_from_decoder(RendererCtx *rctx, AVFrame *frame)
 		return 2;
 	}
 	if (ret == AVERROR_EOF) {
-		LOG("end of file: AVERROR = EOF");
-		return -1;
+		LOG("end of file: AVERROR = EOF, decoder is drained");
+		return 2;
 	}
 	if (ret == AVERROR(EINVAL)) {
 		LOG("decoding error: AVERROR = EINVAL");
@@ -736,52 +1079,234 @@ read_frame_from_decoder(RendererCtx *rctx, AVFrame *frame)
 }
 
 
+// Scaling context of the scaler thread, set up again when the frame or the window size changes
+struct SwsContext*
+get_scale_ctx(RendererCtx *rctx, AVFrame *frame, int dstw, int dsth)
+{
+	if (rctx->yuv_ctx &&
+		rctx->yuv_srcw == frame->width && rctx->yuv_srch == frame->height && rctx->yuv_srcfmt == frame->format &&
+		rctx->yuv_dstw == dstw && rctx->yuv_dsth == dsth) {
+		return rctx->yuv_ctx;
+	}
+	if (rctx->yuv_ctx) {
+		sws_freeContext(rctx->yuv_ctx);
+	}
+	int nthreads = av_cpu_count();
+	nthreads = nthreads > SCALER_MAX_THREADS ? SCALER_MAX_THREADS : nthreads;
+	LOG("setting up scaling context from %dx%d to %dx%d with %d threads",
+		frame->width, frame->height, dstw, dsth, nthreads);
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+	rctx->yuv_ctx = sws_alloc_context();
+	if (rctx->yuv_ctx) {
+		av_opt_set_int(rctx->yuv_ctx, "srcw", frame->width, 0);
+		av_opt_set_int(rctx->yuv_ctx, "srch", frame->height, 0);
+		av_opt_set_int(rctx->yuv_ctx, "src_format", frame->format, 0);
+		// set video size for the ffmpeg image scaler
+		av_opt_set_int(rctx->yuv_ctx, "dstw", dstw, 0);
+		av_opt_set_int(rctx->yuv_ctx, "dsth", dsth, 0);
+		av_opt_set_int(rctx->yuv_ctx, "dst_format", AV_PIX_FMT_YUV420P, 0);
+		av_opt_set_int(rctx->yuv_ctx, "sws_flags", SWS_BILINEAR, 0);
+		av_opt_set_int(rctx->yuv_ctx, "threads", nthreads, 0);
+		if (sws_init_context(rctx->yuv_ctx, nil, nil) < 0) {
+			sws_freeContext(rctx->yuv_ctx);
+			rctx->yuv_ctx = nil;
+		}
+	}
+#else
+	rctx->yuv_ctx = sws_getContext(
+		frame->width,
+		frame->height,
+		frame->format,
+		// set video size for the ffmpeg image scaler
+		dstw,
+		dsth,
+		AV_PIX_FMT_YUV420P,
+		SWS_BILINEAR,
+		nil,
+		nil,
+		nil
+	);
+#endif
+	if (rctx->yuv_ctx == nil) {
+		LOG("failed to set up scaling context");
+		return nil;
+	}
+	rctx->yuv_srcw = frame->width;
+	rctx->yuv_srch = frame->height;
+	rctx->yuv_srcfmt = frame->format;
+	rctx->yuv_dstw = dstw;
+	rctx->yuv_dsth = dsth;
+	return rctx->yuv_ctx;
+}
+
+
 int
 create_yuv_picture_from_frame(RendererCtx *rctx, AVFrame *frame, VideoPicture *videoPicture)
 {
-	LOG("scaling video picture (height %d) to target size %dx%d before queueing",
-		rctx->current_codec_ctx->height, rctx->aw, rctx->ah);
-	videoPicture->frame = av_frame_alloc();
-	av_image_fill_arrays(
-			videoPicture->frame->data,
-			videoPicture->frame->linesize,
-			rctx->yuvbuffer,
-			AV_PIX_FMT_YUV420P,
-			// set video size of picture to send to queue here
-			rctx->aw, 
-			rctx->ah,
-			32
-	);
-	sws_scale(
-	    rctx->yuv_ctx,
+	// Blocks while all pictures are queued or displayed
+	AVFrame *picture = recvp(rctx->picpool);
+	if (picture == nil) {
+		LOG("failed to get picture from picture pool");
+		return -1;
+	}
+	videoPicture->passthrough = 0;
+	// The texture size is changed by the event loop, read it once so that the scaling
+	// context and the picture buffer always have the same size
+	int dstw = rctx->tex_w;
+	int dsth = rctx->tex_h;
+	// Decoder output that matches the texture is displayed as is
+	if (frame->format == AV_PIX_FMT_YUV420P && frame->width == dstw && frame->height == dsth) {
+		LOG("passing video picture through to texture of size %dx%d", dstw, dsth);
+		av_frame_unref(picture);
+		int ret = av_frame_ref(picture, frame);
+		if (ret < 0) {
+			LOG("failed to reference video picture: %s", av_err2str(ret));
+			sendp(rctx->picpool, picture);
+			return -1;
+		}
+		videoPicture->frame = picture;
+		videoPicture->passthrough = 1;
+		return 0;
+	}
+	LOG("scaling video picture %dx%d to target size %dx%d before queueing",
+		frame->width, frame->height, dstw, dsth);
+	struct SwsContext *yuv_ctx = get_scale_ctx(rctx, frame, dstw, dsth);
+	if (yuv_ctx == nil) {
+		sendp(rctx->picpool, picture);
+		return -1;
+	}
+	// Buffer not allocated yet or video size changed
+	if (picture->data[0] == nil || picture->width != dstw || picture->height != dsth) {
+		if (alloc_picture_buffer(rctx, picture, dstw, dsth) < 0) {
+			sendp(rctx->picpool, picture);
+			return -1;
+		}
+	}
+	videoPicture->frame = picture;
+#if LIBSWSCALE_VERSION_INT >= AV_VERSION_INT(6, 1, 100)
+	// Only the frame api scales the slices of the picture on the threads of the scaling context
+	int ret = sws_scale_frame(yuv_ctx, picture, frame);
+#else
+	int ret = sws_scale(
+	    yuv_ctx,
 	    (uint8_t const * const *)frame->data,
 	    frame->linesize,
 	    0,
 	    // set video height here to select the slice in the *SOURCE* picture to scale (usually the whole picture)
-	    rctx->current_codec_ctx->height,
-	    videoPicture->frame->data,
-	    videoPicture->frame->linesize
+	    frame->height,
+	    picture->data,
+	    picture->linesize
 	);
+#endif
+	if (ret < 0) {
+		LOG("failed to scale video picture: %s", av_err2str(ret));
+		release_picture(rctx, videoPicture);
+		return -1;
+	}
 	LOG("video picture created.");
 	return 0;
 }
 
 
+// Scaling runs on its own thread, so that decoding of the next frame overlaps scaling
+// of the current one
+void
+scaler_thread(void *arg)
+{
+	RendererCtx *rctx = arg;
+	VideoPicture decoded;
+	for (;;) {
+		if (recv(rctx->scaleq, &decoded) != 1) {
+			LOG("<== error receiving frame from scale queue");
+			continue;
+		}
+		if (decoded.stop) {
+			LOG("stopping scaler thread ...");
+			sendul(rctx->scalerq, 1);
+			threadexits("stopping scaler thread");
+		}
+		if (decoded.eos) {
+			send_picture_to_queue(rctx, &decoded);
+			continue;
+		}
+		VideoPicture videoPicture = decoded;
+		videoPicture.frame = nil;
+		if (create_yuv_picture_from_frame(rctx, decoded.frame, &videoPicture) == 0) {
+			send_picture_to_queue(rctx, &videoPicture);
+		}
+		release_decoded_frame(rctx, &decoded);
+	}
+}
+
+
+// Takes a sample buffer of at least size bytes from the sample pool,
+// a buffer is only allocated when the pool is empty or its buffer is too small
+void
+get_sample_buffer(RendererCtx *rctx, AudioSample *audioSample, int size)
+{
+	AudioSample buf = {.sample = nil, .capacity = 0};
+	nbrecv(rctx->samplepool, &buf);
+	if (buf.capacity < size) {
+		free(buf.sample);
+		buf.sample = malloc(size);
+		buf.capacity = size;
+	}
+	audioSample->sample = buf.sample;
+	audioSample->capacity = buf.capacity;
+}
+
+
+// Returns the sample buffer to the sample pool after it was queued to the audio device or dropped
+void
+release_sample(RendererCtx *rctx, AudioSample *audioSample)
+{
+	if (audioSample->sample == nil) {
+		return;
+	}
+	if (nbsend(rctx->samplepool, audioSample) != 1) {
+		free(audioSample->sample);
+	}
+	audioSample->sample = nil;
+}
+
+
+void
+free_sample_pool(RendererCtx *rctx)
+{
+	if (rctx->samplepool == nil) {
+		return;
+	}
+	AudioSample buf;
+	while (nbrecv(rctx->samplepool, &buf) == 1) {
+		free(buf.sample);
+	}
+	chanfree(rctx->samplepool);
+	rctx->samplepool = nil;
+}
+
+
 int
 create_sample_from_frame(RendererCtx *rctx, AVFrame *frame, AudioSample *audioSample)
 {
 	int bytes_per_sample = 2 * rctx->audio_out_channels;
 	int bytes_per_sec = rctx->current_codec_ctx->sample_rate * bytes_per_sample;
-	audioSample->sample = malloc(MAX_AUDIO_FRAME_SIZE);
+	// Upper bound of the resampled output, including samples buffered in the resampler
+	int max_out_samples = swr_get_out_samples(rctx->swr_ctx, frame->nb_samples);
+	if (max_out_samples <= 0) {
+		LOG("resampling audio failed, no output samples");
+		return 0;
+	}
+	get_sample_buffer(rctx, audioSample, max_out_samples * bytes_per_sample);
 	int nbsamples = swr_convert(
 			rctx->swr_ctx,
 			&audioSample->sample,
-			MAX_AUDIO_FRAME_SIZE / bytes_per_sample,
+			max_out_samples,
 			(const uint8_t**) frame->data,
 			frame->nb_samples
 	);
-	if (nbsamples < 0) {
+	if (nbsamples <= 0) {
 		LOG("resampling audio failed");
+		release_sample(rctx, audioSample);
 		return 0;
 	}
 	int data_size = nbsamples * bytes_per_sample;
@@ -795,6 +1320,21 @@ create_sample_from_frame(RendererCtx *rctx, AVFrame *frame, AudioSample *audioSa
 }
 
 
+// Returns the picture to the picture pool after it was displayed or dropped
+void
+release_picture(RendererCtx *rctx, VideoPicture *videoPicture)
+{
+	if (videoPicture->frame) {
+		// Give the decoder its picture back
+		if (videoPicture->passthrough) {
+			av_frame_unref(videoPicture->frame);
+		}
+		sendp(rctx->picpool, videoPicture->frame);
+		videoPicture->frame = nil;
+	}
+}
+
+
 void
 send_picture_to_queue(RendererCtx *rctx, VideoPicture *videoPicture)
 {
@@ -839,8 +1379,7 @@ flush_picture_queue(RendererCtx *rctx)
 	for (;;) {
 		int ret = nbrecv(rctx->pictq, &videoPicture);
 		if (ret == 1) {
-			av_frame_unref(videoPicture.frame);
-			av_frame_free(&videoPicture.frame);
+			release_picture(rctx, &videoPicture);
 		}
 		else {
 			break;
@@ -861,7 +1400,7 @@ flush_audio_queue(RendererCtx *rctx)
 	for (;;) {
 		int ret = nbrecv(rctx->audioq, &audioSample);
 		if (ret == 1) {
-			free(audioSample.sample);
+			release_sample(rctx, &audioSample);
 		}
 		else {
 			break;
@@ -871,6 +1410,22 @@ flush_audio_queue(RendererCtx *rctx)
 }
 
 
+// Scales the S16 samples by the soft volume, SDL_QueueAudio() copies them anyway
+void
+apply_volume(RendererCtx *rctx, AudioSample *audioSample)
+{
+	if (rctx->audio_vol >= 100) {
+		return;
+	}
+	int vol = rctx->audio_vol * 256 / 100;
+	int16_t *sample = (int16_t*)audioSample->sample;
+	int n = audioSample->size / sizeof(int16_t);
+	for (int i = 0; i < n; ++i) {
+		sample[i] = (sample[i] * vol) >> 8;
+	}
+}
+
+
 void
 presenter_thread(void *arg)
 {
@@ -938,14 +1493,12 @@ presenter_thread(void *arg)
 		}
 		LOG("<== received sample with idx: %d, pts: %.2fms, eos: %d from audio queue.", audioSample.idx, audioSample.pts, audioSample.eos);
 
-		// Mix audio sample soft volume and write it to sdl audio buffer
-		SDL_memset(rctx->mixed_audio_buf, 0, audioSample.size);
-		SDL_MixAudioFormat(rctx->mixed_audio_buf, audioSample.sample, rctx->specs.format, audioSample.size, (rctx->audio_vol / 100.0) * SDL_MIX_MAXVOLUME);
-		int ret = SDL_QueueAudio(rctx->audio_devid, rctx->mixed_audio_buf, audioSample.size);
-		/* int ret = SDL_QueueAudio(rctx->audio_devid, audioSample.sample, audioSample.size); */
+		// Apply soft volume to the audio sample in place and write it to sdl audio buffer
+		apply_volume(rctx, &audioSample);
+		int ret = SDL_QueueAudio(rctx->audio_devid, audioSample.sample, audioSample.size);
 		if (ret < 0) {
 			LOG("failed to write audio sample: %s", SDL_GetError());
-			free(audioSample.sample);
+			release_sample(rctx, &audioSample);
 			continue;
 		}
 		LOG("queued audio sample to sdl device");
@@ -980,11 +1533,7 @@ presenter_thread(void *arg)
 			LOG("display pic dist: %.2fms", avdist);
 			display_picture(rctx, &videoPicture);
 			nextpic = 1;
-			if (videoPicture.frame) {
-				av_frame_unref(videoPicture.frame);
-				av_frame_free(&videoPicture.frame);
-				videoPicture.frame = nil;
-			}
+			release_picture(rctx, &videoPicture);
 		}
 		else {
 			LOG("video picture not ready to display");
@@ -1001,7 +1550,7 @@ presenter_thread(void *arg)
 			sleep(time_diff);
 			LOG("P6<");
 		}
-		free(audioSample.sample);
+		release_sample(rctx, &audioSample);
 	}
 }
 
@@ -1015,6 +1564,12 @@ display_picture(RendererCtx *rctx, VideoPicture *videoPicture)
 	}
 	LOG("displaying picture %d ...",
 		videoPicture->idx);
+	// Pictures scaled before the video size changed don't fit the texture
+	if (videoPicture->frame->width != rctx->tex_w || videoPicture->frame->height != rctx->tex_h) {
+		LOG("skipping picture of size %dx%d, texture size is %dx%d",
+			videoPicture->frame->width, videoPicture->frame->height, rctx->tex_w, rctx->tex_h);
+		return;
+	}
 	int textupd = SDL_UpdateYUVTexture(
 			rctx->sdl_texture,
 			nil,
@@ -1042,8 +1597,14 @@ void
 send_eos_frames(RendererCtx *rctx)
 {
 	if (rctx->video_ctx) {
+		// Queued behind the frames that are still scaled while the scaler is running
 		VideoPicture videoPicture = {.eos = 1};
-		send_picture_to_queue(rctx, &videoPicture);
+		if (rctx->scaler_tid) {
+			send(rctx->scaleq, &videoPicture);
+		}
+		else {
+			send_picture_to_queue(rctx, &videoPicture);
+		}
 	}
 	if (rctx->audio_ctx) {
 		AudioSample audioSample = {.eos = 1};
@@ -1057,20 +1618,44 @@ state_run(RendererCtx *rctx)
 {
 	// Main decoder loop
 	for (;;) {
-		if (read_cmd(rctx, READCMD_POLL) == CHANGE_STATE) {
-			return;
-		}
-		if (read_packet(rctx, rctx->decoder_packet) == -1) {
+		if (rctx->demux_streams == 0) {
 			// When keeping the state after EOF, we blocking wait for commands in the decoder thread
-			// while the presenter thread is still running. We send an EOS (End-Of-Stream) frame 
-			// to both, audio and video queue, to signal the end of the stream in the presenter thread.
-			send_eos_frames(rctx);
+			// while the presenter thread is still running.
 			if (read_cmd(rctx, READCMD_BLOCK) == CHANGE_STATE) {
 				return;
 			}
+			continue;
+		}
+		if (read_cmd(rctx, READCMD_POLL) == CHANGE_STATE) {
+			return;
+		}
+		int stream_index;
+		AVPacket *packet = recv_packet(rctx, &stream_index);
+		if (stream_index == -1) {
+			continue;
+		}
+		// The nil packet ends a stream, an empty packet drains its decoder. After draining the
+		// decoder of the last stream we send an EOS (End-Of-Stream) frame to both, audio and
+		// video queue, to signal the end of the stream in the presenter thread.
+		int last_eos = 0;
+		if (packet == nil) {
+			last_eos = (--rctx->demux_streams == 0);
+			packet = av_packet_alloc();
+			if (packet == nil) {
+				LOG("could not allocate eos packet");
+				if (last_eos) {
+					send_eos_frames(rctx);
+				}
+				continue;
+			}
+			packet->stream_index = stream_index;
 		}
-		if (write_packet_to_decoder(rctx, rctx->decoder_packet) == -1) {
+		if (write_packet_to_decoder(rctx, packet) == -1) {
 			/* rctx->renderer_state = transitions[CMD_ERR][rctx->renderer_state]; */
+			av_packet_free(&packet);
+			if (last_eos) {
+				send_eos_frames(rctx);
+			}
 			continue;
 		}
 		// This loop is only needed when we get more than one decoded frame out
@@ -1100,9 +1685,13 @@ state_run(RendererCtx *rctx)
 					.pts = rctx->video_pts,
 					.eos = 0,
 					};
-			    create_yuv_picture_from_frame(rctx, rctx->decoder_frame, &videoPicture);
 				if (!rctx->audio_only) {
-					send_picture_to_queue(rctx, &videoPicture);
+					// Hand the decoded frame over to the scaler thread without copying it
+					videoPicture.frame = recvp(rctx->framepool);
+					if (videoPicture.frame) {
+						av_frame_move_ref(videoPicture.frame, rctx->decoder_frame);
+						send(rctx->scaleq, &videoPicture);
+					}
 				}
 			}
 			else if (rctx->current_codec_ctx == rctx->audio_ctx) {
@@ -1124,7 +1713,10 @@ state_run(RendererCtx *rctx)
 				LOG("non AV packet from demuxer, ignoring");
 			}
 		}
-		av_packet_unref(rctx->decoder_packet);
+		if (last_eos) {
+			send_eos_frames(rctx);
+		}
+		av_packet_free(&packet);
 		av_frame_unref(rctx->decoder_frame);
 	}
 }
@@ -1153,6 +1745,10 @@ state_load(RendererCtx *rctx)
 		rctx->renderer_state = transitions[CMD_ERR][rctx->renderer_state];
 		return;
 	}
+	if (start_demuxer(rctx) == -1) {
+		rctx->renderer_state = transitions[CMD_ERR][rctx->renderer_state];
+		return;
+	}
 	rctx->renderer_state = transitions[CMD_NONE][rctx->renderer_state];
 }
 
@@ -1160,8 +1756,13 @@ state_load(RendererCtx *rctx)
 void
 state_unload(RendererCtx *rctx)
 {
-	// Stop presenter thread
+	// Stop demuxer, scaler and presenter thread, the demuxer still reads from the format context
+	stop_demuxer(rctx);
+	stop_scaler(rctx);
 	LOG("sending stop to presenter thread ...");
+	// Drop queued pictures and samples, a full queue would block sending the flush frames
+	flush_picture_queue(rctx);
+	flush_audio_queue(rctx);
 	// Send flush frames to the queues to avoid blocking in recv() in the presenter thread
 	send_eos_frames(rctx);
 	sendul(rctx->presq, 1);
@@ -1184,24 +1785,22 @@ state_unload(RendererCtx *rctx)
 	if (rctx->video_ctx) {
 		avcodec_free_context(&rctx->video_ctx);
 	}
-	if (rctx->yuv_ctx) {
-		av_free(rctx->yuv_ctx);
-	}
 	SDL_CloseAudioDevice(rctx->audio_devid);
-	if (rctx->yuvbuffer) {
-		av_free(rctx->yuvbuffer);
-	}
-	av_packet_unref(rctx->decoder_packet);
 	av_frame_unref(rctx->decoder_frame);
+	free_demuxer(rctx);
 
 	flush_audio_queue(rctx);
 	if (rctx->audioq) {
 		chanfree(rctx->audioq);
 	}
+	free_sample_pool(rctx);
 	flush_picture_queue(rctx);
 	if (rctx->pictq) {
 		chanfree(rctx->pictq);
 	}
+	free_scaler(rctx);
+	// Pictures still held by the stopped presenter thread are freed with the pool
+	free_picture_pool(rctx);
 	chanfree(rctx->presq);
 
 	// Reset the renderer context to a defined initial state
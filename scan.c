@@ -6,6 +6,9 @@
 #include <strings.h>
 #include <dirent.h>
 #include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include <vlc/vlc.h>
@@ -13,9 +16,23 @@
 
 
 bool append_mode               = false;
+bool update_mode               = false;
 char *basedir                  = NULL;
-libvlc_instance_t *libvlc      = NULL;
 sqlite3 *db                    = NULL;
+/// Number of parser threads, each with its own libvlc instance, as parsing
+/// requests of one instance are queued to a single preparser thread
+int nworkers                   = 0;
+/// Max objs written per transaction, ommserve sees the scanned objs after each commit
+int batchsize                  = 1000;
+
+/// WAL lets ommserve read while the scanner writes, fsync only at checkpoints is safe with WAL
+const char *tune_qry          =      \
+"PRAGMA journal_mode = WAL; "        \
+"PRAGMA synchronous = NORMAL; "      \
+"PRAGMA cache_size = -65536; "       \
+"PRAGMA mmap_size = 268435456";
+/// ommserve may write fav entries while a batch is written
+#define BUSY_TIMEOUT_MS 5000
 
 /// Table obj
 const char *crtobj_qry         =     \
@@ -28,13 +45,60 @@ const char *crtobj_qry         =     \
 "album  TEXT, "                      \
 "track  TEXT, "                      \
 "title  TEXT, "                      \
-"path   TEXT "                       \
+"path   TEXT, "                      \
+"size   INTEGER, "                   \
+"mtime  INTEGER "                    \
 ")";
+/// Browsing by type, format and artist / album, the indexes contain id so that
+/// the id lists are read from the index alone. Lookups by id use the index of the primary key
 const char *idxobj_qry        =      \
-"CREATE INDEX objid_idx ON obj(id)";
+"CREATE INDEX IF NOT EXISTS objtype_idx ON obj(type, fmt, id); "   \
+"CREATE INDEX IF NOT EXISTS objorig_idx ON obj(orig, album, track, id); " \
+"CREATE INDEX IF NOT EXISTS objalbum_idx ON obj(album, track, id)";
+/// objid_idx of older dbs duplicates the index of the primary key and only slows down inserts
+const char *drpidxobj_qry     =      \
+"DROP INDEX IF EXISTS objid_idx";
+/// dbs scanned before size and mtime were stored get the columns added, their objs are parsed again
+const char *hassize_qry       =      \
+"SELECT size, mtime FROM obj LIMIT 0";
+const char *addsize_qry       =      \
+"ALTER TABLE obj ADD COLUMN size INTEGER";
+const char *addmtime_qry      =      \
+"ALTER TABLE obj ADD COLUMN mtime INTEGER";
 const char *drpobj_qry        =      \
 "DROP TABLE IF EXISTS obj";
 
+/// Full text index over obj, searched by ommserve through the query file.
+/// External content table, the triggers keep it in sync with obj
+const char *crtfts_qry         =     \
+"CREATE VIRTUAL TABLE IF NOT EXISTS objfts USING fts5(" \
+"title, orig, album, track, "        \
+"content='obj', content_rowid='id'"  \
+")";
+const char *crtftsins_qry      =     \
+"CREATE TRIGGER IF NOT EXISTS objfts_ins AFTER INSERT ON obj BEGIN "                        \
+"INSERT INTO objfts(rowid, title, orig, album, track) "                                     \
+"VALUES (new.id, new.title, new.orig, new.album, new.track); "                              \
+"END";
+const char *crtftsdel_qry      =     \
+"CREATE TRIGGER IF NOT EXISTS objfts_del AFTER DELETE ON obj BEGIN "                        \
+"INSERT INTO objfts(objfts, rowid, title, orig, album, track) "                             \
+"VALUES ('delete', old.id, old.title, old.orig, old.album, old.track); "                    \
+"END";
+const char *crtftsupd_qry      =     \
+"CREATE TRIGGER IF NOT EXISTS objfts_upd AFTER UPDATE ON obj BEGIN "                        \
+"INSERT INTO objfts(objfts, rowid, title, orig, album, track) "                             \
+"VALUES ('delete', old.id, old.title, old.orig, old.album, old.track); "                    \
+"INSERT INTO objfts(rowid, title, orig, album, track) "                                     \
+"VALUES (new.id, new.title, new.orig, new.album, new.track); "                              \
+"END";
+const char *rebuildfts_qry     =     \
+"INSERT INTO objfts(objfts) VALUES ('rebuild')";
+const char *hasfts_qry         =     \
+"SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'objfts'";
+const char *drpfts_qry         =     \
+"DROP TABLE IF EXISTS objfts";
+
 /// Table fav
 /// Length of fav.userid should be LOGIN_NAME_MAX (POSIX)
 /// id is not primary key, currently id is always set to 0
@@ -45,17 +109,31 @@ const char *crtfav_qry        =      \
 "listid TEXT(16), "                  \
 "objid  INTEGER(8) "                 \
 ")";
-#if 0
+/// Fav lists are joined with obj by listid, objs are removed from fav lists by objid
 const char *idxfav_qry        =      \
-"CREATE INDEX favid_idx ON fav(id)";
-#endif
+"CREATE INDEX IF NOT EXISTS favlist_idx ON fav(listid, objid); "   \
+"CREATE INDEX IF NOT EXISTS favobj_idx ON fav(objid)";
 const char *drpfav_qry        =      \
 "DROP TABLE IF EXISTS fav";
 
 /// Insert
 sqlite3_stmt *ins_stmt         = NULL;
 const char *ins_qry           =      \
-"INSERT INTO obj VALUES (?,?,?,?,?,?,?,?,?)";
+"INSERT INTO obj (id, type, fmt, dur, orig, album, track, title, path, size, mtime) " \
+"VALUES (?,?,?,?,?,?,?,?,?,?,?)";
+
+/// Update mode, objs keep their id so that fav entries stay valid
+sqlite3_stmt *upd_stmt         = NULL;
+const char *upd_qry           =      \
+"UPDATE obj SET type = ?2, fmt = ?3, dur = ?4, orig = ?5, album = ?6, track = ?7, " \
+"title = ?8, path = ?9, size = ?10, mtime = ?11 WHERE id = ?1";
+/// Objs below the scanned dir
+const char *known_qry         =      \
+"SELECT id, path, size, mtime FROM obj WHERE substr(path, 1, length(?1) + 1) = ?1 || '/'";
+const char *del_qry           =      \
+"DELETE FROM obj WHERE id = ?";
+const char *delfav_qry        =      \
+"DELETE FROM fav WHERE objid = ?";
 
 sqlite3_stmt *maxid_stmt      = NULL;
 const char *maxid_qry         =      \
@@ -85,6 +163,144 @@ char *img_types[] = {
 
 uint64_t objid = 0;
 
+/// Scanning is a pipeline: the walker (main thread) queues file paths to the parser
+/// workers, the workers queue tags to the writer thread, the only one that writes to db
+#define PATHQ_LEN     1024
+#define TAGQ_LEN      256
+#define PROGRESS_SEC  2
+/// Max time a batch holds the write lock, ommserve's fav writes wait for it
+#define BATCH_SEC     1
+
+typedef struct queue {
+	void **items;
+	int cap, head, count;
+	bool closed;
+	pthread_mutex_t lock;
+	pthread_cond_t notempty, notfull;
+} queue;
+
+typedef struct media_tag {
+	uint64_t id;                  /// Id of a changed obj in update mode, 0 for new objs
+	int64_t size;
+	int64_t mtime;
+	char *fpath;
+	char *mtype;
+	char *artist;
+	char *album;
+	char *track;
+	char *title;
+	libvlc_time_t duration;
+} media_tag;
+
+queue pathq;
+queue tagq;
+
+/// Objs of the db below the scanned dir in update mode, by path
+typedef struct known_obj {
+	uint64_t id;
+	char *fpath;
+	int64_t size;
+	int64_t mtime;
+	bool seen;
+	struct known_obj *next;
+} known_obj;
+
+#define KNOWN_HASH    65536
+
+known_obj *known[KNOWN_HASH];
+uint64_t nunchanged = 0;
+uint64_t nchanged = 0;
+uint64_t nnew = 0;
+uint64_t ndeleted = 0;
+
+
+void
+queue_init(queue *q, int cap)
+{
+	q->items = calloc(cap, sizeof(void*));
+	q->cap = cap;
+	q->head = q->count = 0;
+	q->closed = false;
+	pthread_mutex_init(&q->lock, NULL);
+	/// Deadlines of queue_pop_until() are monotonic, the wall clock may jump
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&q->notempty, &attr);
+	pthread_condattr_destroy(&attr);
+	pthread_cond_init(&q->notfull, NULL);
+}
+
+
+void
+queue_free(queue *q)
+{
+	free(q->items);
+	pthread_mutex_destroy(&q->lock);
+	pthread_cond_destroy(&q->notempty);
+	pthread_cond_destroy(&q->notfull);
+}
+
+
+/// queue_push() blocks while the queue is full, so a fast walker doesn't run ahead of the parsers
+void
+queue_push(queue *q, void *item)
+{
+	pthread_mutex_lock(&q->lock);
+	while (q->count == q->cap) pthread_cond_wait(&q->notfull, &q->lock);
+	q->items[(q->head + q->count) % q->cap] = item;
+	q->count++;
+	pthread_cond_signal(&q->notempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
+
+/// queue_pop_until() returns NULL when the queue is closed and empty, or when the queue is
+/// still empty at deadline (CLOCK_MONOTONIC), then timedout is set. A NULL deadline waits forever
+void*
+queue_pop_until(queue *q, struct timespec *deadline, bool *timedout)
+{
+	void *item = NULL;
+	pthread_mutex_lock(&q->lock);
+	while (q->count == 0 && !q->closed) {
+		if (deadline == NULL) {
+			pthread_cond_wait(&q->notempty, &q->lock);
+		}
+		else if (pthread_cond_timedwait(&q->notempty, &q->lock, deadline) == ETIMEDOUT) {
+			if (q->count == 0 && !q->closed) {
+				*timedout = true;
+				break;
+			}
+		}
+	}
+	if (q->count) {
+		item = q->items[q->head];
+		q->head = (q->head + 1) % q->cap;
+		q->count--;
+		pthread_cond_signal(&q->notfull);
+	}
+	pthread_mutex_unlock(&q->lock);
+	return item;
+}
+
+
+/// queue_pop() returns NULL when the queue is closed and empty
+void*
+queue_pop(queue *q)
+{
+	return queue_pop_until(q, NULL, NULL);
+}
+
+
+void
+queue_close(queue *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->closed = true;
+	pthread_cond_broadcast(&q->notempty);
+	pthread_mutex_unlock(&q->lock);
+}
+
 
 bool
 exec_stmt(sqlite3 *db, const char *stmt)
@@ -103,19 +319,63 @@ exec_stmt(sqlite3 *db, const char *stmt)
 bool
 drop_tables(sqlite3 *db)
 {
+	if (!exec_stmt(db, drpfts_qry)) return false;
 	if (!exec_stmt(db, drpobj_qry)) return false;
 	if (!exec_stmt(db, drpfav_qry)) return false;
 	return true;
 }
 
 
+bool
+has_fts(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	bool ret = false;
+	if (sqlite3_prepare_v2(db, hasfts_qry, -1, &stmt, NULL) == SQLITE_OK) {
+		ret = sqlite3_step(stmt) == SQLITE_ROW;
+		sqlite3_finalize(stmt);
+	}
+	return ret;
+}
+
+
+bool
+has_size(sqlite3 *db)
+{
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, hassize_qry, -1, &stmt, NULL) != SQLITE_OK) return false;
+	sqlite3_finalize(stmt);
+	return true;
+}
+
+
+bool
+create_fts(sqlite3 *db)
+{
+	if (!exec_stmt(db, crtfts_qry)) return false;
+	if (!exec_stmt(db, crtftsins_qry)) return false;
+	if (!exec_stmt(db, crtftsdel_qry)) return false;
+	if (!exec_stmt(db, crtftsupd_qry)) return false;
+	return true;
+}
+
+
 bool
 create_tables(sqlite3 *db)
 {
 	if (!exec_stmt(db, crtobj_qry)) return false;
-	if (!exec_stmt(db, idxobj_qry)) return false;
 	if (!exec_stmt(db, crtfav_qry)) return false;
-	// if (!exec_stmt(db, idxfav_qry)) return false;
+	return create_fts(db);
+}
+
+
+/// Indexes of a new db are created after the scan, that is faster than updating them with each insert
+bool
+create_indexes(sqlite3 *db)
+{
+	if (!exec_stmt(db, drpidxobj_qry)) return false;
+	if (!exec_stmt(db, idxobj_qry)) return false;
+	if (!exec_stmt(db, idxfav_qry)) return false;
 	return true;
 }
 
@@ -186,43 +446,299 @@ media_type(libvlc_media_t *media, char *fpath)
 }
 
 
-int
-tag(char *fpath)
+char*
+meta_or_empty(libvlc_media_t *media, libvlc_meta_t meta)
 {
+	char *val = libvlc_media_get_meta(media, meta);
+	return val ? val : strdup("");
+}
+
+
+bool
+tag(libvlc_instance_t *libvlc, media_tag *mt)
+{
+	char *fpath = mt->fpath;
 	libvlc_media_t *media = libvlc_media_new_path(libvlc, fpath);
 	if (!media) {
 		LOG("failed to parse: %s, skipping", fpath);
+		return false;
 	}
 	libvlc_media_parse(media);
-	char *title = libvlc_media_get_meta(media, libvlc_meta_Title);
-	if (!title) title = "";
-	char *artist = libvlc_media_get_meta(media, libvlc_meta_Artist);
-	if (!artist) artist = "";
-    char* album = libvlc_media_get_meta(media, libvlc_meta_Album);
-	if (!album) album = "";
-    char* track = libvlc_media_get_meta(media, libvlc_meta_TrackNumber);
-	if (!track) track = "";
-	libvlc_time_t duration = libvlc_media_get_duration(media);
-	if (duration == -1) {
+	mt->title = meta_or_empty(media, libvlc_meta_Title);
+	mt->artist = meta_or_empty(media, libvlc_meta_Artist);
+	mt->album = meta_or_empty(media, libvlc_meta_Album);
+	mt->track = meta_or_empty(media, libvlc_meta_TrackNumber);
+	mt->duration = libvlc_media_get_duration(media);
+	if (mt->duration == -1) {
 		LOG("could not get duration");
 	}
-	char *mtype = media_types[media_type(media, fpath)];
-	if (!mtype) mtype = "";
-	objid++;
-	sqlite3_bind_int(ins_stmt, 1, objid);
-	sqlite3_bind_text(ins_stmt, 2, "file", strlen("file"), SQLITE_STATIC);
-	sqlite3_bind_text(ins_stmt, 3, mtype, strlen(mtype), SQLITE_STATIC);
-	sqlite3_bind_int(ins_stmt, 4, duration);
-	sqlite3_bind_text(ins_stmt, 5, artist, strlen(artist), SQLITE_STATIC);
-	sqlite3_bind_text(ins_stmt, 6, album, strlen(title), SQLITE_STATIC);
-	sqlite3_bind_text(ins_stmt, 7, track, strlen(title), SQLITE_STATIC);
-	sqlite3_bind_text(ins_stmt, 8, title, strlen(title), SQLITE_STATIC);
-	sqlite3_bind_text(ins_stmt, 9, fpath, strlen(fpath), SQLITE_STATIC);
-	sqlite3_step(ins_stmt);
-	sqlite3_reset(ins_stmt);
-	LOG("%s", fpath);
+	mt->mtype = media_types[media_type(media, fpath)];
+	if (!mt->mtype) mt->mtype = "";
 	libvlc_media_release(media);
-	return 0;
+	return true;
+}
+
+
+void
+free_tag(media_tag *mt)
+{
+	free(mt->fpath);
+	free(mt->title);
+	free(mt->artist);
+	free(mt->album);
+	free(mt->track);
+	free(mt);
+}
+
+
+void
+insert_tag(media_tag *mt)
+{
+	/// Changed objs are updated in place, new objs get the next id
+	sqlite3_stmt *stmt = mt->id ? upd_stmt : ins_stmt;
+	if (mt->id) {
+		nchanged++;
+	} else {
+		mt->id = ++objid;
+		nnew++;
+	}
+	sqlite3_bind_int64(stmt, 1, mt->id);
+	sqlite3_bind_text(stmt, 2, "file", strlen("file"), SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 3, mt->mtype, strlen(mt->mtype), SQLITE_STATIC);
+	sqlite3_bind_int(stmt, 4, mt->duration);
+	sqlite3_bind_text(stmt, 5, mt->artist, strlen(mt->artist), SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 6, mt->album, strlen(mt->album), SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 7, mt->track, strlen(mt->track), SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 8, mt->title, strlen(mt->title), SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 9, mt->fpath, strlen(mt->fpath), SQLITE_STATIC);
+	sqlite3_bind_int64(stmt, 10, mt->size);
+	sqlite3_bind_int64(stmt, 11, mt->mtime);
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		LOG("failed to write obj %s: %s", mt->fpath, sqlite3_errmsg(db));
+	}
+	sqlite3_reset(stmt);
+	LOG("%s", mt->fpath);
+}
+
+
+void*
+parse_worker(void *arg)
+{
+	(void)arg;
+	/// libvlc is created with the first file, an update of an unchanged library parses nothing
+	libvlc_instance_t *libvlc = NULL;
+	media_tag *mt;
+	while ((mt = queue_pop(&pathq))) {
+		if (!libvlc && !(libvlc = libvlc_new(0, NULL))) {
+			LOG("failed to create libvlc instance, skipping: %s", mt->fpath);
+		}
+		if (libvlc && tag(libvlc, mt)) {
+			queue_push(&tagq, mt);
+		} else {
+			free_tag(mt);
+		}
+	}
+	if (libvlc) libvlc_release(libvlc);
+	return NULL;
+}
+
+
+double
+elapsed_sec(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+
+void*
+db_writer(void *arg)
+{
+	(void)arg;
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	double lastprogress = 0;
+	uint64_t nfiles = 0;
+	uint64_t ncommits = 0;
+	int nbatch = 0;
+	struct timespec batchstart, batchend;
+	media_tag *mt;
+	for (;;) {
+		/// An open batch waits for the parsers at most until it is BATCH_SEC old,
+		/// so the write lock isn't held while parsing a slow library
+		bool timedout = false;
+		mt = queue_pop_until(&tagq, nbatch ? &batchend : NULL, &timedout);
+		if (mt == NULL) {
+			if (nbatch) {
+				exec_stmt(db, "COMMIT");
+				LOG("committed %d objs", nbatch);
+				ncommits++;
+				nbatch = 0;
+			}
+			if (timedout) continue;
+			break;
+		}
+		if (nbatch == 0) {
+			exec_stmt(db, "BEGIN TRANSACTION");
+			clock_gettime(CLOCK_MONOTONIC, &batchstart);
+			batchend = batchstart;
+			batchend.tv_sec += BATCH_SEC;
+		}
+		insert_tag(mt);
+		free_tag(mt);
+		nfiles++;
+		nbatch++;
+		if (nbatch >= batchsize || elapsed_sec(&batchstart) >= BATCH_SEC) {
+			exec_stmt(db, "COMMIT");
+			LOG("committed %d objs", nbatch);
+			ncommits++;
+			nbatch = 0;
+		}
+		double sec = elapsed_sec(&start);
+		if (sec - lastprogress >= PROGRESS_SEC) {
+			lastprogress = sec;
+			LOG("progress: %lu files, %.1f files/s", nfiles, nfiles / sec);
+		}
+	}
+	double sec = elapsed_sec(&start);
+	LOG("parsed %lu files in %.1f s, %.1f files/s, %lu transactions", nfiles, sec, sec > 0 ? nfiles / sec : 0, ncommits);
+	return NULL;
+}
+
+
+uint32_t
+path_hash(const char *fpath)
+{
+	/// FNV-1a
+	uint32_t h = 2166136261u;
+	for (const unsigned char *c = (const unsigned char*)fpath; *c; ++c) {
+		h = (h ^ *c) * 16777619u;
+	}
+	return h % KNOWN_HASH;
+}
+
+
+/// load_known() reads the objs below the scanned dir, the walker checks files against them
+void
+load_known(char *dir)
+{
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(db, known_qry, -1, &stmt, NULL)) {
+		LOG("failed to prepare known objs query: %s", sqlite3_errmsg(db));
+		return;
+	}
+	sqlite3_bind_text(stmt, 1, dir, strlen(dir), SQLITE_STATIC);
+	uint64_t count = 0;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
+		known_obj *ko = calloc(1, sizeof(known_obj));
+		ko->id = sqlite3_column_int64(stmt, 0);
+		ko->fpath = strdup((char*)sqlite3_column_text(stmt, 1));
+		/// Objs without size and mtime are from older dbs, they never match
+		ko->size = sqlite3_column_type(stmt, 2) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 2);
+		ko->mtime = sqlite3_column_type(stmt, 3) == SQLITE_NULL ? -1 : sqlite3_column_int64(stmt, 3);
+		uint32_t h = path_hash(ko->fpath);
+		ko->next = known[h];
+		known[h] = ko;
+		count++;
+	}
+	sqlite3_finalize(stmt);
+	LOG("%lu objs in db below %s", count, dir);
+}
+
+
+known_obj*
+find_known(char *fpath)
+{
+	for (known_obj *ko = known[path_hash(fpath)]; ko; ko = ko->next) {
+		if (strcmp(ko->fpath, fpath) == 0) return ko;
+	}
+	return NULL;
+}
+
+
+/// keep_known() marks the objs at or below fpath as seen, when fpath couldn't be read
+/// (e.g. a transient NFS error) its objs are kept with their fav entries
+void
+keep_known(char *fpath)
+{
+	size_t len = strlen(fpath);
+	uint64_t count = 0;
+	for (int h = 0; h < KNOWN_HASH; ++h) {
+		for (known_obj *ko = known[h]; ko; ko = ko->next) {
+			if (strncmp(ko->fpath, fpath, len) == 0 &&
+				(ko->fpath[len] == '\0' || ko->fpath[len] == '/')) {
+				ko->seen = true;
+				count++;
+			}
+		}
+	}
+	LOG("keeping %lu objs below unreadable %s", count, fpath);
+}
+
+
+/// delete_unseen() deletes the objs of files that vanished, and their fav entries,
+/// as a new obj may get the id of a deleted one
+void
+delete_unseen(void)
+{
+	sqlite3_stmt *del_stmt, *delfav_stmt;
+	if (sqlite3_prepare_v2(db, del_qry, -1, &del_stmt, NULL) ||
+		sqlite3_prepare_v2(db, delfav_qry, -1, &delfav_stmt, NULL)) {
+		LOG("failed to prepare delete statements: %s", sqlite3_errmsg(db));
+		return;
+	}
+	for (int h = 0; h < KNOWN_HASH; ++h) {
+		for (known_obj *ko = known[h]; ko; ko = ko->next) {
+			if (ko->seen) continue;
+			LOG("deleting vanished: %s", ko->fpath);
+			sqlite3_bind_int64(del_stmt, 1, ko->id);
+			sqlite3_step(del_stmt);
+			sqlite3_reset(del_stmt);
+			sqlite3_bind_int64(delfav_stmt, 1, ko->id);
+			sqlite3_step(delfav_stmt);
+			sqlite3_reset(delfav_stmt);
+			ndeleted++;
+		}
+	}
+	sqlite3_finalize(del_stmt);
+	sqlite3_finalize(delfav_stmt);
+}
+
+
+void
+free_known(void)
+{
+	for (int h = 0; h < KNOWN_HASH; ++h) {
+		while (known[h]) {
+			known_obj *ko = known[h];
+			known[h] = ko->next;
+			free(ko->fpath);
+			free(ko);
+		}
+	}
+}
+
+
+/// queue_file() queues a file for parsing, in update mode only if it's new or changed
+void
+queue_file(char *fpath, struct stat *statbuf)
+{
+	media_tag *mt;
+	known_obj *ko = update_mode ? find_known(fpath) : NULL;
+	if (ko) {
+		ko->seen = true;
+		if (ko->size == statbuf->st_size && ko->mtime == statbuf->st_mtime) {
+			nunchanged++;
+			return;
+		}
+	}
+	mt = calloc(1, sizeof(media_tag));
+	mt->id = ko ? ko->id : 0;
+	mt->size = statbuf->st_size;
+	mt->mtime = statbuf->st_mtime;
+	mt->fpath = strdup(fpath);
+	queue_push(&pathq, mt);
 }
 
 
@@ -233,18 +749,25 @@ scan(char *basedir)
 	DIR *basedirfd = opendir(basedir);
 	if (!basedirfd) {
 		LOG("failed to open dir %s", basedir);
+		if (update_mode) keep_known(basedir);
 		return;
 	}
 	char fpath[PATH_MAX];
 	struct dirent *entryfd;
 	struct stat statbuf;
+	errno = 0;
 	while ((entryfd = readdir(basedirfd))) {
 		if (entryfd->d_name[0] == '.') continue;
 		sprintf(fpath, "%s/%s", basedir, entryfd->d_name);
-		if (stat(fpath, &statbuf) == -1) continue;
+		if (stat(fpath, &statbuf) == -1) {
+			LOG("failed to stat %s", fpath);
+			if (update_mode) keep_known(fpath);
+			errno = 0;
+			continue;
+		}
 		switch (statbuf.st_mode & S_IFMT) {
 			case S_IFREG:
-				tag(fpath);
+				queue_file(fpath, &statbuf);
 				break;
 			case S_IFDIR:
 				scan(fpath);
@@ -252,6 +775,12 @@ scan(char *basedir)
 			default:
 				LOG("skipping: %s", entryfd->d_name);
 		}
+		errno = 0;
+	}
+	/// A listing that broke off doesn't tell which files vanished
+	if (errno) {
+		LOG("failed to read dir %s", basedir);
+		if (update_mode) keep_known(basedir);
 	}
 	closedir(basedirfd);
 }
@@ -260,7 +789,11 @@ scan(char *basedir)
 void
 print_usage(char *cmd)
 {
-	printf("usage: %s [ -a ] db dir\n", cmd);
+	printf("usage: %s [ -a | -u ] [ -j threads ] [ -b batch size ] db dir\n", cmd);
+	printf("  -a  append all files of dir to db\n");
+	printf("  -u  update db with new, changed and vanished files of dir, keeping obj ids and favs\n");
+	printf("  -j  number of parser threads, default is number of cpus\n");
+	printf("  -b  max number of objs written per transaction, default is %d\n", batchsize);
 }
 
 
@@ -271,38 +804,121 @@ main(int argc, char *argv[])
 		print_usage(argv[0]);
 		return EXIT_FAILURE;
 	}
-	int opt = getopt(argc, argv, "a");
-	switch (opt) {
-	case 'a':
-		LOG("append mode");
-		append_mode = true;
-		break;
-	case -1:
-		break;
-	default:
+	int opt;
+	while ((opt = getopt(argc, argv, "auj:b:")) != -1) {
+		switch (opt) {
+		case 'a':
+			LOG("append mode");
+			append_mode = true;
+			break;
+		case 'u':
+			LOG("update mode");
+			update_mode = true;
+			break;
+		case 'j':
+			nworkers = atoi(optarg);
+			break;
+		case 'b':
+			batchsize = atoi(optarg);
+			if (batchsize <= 0) batchsize = 1;
+			break;
+		default:
+			print_usage(argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (argc - optind < 2) {
 		print_usage(argv[0]);
+		return EXIT_FAILURE;
 	}
+	if (nworkers <= 0) nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nworkers <= 0) nworkers = 1;
 
-    libvlc = libvlc_new(0, NULL);
     if (sqlite3_open(argv[optind], &db)) {
-    	LOG("failed to open db: %s", argv[2]);
+    	LOG("failed to open db: %s", argv[optind]);
     	return EXIT_FAILURE;
 	}
+	sqlite3_busy_timeout(db, BUSY_TIMEOUT_MS);
+	exec_stmt(db, tune_qry);
 	basedir = argv[optind + 1];
-	sqlite3_prepare_v2(db, ins_qry, -1, &ins_stmt, NULL);
-	sqlite3_prepare_v2(db, maxid_qry, -1, &maxid_stmt, NULL);
-	if (append_mode) {
+	/// Paths are stored as <basedir>/<name>, update mode finds them only with the same basedir
+	for (int l = strlen(basedir) - 1; l > 0 && basedir[l] == '/'; --l) basedir[l] = '\0';
+	if (append_mode || update_mode) {
+		bool hadfts = has_fts(db);
+		create_tables(db);
+		create_indexes(db);
+		if (!has_size(db)) {
+			LOG("adding size and mtime to objs");
+			exec_stmt(db, addsize_qry);
+			exec_stmt(db, addmtime_qry);
+		}
+		/// dbs scanned before the full text index existed are indexed once
+		if (!hadfts) {
+			LOG("creating full text index");
+			exec_stmt(db, rebuildfts_qry);
+		}
+		sqlite3_prepare_v2(db, maxid_qry, -1, &maxid_stmt, NULL);
 		objid = maxid(db);
 		LOG("continuing with objid: %ld", objid);
 	} else {
 		drop_tables(db);
 		create_tables(db);
 	}
-	exec_stmt(db, "BEGIN TRANSACTION");
+	/// obj table must exist when preparing the insert statement, e.g. in a new db
+	if (sqlite3_prepare_v2(db, ins_qry, -1, &ins_stmt, NULL) ||
+		sqlite3_prepare_v2(db, upd_qry, -1, &upd_stmt, NULL)) {
+		LOG("failed to prepare insert statement: %s", sqlite3_errmsg(db));
+		sqlite3_close(db);
+		return EXIT_FAILURE;
+	}
+	if (update_mode) {
+		/// An unreadable dir (e.g. unmounted) would delete all its objs
+		DIR *basedirfd = opendir(basedir);
+		if (!basedirfd) {
+			LOG("failed to open dir %s, not updating", basedir);
+			sqlite3_close(db);
+			return EXIT_FAILURE;
+		}
+		closedir(basedirfd);
+		load_known(basedir);
+	}
+	LOG("scanning with %d parser threads", nworkers);
+	queue_init(&pathq, PATHQ_LEN);
+	queue_init(&tagq, TAGQ_LEN);
+	pthread_t writer;
+	pthread_t *workers = calloc(nworkers, sizeof(pthread_t));
+	pthread_create(&writer, NULL, db_writer, NULL);
+	for (int w = 0; w < nworkers; ++w) {
+		pthread_create(&workers[w], NULL, parse_worker, NULL);
+	}
 	scan(basedir);
-	exec_stmt(db, "COMMIT");
+	queue_close(&pathq);
+	for (int w = 0; w < nworkers; ++w) {
+		pthread_join(workers[w], NULL);
+	}
+	queue_close(&tagq);
+	pthread_join(writer, NULL);
+	if (update_mode) {
+		exec_stmt(db, "BEGIN TRANSACTION");
+		delete_unseen();
+		exec_stmt(db, "COMMIT");
+		free_known();
+		LOG("update: %lu new, %lu changed, %lu unchanged, %lu deleted objs", nnew, nchanged, nunchanged, ndeleted);
+	}
+	if (!append_mode && !update_mode) {
+		LOG("creating indexes");
+		create_indexes(db);
+	}
+	/// Statistics for the query planner of ommserve
+	exec_stmt(db, "ANALYZE");
+	free(workers);
+	queue_free(&pathq);
+	queue_free(&tagq);
+	/// Closing the last connection checkpoints the WAL, statements must be finalized for that
+	sqlite3_finalize(ins_stmt);
+	sqlite3_finalize(upd_stmt);
+	sqlite3_finalize(maxid_stmt);
 	sqlite3_close(db);
-	libvlc_release(libvlc);
 
     return EXIT_SUCCESS;
 }
@@ -24,23 +24,37 @@
 Server layout:
 /--[0]-ctl
  |-[1]-query
- |-[2]-objid 1--data-aux-(file|dvb)
+ |-[2]-stats
+ |-[3]-index
+ |-[4]-objid 1--data-aux-(file|dvb)
           |-meta
- |-[3]-objid 2--data-aux-(file|dvb)
+ |-[5]-objid 2--data-aux-(file|dvb)
           |-meta
  .
  .
  .
- |-[n+1]-objid n--data-aux-(file|dvb)
+ |-[n+3]-objid n--data-aux-(file|dvb)
           |-meta
+
+The index file lists the meta data of all objs in the root dir, one record per line:
+objid, size of data file (-1 if unknown) and the fields of the meta file, each followed by LIST_SEP.
+Each read returns whole records only, so a client gets a page of records with one read.
+
+Reads of data files may block (disk, dvb streams), they are handed to a reader proc per
+open data fid and responded from there. All other requests are handled in the 9P server
+loop. Request latencies and the data read queue depth can be read from the stats file.
 */
 
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // readahead()
+#endif
 #include <u.h>
 #include <stdio.h>
 #include <time.h>  // posix std headers should be included between u.h and libc.h
 #include <stdbool.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <libc.h>
 #include <fcall.h>
 #include <thread.h>
@@ -59,9 +73,21 @@ Server layout:
 #define IDSTR_MAXLEN 10
 #define FAVID_MAXLEN 128
 #define MAX_QRY      128
-#define MAX_CTL      128
-#define MAX_ARGC     32
+#define MAX_CTLLOG   64     /// Logged length of ctl commands, fav commands may list many obj ids
+#define ARG_SEP      " \t\r\n"
 #define MAX_META     1024
+#define MAX_FTSQRY   (4 * MAX_QRY)
+#define MAX_QRYCACHE 16
+#define MAX_SESSIONS 64     /// Max sessions, each holds a db connection and a query cache
+#define MAX_IDLESESSIONS 8  /// Sessions kept without fids, e.g. for a query set by a 9p write
+#define MAX_STATS    8192
+#define MAX_INDEXREC (MAX_META + 64)
+#define NLATBUCKET   24     /// Latency histogram buckets 0..1us, 1..2us, ... 2^22us..
+#define READER_STACK_SIZE (64 * 1024)
+#define MAX_RAWINDOW 64     /// Max readahead window in iounits
+#define MAX_OBJCACHE 4096   /// Max obj records in the obj cache
+#define OBJCACHE_HASH 1024
+#define OBJCACHE_CHECK_MS 1000  /// Min interval between db version checks of the obj cache
 
 /// 9P server
 static char *srvname            = "ommserve";
@@ -70,49 +96,70 @@ static char *gname              = "omm";
 static char *datafname          = "data";
 static char *metafname          = "meta";
 static char *queryfname         = "query";
+static char *statsfname         = "stats";
+static char *indexfname         = "index";
 // static char *queryres           = "query result";
 static char *ctlfname           = "ctl";
 
 /// Database backend
-static sqlite3 *db              = NULL;
-static sqlite3_stmt *idstmt     = NULL;
-static sqlite3_stmt *countstmt  = NULL;
+static char *dbpath             = NULL;
+static bool hasfts              = false;
+/// Connection of the obj cache, shared by all sessions
+static sqlite3 *metadb          = NULL;
 static sqlite3_stmt *metastmt   = NULL;
-static sqlite3_stmt *favaddstmt = NULL;
-static sqlite3_stmt *favdelstmt = NULL;
+static sqlite3_stmt *metaverstmt = NULL;
+static const char *allidqry     = \
+	"SELECT id FROM obj";
+static const char *favallidqry  = \
+	"SELECT obj.id FROM obj, fav WHERE " \
+	"obj.id = fav.objid AND fav.listid = ?";
+/// Search in the full text index objfts (title, orig, album, track) built by ommscan,
+/// best matches first
 static const char *idqry        = \
-	"SELECT id FROM obj WHERE " \
-	"orig like '%%%s%%' OR title like '%%%s%%' " \
-	"LIMIT 1 OFFSET %d";
+	"SELECT rowid FROM objfts WHERE objfts MATCH ? " \
+	"ORDER BY rank";
 static const char *favidqry     = \
+	"SELECT objfts.rowid FROM objfts, fav WHERE objfts MATCH ? " \
+	"AND objfts.rowid = fav.objid AND fav.listid = ? " \
+	"ORDER BY rank";
+/// Fallback for dbs that were scanned without full text index
+static const char *likeidqry    = \
+	"SELECT id FROM obj WHERE " \
+	"orig like '%' || ?1 || '%' OR title like '%' || ?1 || '%'";
+static const char *likefavidqry = \
 	"SELECT obj.id FROM obj, fav WHERE " \
-	"(orig like '%%%s%%' OR title like '%%%s%%') " \
-	"AND obj.id = fav.objid AND fav.listid = '%s' " \
-	"LIMIT 1 OFFSET %d";
+	"(orig like '%' || ?1 || '%' OR title like '%' || ?1 || '%') " \
+	"AND obj.id = fav.objid AND fav.listid = ?2";
 static const char *countqry     = \
-	"SELECT COUNT(id) FROM obj WHERE " \
-	"orig like '%%%s%%' OR title like '%%%s%%' " \
-	"LIMIT 1";
-static const char *favcountqry  = \
-	"SELECT COUNT(obj.id) FROM obj, fav " \
-	"WHERE (orig like '%%%s%%' OR title like '%%%s%%') " \
-	"AND obj.id = fav.objid AND fav.listid = '%s' " \
-	"LIMIT 1";
+	"SELECT COUNT(id) FROM obj";
+static const char *hasftsqry    = \
+	"SELECT 1 FROM sqlite_master WHERE type = 'table' AND name = 'objfts'";
+static const char *dbverqry     = \
+	"PRAGMA data_version";
+/// WAL lets ommscan write while sessions read, each connection gets its own page cache
+/// and maps the db, so hot pages are read without syscalls
+static const char *tuneqry      = \
+	"PRAGMA journal_mode = WAL; " \
+	"PRAGMA cache_size = -16384; " \
+	"PRAGMA mmap_size = 268435456";
+/// Fav writes run in the server loop and fail instead of stalling all clients while
+/// ommscan holds the write lock, which it does for at most about a second per batch
+#define DB_BUSY_TIMEOUT_MS 100
 static const char *metaqry      = \
 	"SELECT type, fmt, dur, orig, album, track, title, path FROM obj WHERE " \
 	"id = ? LIMIT 1";
+/// Only objs in the db are added, and each obj only once per fav list
 static const char *favaddqry    = \
-	"INSERT INTO fav VALUES (?,?,?,?)";
+	"INSERT INTO fav (id, userid, listid, objid) " \
+	"SELECT ?1, ?2, ?3, id FROM obj WHERE id = ?4 " \
+	"AND NOT EXISTS (SELECT 1 FROM fav WHERE listid = ?3 AND objid = ?4)";
 static const char *favdelqry    = \
 	"DELETE FROM fav WHERE listid = ? AND objid = ?";
+static const char *planqry      = \
+	"EXPLAIN QUERY PLAN %s";
 
 static const int nobjdir        = 2;
-/// FIXME the following static variables are mutated by all clients
-static int objcount             = 0;
-static char querystr[MAX_QRY]   = "";    /// By default, no search string for title, origin; show all
-static char favid[FAVID_MAXLEN] = "";    /// By default, no fav list, show all table entries
-static char qrootstr[MAX_QRY]   = "";
-static char ctlstr[MAX_CTL]     = "";
+static const int nrootfiles     = 4;    /// ctl, query, stats and index file precede the obj dirs in root dir
 
 enum
 {
@@ -122,8 +169,48 @@ enum
 	Qmeta,
 	Qquery,
 	Qctl,
+	Qstats,
+	Qindex,
+};
+
+/// Ops with a latency histogram in the stats file
+enum
+{
+	OPattach = 0,
+	OPstat,
+	OPopen,
+	OPreaddir,
+	OPreadmeta,
+	OPreadindex,
+	OPreaddata,
+	OPwrite,
+	OPcount,
+};
+
+static char *opname[OPcount] = {
+	"attach", "stat", "open", "readdir", "readmeta", "readindex", "readdata", "write",
 };
 
+typedef struct OpStat
+{
+	uvlong count;
+	uvlong sum;                 /// Sum of latencies in us
+	uvlong max;
+	uvlong hist[NLATBUCKET];
+} OpStat;
+
+/// Stats are updated by the server loop and the data reader procs
+static QLock statlock;
+static OpStat opstat[OPcount];
+static int dataqdepth           = 0;
+static int dataqmax             = 0;
+/// Readahead window of open data files in iounits, 0 disables prefetching.
+/// Set with environment variable OMM_SERVE_READAHEAD
+static int rawindow             = 0;
+/// Media files of at least this size are memory mapped, 0 disables mapping.
+/// Set in MB with environment variable OMM_SERVE_MMAP
+static vlong mmapmin            = 0;
+
 enum
 {
 	OTfile = 0,
@@ -145,17 +232,142 @@ typedef union AuxData
 	struct DvbStream *st;
 } AuxData;
 
+/// Pending read of a data file, queued for the reader proc of the fid
+typedef struct DataReq
+{
+	Req *r;
+	vlong start;
+	struct DataReq *next;
+} DataReq;
+
+/// Range of a data file to prefetch into the page cache, len == 0 stops the prefetch proc
+typedef struct Prefetch
+{
+	vlong off;
+	vlong len;
+} Prefetch;
+
+/// Memory mapping of a media file, shared by all fids that opened the same obj.
+/// Note that a file truncated while being mapped raises SIGBUS on read
+typedef struct ObjMap
+{
+	vlong objid;
+	uchar *base;
+	vlong size;
+	int ref;
+	struct ObjMap *next;
+} ObjMap;
+
 typedef struct AuxObj
 {
 	char *objpath;
 	int ot;
 	uint64_t os;
 	AuxData od;
+	ObjMap *om;                 /// Mapping of the file, if mapped
+	bool reader;                /// The reader proc of this fid is started and owns the aux object
+	QLock reqlock;              /// Protects the read queue and stop
+	Rendez reqrz;               /// Wakes up the reader proc
+	DataReq *reqhead;           /// Reads queued for the reader proc, oldest first
+	DataReq *reqtail;
+	bool stop;                  /// Fid destroyed, the reader proc frees the aux object
+	Channel *donec;             /// ulong, reader or prefetch proc finished
+	Channel *rac;               /// Prefetch, read by the prefetch proc of this fid
+	vlong rastart;              /// Range of the file that has been prefetched
+	vlong raend;
 } AuxObj;
 
+/// Mappings are taken in the server loop, but may be released by a reader proc
+static QLock maplock;
+static ObjMap *objmaps          = nil;
+
+/// Snapshot of the obj ids in the root dir, taken when a client starts reading the root dir.
+/// Snapshots are shared by the fids and the query cache, the last reference frees it
+typedef struct AuxRoot
+{
+	int *ids;
+	int nids;
+	int ref;
+} AuxRoot;
+
+/// Read position in the index file, records are generated from the snapshot
+/// taken when the client starts reading the index file
+typedef struct AuxIndex
+{
+	AuxRoot *ar;
+	int idx;                    /// Next record to read
+	vlong off;                  /// Offset of record idx
+} AuxIndex;
+
+/// Id snapshots of the last queries, keyed by query string and fav list
+typedef struct QryCache
+{
+	char qry[MAX_QRY];
+	char fav[FAVID_MAXLEN];
+	AuxRoot *ar;
+	uvlong lastuse;
+} QryCache;
+
+/// Session state of all clients that attach with the same user name, e.g. a renderer
+/// browsing the root dir and ommctl setting the query for it. Each session has its own
+/// db connection with its own prepared statements, so sessions don't see each other's
+/// query and fav list. Sessions are referenced by the fids of their clients, the least
+/// recently used sessions without fids are closed
+typedef struct Session
+{
+	char *uname;
+	int ref;                         /// Fids attached with uname
+	uvlong lastuse;
+	sqlite3 *db;
+	sqlite3_stmt *allidstmt;
+	sqlite3_stmt *favallidstmt;
+	sqlite3_stmt *idstmt;
+	sqlite3_stmt *favidstmt;
+	sqlite3_stmt *dbverstmt;
+	sqlite3_stmt *favaddstmt;
+	sqlite3_stmt *favdelstmt;
+	int objcount;
+	char querystr[MAX_QRY];          /// By default, no search string for title, origin; show all
+	char favid[FAVID_MAXLEN];        /// By default, no fav list, show all table entries
+	QryCache qrycache[MAX_QRYCACHE];
+	uvlong qrycacheuse;
+	int qrycachedbver;
+	struct Session *next;
+} Session;
+
+/// Sessions are taken in the server loop, but the last fid of a session may be destroyed
+/// by a reader proc. sessionlock protects the session list and the fid references
+static QLock sessionlock;
+static Session *sessions        = nil;
+static int nsessions            = 0;
+static uvlong sessionuse        = 0;
+
+/// Record of an obj as served by the data and meta files, kept in the obj cache
+typedef struct ObjRec
+{
+	vlong objid;
+	int ot;
+	char *path;
+	char *meta;                 /// Content of the meta file
+	vlong size;                 /// Size of file objs, -1 if unknown
+	vlong mtime;
+	struct ObjRec *hnext;       /// Next record in hash bucket
+	struct ObjRec *prev;        /// LRU list, most recently used first
+	struct ObjRec *next;
+} ObjRec;
+
+/// Obj cache is only used by the server loop
+static ObjRec *objhash[OBJCACHE_HASH];
+static ObjRec *objlru           = nil;
+static ObjRec *objlrutail       = nil;
+static int nobjrec              = 0;
+static int objcachever          = -1;
+static vlong objcachecheck      = 0;
+
 static void closedb(void);
-static int xfav(int argc, char *argv[]);
-static void parse_args(int *argc, char *argv[MAX_ARGC], char *cmd);
+static bool exec_stmt(sqlite3 *db, const char *stmt);
+static char *xfav(Session *s, int argc, char *argv[]);
+static void parse_args(int *argc, char *argv[], int maxargc, char *cmd);
 
 static vlong
 qpath(int type, int obj)
@@ -217,6 +429,14 @@ dostat(vlong path, Qid *qid, Dir *dir)
 		name = ctlfname;
 		mode = 0666;
 		break;
+	case Qstats:
+		q.type = QTFILE;
+		name = statsfname;
+		break;
+	case Qindex:
+		q.type = QTFILE;
+		name = indexfname;
+		break;
 	default:
 		sysfatal("dostat %#llux", path);
 	}
@@ -238,6 +458,134 @@ dostat(vlong path, Qid *qid, Dir *dir)
 }
 
 
+/// dbversion() changes when another connection (e.g. ommscan or another session) commits to the db
+static int
+dbversion(sqlite3_stmt *verstmt)
+{
+	int ver = -1;
+	if (sqlite3_step(verstmt) == SQLITE_ROW) {
+		ver = sqlite3_column_int(verstmt, 0);
+	}
+	sqlite3_reset(verstmt);
+	return ver;
+}
+
+
+static void
+unlinkobjrec(ObjRec *or)
+{
+	if (or->prev) or->prev->next = or->next; else objlru = or->next;
+	if (or->next) or->next->prev = or->prev; else objlrutail = or->prev;
+	or->prev = or->next = nil;
+}
+
+
+static void
+pushobjrec(ObjRec *or)
+{
+	or->next = objlru;
+	if (objlru) objlru->prev = or; else objlrutail = or;
+	objlru = or;
+}
+
+
+static void
+freeobjrec(ObjRec *or)
+{
+	ObjRec **h = &objhash[or->objid % OBJCACHE_HASH];
+	for (; *h; h = &(*h)->hnext) {
+		if (*h == or) {
+			*h = or->hnext;
+			break;
+		}
+	}
+	unlinkobjrec(or);
+	nobjrec--;
+	free(or->path);
+	free(or->meta);
+	free(or);
+}
+
+
+static void
+clearobjcache(void)
+{
+	while (objlru) freeobjrec(objlru);
+}
+
+
+/// loadobjrec() queries the obj from the db and stats its file
+static ObjRec*
+loadobjrec(vlong objid)
+{
+	ObjRec *or = nil;
+	char meta[MAX_META];
+	int pos = 0;
+	// SELECT type, fmt, dur, orig, album, track, title, path FROM obj WHERE id = objid LIMIT 1
+	sqlite3_bind_int(metastmt, 1, objid);
+	if (sqlite3_step(metastmt) == SQLITE_ROW) {
+		or = emalloc9p(sizeof(ObjRec));
+		memset(or, 0, sizeof(ObjRec));
+		or->objid = objid;
+		char *objtype = (char*)sqlite3_column_text(metastmt, 0);
+		char *objpath = (char*)sqlite3_column_text(metastmt, 7);
+		or->path = estrdup9p(objpath ? objpath : "");
+		or->ot = (objtype && strcmp(objtype, OBJTYPESTR_DVB) == 0) ? OTdvb : OTfile;
+		/// Meta file lists type .. title, each followed by LIST_SEP
+		int col_cnt = 7;
+		for (int m = 0; m < col_cnt; ++m) {
+			char *col_val = (char*)sqlite3_column_text(metastmt, m);
+			pos += snprint(meta + pos, MAX_META - pos, "%s%c", col_val ? col_val : "", LIST_SEP);
+		}
+		or->meta = estrdup9p(meta);
+		or->size = -1;
+		struct stat statbuf;
+		if (or->ot == OTfile && stat(or->path, &statbuf) == 0) {
+			or->size = statbuf.st_size;
+			or->mtime = statbuf.st_mtime;
+		}
+		LOG("obj cache loaded obj %lld, path: %s", objid, or->path);
+	}
+	sqlite3_reset(metastmt);
+	return or;
+}
+
+
+/// getobjrec() returns the record of obj objid from the obj cache, loading it on a miss.
+/// The cache is cleared when the db changed, checked at most every OBJCACHE_CHECK_MS
+static ObjRec*
+getobjrec(vlong objid)
+{
+	vlong now = nsec() / 1000000;
+	if (now - objcachecheck >= OBJCACHE_CHECK_MS) {
+		objcachecheck = now;
+		int ver = dbversion(metaverstmt);
+		if (ver != objcachever) {
+			if (nobjrec) LOG("db changed, clearing obj cache");
+			clearobjcache();
+			objcachever = ver;
+		}
+	}
+	ObjRec *or;
+	for (or = objhash[objid % OBJCACHE_HASH]; or; or = or->hnext) {
+		if (or->objid == objid) {
+			unlinkobjrec(or);
+			pushobjrec(or);
+			return or;
+		}
+	}
+	or = loadobjrec(objid);
+	if (!or) return nil;
+	if (nobjrec == MAX_OBJCACHE) freeobjrec(objlrutail);
+	ObjRec **h = &objhash[objid % OBJCACHE_HASH];
+	or->hnext = *h;
+	*h = or;
+	pushobjrec(or);
+	nobjrec++;
+	return or;
+}
+
+
 /// initaux() initializes r->fid->aux based on r->fid->qid.path
 /// it allocates aux, if necessary, otherwise it sets all fields to zero
 /// then it queries the object for type and path and sets them in aux
@@ -253,53 +601,470 @@ initaux(vlong path, void **aux)
 	// if (*aux) return;
 	if (QTYPE(path) == Qdata) {
 		LOG("initaux, Qdata");
+		/// Stat of an open data file must not replace the aux object the reader proc works on
+		if (*aux) return;
 		AuxObj *ao = calloc(1, sizeof(AuxObj));
-		vlong objid = QOBJID(path);
-		// SELECT type, fmt, dur, orig, album, track, title, path FROM obj WHERE id = objid LIMIT 1
-		sqlite3_bind_int(metastmt, 1, objid);
-		int sqlret = sqlite3_step(metastmt);
-		if (sqlret == SQLITE_ROW) {
-			char *objtype = (char*)sqlite3_column_text(metastmt, 0);
-			char *objpath = (char*)sqlite3_column_text(metastmt, 7);
-			LOG("meta query returned file type: %s, path: %s", objtype, objpath);
-			ao->objpath = estrdup9p(objpath);
-			if (strcmp(objtype, OBJTYPESTR_FILE) == 0) {
-				ao->ot = OTfile;
-			}
-			else if (strcmp(objtype, OBJTYPESTR_DVB) == 0) {
-				ao->ot = OTdvb;
+		/// Data handle is opened in srvopen()
+		ao->od.fh = -1;
+		ObjRec *or = getobjrec(QOBJID(path));
+		if (or) {
+			ao->objpath = estrdup9p(or->path);
+			ao->ot = or->ot;
+			ao->os = or->size;
+			if (ao->ot == OTdvb) {
+				ao->od.st = nil;
 			}
 		}
-		sqlite3_reset(metastmt);
 		*aux = ao;
 	}
 	LOG("initaux finished");
 }
 
 
+static void
+freeauxroot(AuxRoot *ar)
+{
+	if (!ar) return;
+	if (--ar->ref > 0) return;
+	free(ar->ids);
+	free(ar);
+}
+
+
+static void
+clearqrycache(Session *s)
+{
+	for (int c = 0; c < MAX_QRYCACHE; ++c) {
+		freeauxroot(s->qrycache[c].ar);
+		memset(&s->qrycache[c], 0, sizeof(QryCache));
+	}
+}
+
+
+
+
+static AuxRoot*
+getqrycache(Session *s)
+{
+	int ver = dbversion(s->dbverstmt);
+	if (ver != s->qrycachedbver) {
+		LOG("db changed, clearing query cache");
+		clearqrycache(s);
+		s->qrycachedbver = ver;
+		return nil;
+	}
+	for (int c = 0; c < MAX_QRYCACHE; ++c) {
+		QryCache *qc = &s->qrycache[c];
+		if (qc->ar && strcmp(qc->qry, s->querystr) == 0 && strcmp(qc->fav, s->favid) == 0) {
+			qc->lastuse = ++s->qrycacheuse;
+			return qc->ar;
+		}
+	}
+	return nil;
+}
+
+
+static void
+putqrycache(Session *s, AuxRoot *ar)
+{
+	/// Replace the least recently used entry
+	int lru = 0;
+	for (int c = 1; c < MAX_QRYCACHE; ++c) {
+		if (s->qrycache[c].lastuse < s->qrycache[lru].lastuse) lru = c;
+	}
+	QryCache *qc = &s->qrycache[lru];
+	freeauxroot(qc->ar);
+	snprint(qc->qry, MAX_QRY, "%s", s->querystr);
+	snprint(qc->fav, FAVID_MAXLEN, "%s", s->favid);
+	qc->ar = ar;
+	qc->lastuse = ++s->qrycacheuse;
+	ar->ref++;
+}
+
+
 static int
-rootgen(int i, Dir *d, void *v)
+cmpid(const void *a, const void *b)
 {
-	(void)v;
-	int objoff = 2;
-	if (strlen(favid)) {
-		sprintf(qrootstr, favcountqry, querystr, querystr, favid);
+	int x = *(const int*)a;
+	int y = *(const int*)b;
+	return (x > y) - (x < y);
+}
+
+
+/// updqrycache() applies the fav list changes of this session to the cached listings
+/// of the fav list. Other sessions see the new db version and clear their query cache
+static void
+updqrycache(Session *s, char *listid, bool add, int *ids, int nids)
+{
+	for (int c = 0; c < MAX_QRYCACHE; ++c) {
+		QryCache *qc = &s->qrycache[c];
+		if (!qc->ar || strcmp(qc->fav, listid) != 0) continue;
+		/// Only the db knows which of the objs match the search
+		if (strlen(qc->qry)) {
+			freeauxroot(qc->ar);
+			memset(qc, 0, sizeof(QryCache));
+			continue;
+		}
+		AuxRoot *ar = qc->ar;
+		int *newids = emalloc9p((ar->nids + (add ? nids : 0) + 1) * sizeof(int));
+		int n = 0;
+		for (int i = 0; i < ar->nids; ++i) {
+			if (!add && bsearch(&ar->ids[i], ids, nids, sizeof(int), cmpid)) continue;
+			newids[n++] = ar->ids[i];
+		}
+		if (add) {
+			memmove(newids + n, ids, nids * sizeof(int));
+			n += nids;
+		}
+		/// Listings in progress keep their snapshot
+		if (ar->ref > 1) {
+			ar->ref--;
+			ar = emalloc9p(sizeof(AuxRoot));
+			ar->ref = 1;
+			qc->ar = ar;
+		} else {
+			free(ar->ids);
+		}
+		ar->ids = newids;
+		ar->nids = n;
+	}
+}
+
+
+/// ftsquery() turns the words of the query string into an FTS5 query that
+/// matches all words as token prefix, e.g. abbey ro -> "abbey"* "ro"*
+/// Words are quoted, so FTS5 operators in the query string are searched literally
+static void
+ftsquery(char *fts, int n, const char *qry)
+{
+	int pos = 0;
+	const char *c = qry;
+	fts[0] = '\0';
+	while (*c) {
+		while (*c && isspace((uchar)*c)) c++;
+		if (!*c) break;
+		/// Room for quotes, doubled quotes, star and separator
+		if (pos + 5 >= n) break;
+		if (pos) fts[pos++] = ' ';
+		fts[pos++] = '"';
+		while (*c && !isspace((uchar)*c) && pos + 4 < n) {
+			if (*c == '"') fts[pos++] = '"';
+			fts[pos++] = *c++;
+		}
+		while (*c && !isspace((uchar)*c)) c++;
+		fts[pos++] = '"';
+		fts[pos++] = '*';
+		fts[pos] = '\0';
+	}
+}
+
+
+/// idquery() binds the current query string and fav list to the matching
+/// prepared id query and returns it, ready to step
+static sqlite3_stmt*
+idquery(Session *s, char *fts)
+{
+	sqlite3_stmt *stmt;
+	ftsquery(fts, MAX_FTSQRY, s->querystr);
+	if (strlen(fts) == 0) {
+		stmt = strlen(s->favid) ? s->favallidstmt : s->allidstmt;
+		if (strlen(s->favid)) sqlite3_bind_text(stmt, 1, s->favid, -1, SQLITE_STATIC);
+		return stmt;
+	}
+	stmt = strlen(s->favid) ? s->favidstmt : s->idstmt;
+	LOG("id query: %s", hasfts ? fts : s->querystr);
+	if (hasfts) {
+		sqlite3_bind_text(stmt, 1, fts, -1, SQLITE_STATIC);
 	} else {
-		sprintf(qrootstr, countqry, querystr, querystr);
+		sqlite3_bind_text(stmt, 1, s->querystr, -1, SQLITE_STATIC);
 	}
-	LOG("count query: %s", qrootstr);
-	if (sqlite3_prepare_v2(db, qrootstr, -1, &countstmt, NULL)) {
-		closedb();
-		sysfatal("failed to prepare sql count statement");
+	if (strlen(s->favid)) sqlite3_bind_text(stmt, 2, s->favid, -1, SQLITE_STATIC);
+	return stmt;
+}
+
+
+/// snaprootids() runs the filtered id query once and returns all resulting
+/// obj ids, so that a directory listing doesn't query the db per entry.
+/// Repeated listings of the same query are served from the query cache
+static AuxRoot*
+snaprootids(Session *s)
+{
+	AuxRoot *ar = getqrycache(s);
+	if (ar) {
+		LOG("query cache hit, objcount: %d", ar->nids);
+		ar->ref++;
+		return ar;
+	}
+	char fts[MAX_FTSQRY];
+	sqlite3_stmt *stmt = idquery(s, fts);
+	ar = emalloc9p(sizeof(AuxRoot));
+	int maxids = 1024;
+	ar->ids = emalloc9p(maxids * sizeof(int));
+	ar->nids = 0;
+	ar->ref = 1;
+	int rc;
+	while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (ar->nids == maxids) {
+			maxids *= 2;
+			ar->ids = erealloc9p(ar->ids, maxids * sizeof(int));
+		}
+		ar->ids[ar->nids++] = sqlite3_column_int(stmt, 0);
+	}
+	if (rc != SQLITE_DONE) {
+		LOG("id query failed: %s", sqlite3_errmsg(s->db));
+	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	s->objcount = ar->nids;
+	LOG("session %s objcount: %d", s->uname, s->objcount);
+	putqrycache(s, ar);
+	return ar;
+}
+
+
+static void
+closesession(Session *s)
+{
+	clearqrycache(s);
+	sqlite3_finalize(s->allidstmt);
+	sqlite3_finalize(s->favallidstmt);
+	sqlite3_finalize(s->idstmt);
+	sqlite3_finalize(s->favidstmt);
+	sqlite3_finalize(s->dbverstmt);
+	sqlite3_finalize(s->favaddstmt);
+	sqlite3_finalize(s->favdelstmt);
+	sqlite3_close(s->db);
+	free(s->uname);
+	free(s);
+}
+
+
+static bool
+tunedb(sqlite3 *db)
+{
+	sqlite3_busy_timeout(db, DB_BUSY_TIMEOUT_MS);
+	return exec_stmt(db, tuneqry);
+}
+
+
+/// evictsession() removes the least recently used session without fids from the session
+/// list and returns it, the caller closes it after releasing sessionlock
+static Session*
+evictsession(void)
+{
+	Session **lru = nil;
+	for (Session **sp = &sessions; *sp; sp = &(*sp)->next) {
+		if ((*sp)->ref == 0 && (lru == nil || (*sp)->lastuse < (*lru)->lastuse)) lru = sp;
+	}
+	if (lru == nil) return nil;
+	Session *s = *lru;
+	*lru = s->next;
+	nsessions--;
+	return s;
+}
+
+
+static void
+closeevicted(Session *s)
+{
+	while (s) {
+		Session *next = s->next;
+		LOG("closing idle session of user: %s", s->uname);
+		closesession(s);
+		s = next;
+	}
+}
+
+
+/// opensession() connects a new session to the db and prepares its statements,
+/// the session is returned with the reference of the attaching fid
+static Session*
+opensession(char *uname)
+{
+	LOG("opening session for user: %s", uname);
+	qlock(&sessionlock);
+	Session *evicted = nil;
+	/// Reserve the slot of the new session, so the cap holds while the db is opened
+	if (nsessions >= MAX_SESSIONS && (evicted = evictsession()) == nil) {
+		qunlock(&sessionlock);
+		LOG("too many sessions");
+		return nil;
+	}
+	nsessions++;
+	qunlock(&sessionlock);
+	if (evicted) {
+		evicted->next = nil;
+		closeevicted(evicted);
+	}
+	Session *s = emalloc9p(sizeof(Session));
+	memset(s, 0, sizeof(Session));
+	s->uname = estrdup9p(uname);
+	s->qrycachedbver = -1;
+	if (sqlite3_open(dbpath, &s->db) ||
+		sqlite3_prepare_v2(s->db, allidqry, -1, &s->allidstmt, NULL) ||
+		sqlite3_prepare_v2(s->db, favallidqry, -1, &s->favallidstmt, NULL) ||
+		sqlite3_prepare_v2(s->db, hasfts ? idqry : likeidqry, -1, &s->idstmt, NULL) ||
+		sqlite3_prepare_v2(s->db, hasfts ? favidqry : likefavidqry, -1, &s->favidstmt, NULL) ||
+		sqlite3_prepare_v2(s->db, dbverqry, -1, &s->dbverstmt, NULL) ||
+		sqlite3_prepare_v2(s->db, favaddqry, -1, &s->favaddstmt, NULL) ||
+		sqlite3_prepare_v2(s->db, favdelqry, -1, &s->favdelstmt, NULL)) {
+		LOG("failed to open session db: %s", sqlite3_errmsg(s->db));
+		closesession(s);
+		qlock(&sessionlock);
+		nsessions--;
+		qunlock(&sessionlock);
+		return nil;
+	}
+	tunedb(s->db);
+	s->ref = 1;
+	qlock(&sessionlock);
+	s->next = sessions;
+	sessions = s;
+	qunlock(&sessionlock);
+	return s;
+}
+
+
+static Session*
+findsession(Fid *fid)
+{
+	char *uname = fid->uid ? fid->uid : "";
+	for (Session *s = sessions; s; s = s->next) {
+		if (strcmp(s->uname, uname) == 0) return s;
+	}
+	return nil;
+}
+
+
+/// getsession() returns the session of the user that attached the fid,
+/// walked fids inherit the user name of the attach. The reference of the fid
+/// keeps the session from being closed while the fid is used
+static Session*
+getsession(Fid *fid)
+{
+	qlock(&sessionlock);
+	Session *s = findsession(fid);
+	qunlock(&sessionlock);
+	return s;
+}
+
+
+/// refsession() returns the session of the user of the fid with a new reference for the fid,
+/// or nil if there is no session of the user
+static Session*
+refsession(Fid *fid)
+{
+	qlock(&sessionlock);
+	Session *s = findsession(fid);
+	if (s) {
+		s->ref++;
+		s->lastuse = ++sessionuse;
+	}
+	qunlock(&sessionlock);
+	return s;
+}
+
+
+/// putsession() releases the reference of a destroyed fid, idle sessions are kept
+/// up to MAX_IDLESESSIONS. It may run on a reader proc
+static void
+putsession(Fid *fid)
+{
+	Session *evicted = nil;
+	qlock(&sessionlock);
+	Session *s = findsession(fid);
+	if (s == nil || s->ref == 0) {
+		qunlock(&sessionlock);
+		return;
+	}
+	s->ref--;
+	s->lastuse = ++sessionuse;
+	int nidle = 0;
+	for (Session *i = sessions; i; i = i->next) {
+		if (i->ref == 0) nidle++;
+	}
+	for (; nidle > MAX_IDLESESSIONS; nidle--) {
+		Session *e = evictsession();
+		if (e == nil) break;
+		e->next = evicted;
+		evicted = e;
+	}
+	qunlock(&sessionlock);
+	closeevicted(evicted);
+}
+
+
+static void
+freeauxindex(AuxIndex *ai)
+{
+	if (!ai) return;
+	freeauxroot(ai->ar);
+	free(ai);
+}
+
+
+/// indexrecord() writes the index record of obj objid to rec and returns its length,
+/// objs that are not in the db (anymore) have a record without meta data
+static int
+indexrecord(int objid, char *rec, int n)
+{
+	ObjRec *or = getobjrec(objid);
+	int len = snprint(rec, n, "%d%c%lld%c%s\n", objid, LIST_SEP, or ? or->size : -1LL, LIST_SEP, or ? or->meta : "");
+	/// snprint() truncates silently, keep the record separator
+	if (len == n - 1) rec[len - 1] = '\n';
+	return len;
+}
+
+
+static void
+readindex(Req *r, Session *s)
+{
+	AuxIndex *ai = r->fid->aux;
+	vlong offset = r->ifcall.offset;
+	long count = r->ifcall.count;
+	char rec[MAX_INDEXREC];
+	int len;
+	/// Reading from the start takes a new snapshot of the query result
+	if (offset == 0 || ai == nil) {
+		freeauxindex(ai);
+		ai = emalloc9p(sizeof(AuxIndex));
+		ai->ar = snaprootids(s);
+		ai->idx = 0;
+		ai->off = 0;
+		r->fid->aux = ai;
 	}
-	int ret = sqlite3_step(countstmt);
-	if (ret == SQLITE_ROW) {
-		objcount = sqlite3_column_int(countstmt, 0);
-		LOG("objcount: %d", objcount);
+	/// Not continuing the last read, skip to the first record at or after offset
+	if (offset != ai->off) {
+		ai->idx = 0;
+		ai->off = 0;
+		while (ai->idx < ai->ar->nids && ai->off < offset) {
+			ai->off += indexrecord(ai->ar->ids[ai->idx++], rec, MAX_INDEXREC);
+		}
+	}
+	long pos = 0;
+	while (ai->idx < ai->ar->nids) {
+		len = indexrecord(ai->ar->ids[ai->idx], rec, MAX_INDEXREC);
+		if (pos + len > count) {
+			if (pos > 0 || count <= 0) break;
+			/// Record doesn't fit into an empty read, truncate it
+			len = count;
+			rec[len - 1] = '\n';
+		}
+		memcpy(r->ofcall.data + pos, rec, len);
+		pos += len;
+		ai->off += len;
+		ai->idx++;
 	}
-	sqlite3_reset(countstmt);
-	if (i >= objcount + objoff) {
-		// End of root directory with objcount obj dirs and one query file
+	r->ofcall.count = pos;
+}
+
+
+static int
+rootgen(int i, Dir *d, void *v)
+{
+	AuxRoot *ar = v;
+	if (i >= ar->nids + nrootfiles) {
+		// End of root directory with objcount obj dirs, ctl, query, stats and index file
 		return -1;
 	}
 	if (i == 0) {
@@ -308,25 +1073,13 @@ rootgen(int i, Dir *d, void *v)
 	} else if (i == 1) {
 		LOG("rootgen: query file");
 		dostat(qpath(Qquery, i), nil, d);
+	} else if (i == 2) {
+		dostat(qpath(Qstats, i), nil, d);
+	} else if (i == 3) {
+		dostat(qpath(Qindex, i), nil, d);
 	} else {
-		if (strlen(favid)) {
-			sprintf(qrootstr, favidqry, querystr, querystr, favid, i - objoff);
-		} else {
-			sprintf(qrootstr, idqry, querystr, querystr, i - objoff);
-		}
-		LOG("id query: %s", qrootstr);
-		if (sqlite3_prepare_v2(db, qrootstr, -1, &idstmt, NULL)) {
-			closedb();
-			sysfatal("failed to prepare sql id query statement");
-		}
-		int ret = sqlite3_step(idstmt);
-		if (ret == SQLITE_ROW) {
-			int id = sqlite3_column_int(idstmt, 0);
-			LOG("rootgen: select row %d returned objid: %d", i, id);
-			/// 0-clt, 1-query, 2..-obj (objid in db starts with 1)
-			dostat(qpath(Qobj, id + objoff - 2), nil, d);
-		}
-		sqlite3_reset(idstmt);
+		/// 0-clt, 1-query, 2-stats, 3-index, 4..-obj (objid in db starts with 1)
+		dostat(qpath(Qobj, ar->ids[i - nrootfiles]), nil, d);
 	}
 	return 0;
 }
@@ -349,15 +1102,308 @@ objgen(int i, Dir *d, void *v)
 }
 
 
+/// oprespond() responds to r and adds the time since start to the latency histogram of op
+static void
+oprespond(Req *r, char *err, int op, vlong start)
+{
+	uvlong us = (nsec() - start) / 1000;
+	int b = 0;
+	while (b < NLATBUCKET - 1 && (1ULL << b) <= us) b++;
+	qlock(&statlock);
+	OpStat *os = &opstat[op];
+	os->count++;
+	os->sum += us;
+	if (us > os->max) os->max = us;
+	os->hist[b]++;
+	qunlock(&statlock);
+	respond(r, err);
+}
+
+
+static void
+dataqadd(int n)
+{
+	qlock(&statlock);
+	dataqdepth += n;
+	if (dataqdepth > dataqmax) dataqmax = dataqdepth;
+	qunlock(&statlock);
+}
+
+
+/// Stats file format, one line per op: <op> <count> <avg us> <max us> <histogram buckets>
+/// Bucket b counts requests with latency < 2^b us (the last bucket counts all others)
+static void
+readstats(Req *r)
+{
+	char stats[MAX_STATS];
+	int pos = 0;
+	qlock(&statlock);
+	pos += snprint(stats + pos, MAX_STATS - pos, "dataq %d %d\n", dataqdepth, dataqmax);
+	for (int op = 0; op < OPcount; ++op) {
+		OpStat *os = &opstat[op];
+		pos += snprint(stats + pos, MAX_STATS - pos, "%s %llud %llud %llud",
+			opname[op], os->count, os->count ? os->sum / os->count : 0, os->max);
+		for (int b = 0; b < NLATBUCKET; ++b) {
+			pos += snprint(stats + pos, MAX_STATS - pos, " %llud", os->hist[b]);
+		}
+		pos += snprint(stats + pos, MAX_STATS - pos, "\n");
+	}
+	qunlock(&statlock);
+	readstr(r, stats);
+}
+
+
+/// prefetch() keeps the readahead window ahead of the read position off. The window is
+/// topped up when half of it has been read, and restarted at off after a seek
+static void
+prefetch(AuxObj *ao, vlong off, long iounit)
+{
+	vlong window = (vlong)rawindow * iounit;
+	if (off < ao->rastart || off > ao->raend) {
+		ao->rastart = ao->raend = off;
+	}
+	if (ao->raend - off > window / 2) return;
+	Prefetch pf = {ao->raend, off + window - ao->raend};
+	/// Skip if the prefetch proc is still busy, the next read tries again
+	if (nbsend(ao->rac, &pf) == 1) {
+		ao->raend = off + window;
+	}
+}
+
+
+static void
+prefetchproc(void *arg)
+{
+	AuxObj *ao = arg;
+	Prefetch pf;
+	for (;;) {
+		if (recv(ao->rac, &pf) != 1 || pf.len == 0) break;
+#ifdef __linux__
+		/// readahead() blocks until the range is in the page cache
+		readahead(ao->od.fh, pf.off, pf.len);
+#else
+		posix_fadvise(ao->od.fh, pf.off, pf.len, POSIX_FADV_WILLNEED);
+#endif
+	}
+	sendul(ao->donec, 1);
+}
+
+
+/// getobjmap() returns the mapping of the file fh of obj objid, a file that changed
+/// size since it was mapped is mapped anew
+static ObjMap*
+getobjmap(vlong objid, int fh, vlong size)
+{
+	ObjMap *om;
+	qlock(&maplock);
+	for (om = objmaps; om; om = om->next) {
+		if (om->objid == objid && om->size == size) {
+			om->ref++;
+			qunlock(&maplock);
+			return om;
+		}
+	}
+	uchar *base = mmap(nil, size, PROT_READ, MAP_SHARED, fh, 0);
+	if (base == MAP_FAILED) {
+		qunlock(&maplock);
+		LOG("failed to map obj %lld: %s", objid, strerror(errno));
+		return nil;
+	}
+	madvise(base, size, MADV_SEQUENTIAL);
+	om = emalloc9p(sizeof(ObjMap));
+	om->objid = objid;
+	om->base = base;
+	om->size = size;
+	om->ref = 1;
+	om->next = objmaps;
+	objmaps = om;
+	qunlock(&maplock);
+	LOG("mapped obj %lld, size: %lld", objid, size);
+	return om;
+}
+
+
+static void
+putobjmap(ObjMap *om)
+{
+	qlock(&maplock);
+	if (--om->ref > 0) {
+		qunlock(&maplock);
+		return;
+	}
+	for (ObjMap **p = &objmaps; *p; p = &(*p)->next) {
+		if (*p == om) {
+			*p = om->next;
+			break;
+		}
+	}
+	qunlock(&maplock);
+	munmap(om->base, om->size);
+	free(om);
+}
+
+
+static void
+readdata(AuxObj *ao, Req *r)
+{
+	vlong offset = r->ifcall.offset;
+	long count = r->ifcall.count;
+	r->ofcall.count = 0;
+	if (ao->ot == OTfile) {
+		if (ao->om) {
+			/// Mapped files are copied straight from the page cache, without a syscall
+			if (offset >= ao->om->size) return;
+			if (count > ao->om->size - offset) count = ao->om->size - offset;
+			memcpy(r->ofcall.data, ao->om->base + offset, count);
+			r->ofcall.count = count;
+			if (ao->rac) {
+				prefetch(ao, offset + count, count);
+			}
+			return;
+		}
+		if (ao->od.fh == -1) return;
+		/// pread() doesn't move the file offset, so reads on one handle don't interfere
+		long bytesread = pread(ao->od.fh, r->ofcall.data, count, offset);
+		r->ofcall.count = bytesread < 0 ? 0 : bytesread;
+		if (ao->rac && bytesread > 0) {
+			prefetch(ao, offset + bytesread, count);
+		}
+	}
+	else if (ao->ot == OTdvb) {
+		if (ao->od.st == nil) return;
+		int bytesread = dvb_read_stream(ao->od.st, r->ofcall.data, count);
+		// end of stream
+		if (bytesread < 0) {
+			bytesread = 0;
+		}
+		r->ofcall.count = bytesread;
+	}
+}
+
+
+static void
+freeauxobj(AuxObj *ao)
+{
+	if (ao->rac) {
+		Prefetch pf = {0, 0};
+		send(ao->rac, &pf);
+		recvul(ao->donec);
+		chanfree(ao->rac);
+	}
+	if (ao->donec) chanfree(ao->donec);
+	if (ao->om) putobjmap(ao->om);
+	free(ao->objpath);
+	switch (ao->ot) {
+	case OTfile:
+		LOG("closing file data handle");
+		if (ao->od.fh != -1) close(ao->od.fh);
+		break;
+	case OTdvb:
+		LOG("closing dvb data handle");
+		// FIXME this cause a double free
+		dvb_free_stream(ao->od.st);
+		break;
+	}
+	free(ao);
+}
+
+
+/// readerproc() serves the reads of one open data file in the order they arrived,
+/// so a blocking read only stalls the client that issued it.
+/// The reader proc owns the aux object and frees it when the fid is destroyed
+static void
+readerproc(void *arg)
+{
+	AuxObj *ao = arg;
+	for (;;) {
+		qlock(&ao->reqlock);
+		while (ao->reqhead == nil && !ao->stop) rsleep(&ao->reqrz);
+		DataReq *dr = ao->reqhead;
+		if (dr) {
+			ao->reqhead = dr->next;
+			if (ao->reqhead == nil) ao->reqtail = nil;
+		}
+		qunlock(&ao->reqlock);
+		/// Stopped and all reads answered
+		if (dr == nil) break;
+		readdata(ao, dr->r);
+		dataqadd(-1);
+		/// Responding may release the last reference to the fid and stop the reader proc
+		oprespond(dr->r, nil, OPreaddata, dr->start);
+		free(dr);
+	}
+	freeauxobj(ao);
+}
+
+
+static void
+startreader(AuxObj *ao)
+{
+	ao->reader = true;
+	ao->reqrz.l = &ao->reqlock;
+	ao->donec = chancreate(sizeof(ulong), 0);
+	proccreate(readerproc, ao, READER_STACK_SIZE);
+	if (ao->ot == OTfile && ao->od.fh != -1 && rawindow > 0) {
+		ao->rac = chancreate(sizeof(Prefetch), 1);
+		proccreate(prefetchproc, ao, READER_STACK_SIZE);
+	}
+}
+
+
+/// queueread() queues the read r for the reader proc, the queue has no fixed limit.
+/// A client that pipelines reads waits for the answers, the number of pending reads
+/// is bounded by the tags of its 9P connection
+static void
+queueread(AuxObj *ao, Req *r, vlong start)
+{
+	DataReq *dr = emalloc9p(sizeof(DataReq));
+	dr->r = r;
+	dr->start = start;
+	dr->next = nil;
+	dataqadd(1);
+	qlock(&ao->reqlock);
+	if (ao->reqtail) {
+		ao->reqtail->next = dr;
+	} else {
+		ao->reqhead = dr;
+	}
+	ao->reqtail = dr;
+	rwakeup(&ao->reqrz);
+	qunlock(&ao->reqlock);
+}
+
+
+/// stopreader() doesn't wait for the reader proc, since the fid may be destroyed by
+/// the reader proc itself. No reads are pending then
+static void
+stopreader(AuxObj *ao)
+{
+	qlock(&ao->reqlock);
+	ao->stop = true;
+	rwakeup(&ao->reqrz);
+	qunlock(&ao->reqlock);
+}
+
+
 static void
 srvattach(Req *r)
 {
+	vlong start = nsec();
+	/// Only the server loop opens sessions, so no other session of the user shows up meanwhile
+	Session *s = refsession(r->fid);
+	if (s == nil) {
+		s = opensession(r->fid->uid ? r->fid->uid : "");
+	}
+	if (s == nil) {
+		oprespond(r, "failed to open session", OPattach, start);
+		return;
+	}
 	/* dostat(0, &r->ofcall.qid, nil); */
 	// Maybe more explicitly writing the path of the root dir ...
 	/* dostat(QTDIR | Qroot, &r->ofcall.qid, nil); */
 	dostat(Qroot, &r->ofcall.qid, nil);
 	r->fid->qid = r->ofcall.qid;
-	respond(r, nil);
+	oprespond(r, nil, OPattach, start);
 }
 
 
@@ -385,6 +1431,14 @@ srvwalk1(Fid *fid, char *name, Qid *qid)
 			path = qpath(Qctl, 0);
 			goto Found;
 		}
+		if(strcmp(statsfname, name) == 0) {
+			path = qpath(Qstats, 0);
+			goto Found;
+		}
+		if(strcmp(indexfname, name) == 0) {
+			path = qpath(Qindex, 0);
+			goto Found;
+		}
 		char *endnum;
 		vlong objid = strtoull(name, &endnum, 10);
 		if (objid == 0 || endnum == name) {
@@ -437,167 +1491,212 @@ logobj(char *srvf, Qid qid)
 void
 srvstat(Req *r)
 {
+	vlong start = nsec();
 	logobj("srvstat", r->fid->qid);
 	dostat(r->fid->qid.path, nil, &r->d);
 	/// FIXME setting file length in dir entry should happen in dostat() ...?
-	initaux(r->fid->qid.path, &r->fid->aux);
-	AuxObj *ao = r->fid->aux;
-	struct stat statbuf;
-	if (ao) {
-		switch (ao->ot) {
-		case OTfile:
-			if (stat(ao->objpath, &statbuf) == -1) break;
-			ao->os = statbuf.st_size;
-			r->d.length = ao->os;
-			break;
+	/// Length and mtime of data files come from the obj cache, without touching the fid
+	if (QTYPE(r->fid->qid.path) == Qdata) {
+		ObjRec *or = getobjrec(QOBJID(r->fid->qid.path));
+		if (or && or->size >= 0) {
+			r->d.length = or->size;
+			r->d.mtime = or->mtime;
 		}
 	}
-	respond(r, nil);
+	oprespond(r, nil, OPstat, start);
 }
 
 
 static void
 srvopen(Req *r)
 {
+	vlong start = nsec();
 	logobj("srvopen", r->fid->qid);
 	initaux(r->fid->qid.path, &r->fid->aux);
-	AuxObj *ao = r->fid->aux;
+	AuxObj *ao = QTYPE(r->fid->qid.path) == Qdata ? r->fid->aux : nil;
 	if (ao) {
 		LOG("aux object: %p", ao);
+		char *err = nil;
 		switch (ao->ot) {
 		case OTfile:
-			ao->od.fh = open(ao->objpath, OREAD);
-			ao->os = 567;
+			ao->od.fh = ao->objpath ? open(ao->objpath, OREAD) : -1;
 			if (ao->od.fh == -1) {
 				LOG("failed to open file media object");
+				err = "failed to open media object";
+				break;
+			}
+			/// Media files are streamed front to back, let the kernel read ahead more aggressively
+			posix_fadvise(ao->od.fh, 0, 0, POSIX_FADV_SEQUENTIAL);
+			struct stat statbuf;
+			if (mmapmin > 0 && fstat(ao->od.fh, &statbuf) == 0 && statbuf.st_size >= mmapmin) {
+				ao->om = getobjmap(QOBJID(r->fid->qid.path), ao->od.fh, statbuf.st_size);
 			}
 			break;
 		case OTdvb:
 			ao->od.st = dvb_stream(ao->objpath);
 			if (ao->od.st == nil) {
 				LOG("failed to open dvb media object");
+				err = "failed to open dvb stream";
 			}
 			break;
 		}
+		/// Don't start a reader proc on a dead handle, the fid stays unopened
+		if (err) {
+			freeauxobj(ao);
+			r->fid->aux = nil;
+			oprespond(r, err, OPopen, start);
+			return;
+		}
+		if (!ao->reader) startreader(ao);
 	}
 	r->ofcall.qid = r->fid->qid;
-	respond(r, nil);
+	oprespond(r, nil, OPopen, start);
 }
 
 
 static void
 srvread(Req *r)
 {
+	vlong start = nsec();
 	logobj("srvread", r->fid->qid);
 	vlong path, offset;
 	path = r->fid->qid.path;
 	offset = r->ifcall.offset;
 	vlong objid = QOBJID(path);
-	long count = r->ifcall.count;
-	char *col_val;
-	size_t col_len;
-	int pos = 0;
-	char meta[MAX_META] = {0};
-	int sqlret;
+	int op = OPreadmeta;
+	ObjRec *or;
 	AuxObj *ao = nil;
+	Session *s = getsession(r->fid);
+	if (s == nil) {
+		oprespond(r, "no session", OPreaddir, start);
+		return;
+	}
 	switch(QTYPE(path)) {
 	case Qroot:
-		dirread9p(r, rootgen, nil);
+		op = OPreaddir;
+		/// Reading from the start lists the dir anew, following reads of
+		/// the same listing are served from the snapshot
+		if (offset == 0 || r->fid->aux == nil) {
+			freeauxroot(r->fid->aux);
+			r->fid->aux = snaprootids(s);
+		}
+		dirread9p(r, rootgen, r->fid->aux);
 		break;
 	case Qobj:
+		op = OPreaddir;
 		dirread9p(r, objgen, nil);
 		break;
 	case Qdata:
+		op = OPreaddata;
 		if (r->fid->aux == nil) {
 			LOG("read failed: aux data not set");
 			break;
 		}
 		ao = (AuxObj*)r->fid->aux;
-		if (ao->ot == OTfile) {
-			seek(ao->od.fh, offset, 0);
-			size_t bytesread = read(ao->od.fh, r->ofcall.data, count);
-			r->ofcall.count = bytesread;
-		}
-		else if (ao->ot == OTdvb) {
-			size_t bytesread = dvb_read_stream(ao->od.st, r->ofcall.data, count);
-			r->ofcall.count = bytesread;
+		if (ao->reader) {
+			/// Responded by the reader proc
+			queueread(ao, r, start);
+			return;
 		}
+		readdata(ao, r);
 		break;
 	case Qmeta:
-		// SELECT type, fmt, dur, orig, album, track, title, path FROM obj WHERE id = objid LIMIT 1
-		sqlite3_bind_int(metastmt, 1, objid);
-		sqlret = sqlite3_step(metastmt);
-		int col_cnt = 7;
-		if (sqlret == SQLITE_ROW) {
-			for (int m = 0; m < col_cnt; ++m) {
-				col_val = (char*)sqlite3_column_text(metastmt, m);
-				col_len = strlen(col_val);
-				memcpy(meta + pos, col_val, col_len);
-				pos += col_len;
-				meta[pos] = LIST_SEP;
-				pos++;
-			}
-			LOG("meta query returned title: %s", col_val);  /// Last col is title
-			readstr(r, meta);
+		or = getobjrec(objid);
+		if (or) {
+			readstr(r, or->meta);
 		}
-		sqlite3_reset(metastmt);
+		break;
+	case Qstats:
+		readstats(r);
+		break;
+	case Qindex:
+		op = OPreadindex;
+		readindex(r, s);
 		break;
 	// case Qquery:
 		// readstr(r, queryres);
 		// break;
 	}
-	respond(r, nil);
+	oprespond(r, nil, op, start);
 }
 
 
 static void
 srvwrite(Req *r)
 {
+	vlong start = nsec();
 	logobj("srvwrite", r->fid->qid);
 	/* vlong offset; */
 	vlong path;
 	long count;
+	char *ctl, *err = nil;
+	char **argv;
+	int argc, maxargc;
 	path = r->fid->qid.path;
 	/* offset = r->ifcall.offset; */
 	count = r->ifcall.count;
+	Session *s = getsession(r->fid);
+	if (s == nil) {
+		oprespond(r, "no session", OPwrite, start);
+		return;
+	}
 	switch(QTYPE(path)) {
 	case Qquery:
-		snprint(querystr, count, "%s", r->ifcall.data);
-		LOG("query: %s", querystr);
+		/// The query string is only bound as parameter to the id queries, never spliced into sql
+		snprint(s->querystr, count < MAX_QRY ? count : MAX_QRY, "%s", r->ifcall.data);
+		LOG("session %s query: %s", s->uname, s->querystr);
 		break;
 	case Qctl:
-		snprint(ctlstr, count, "%s", r->ifcall.data);
-		LOG("ctl: %s", ctlstr);
-		int argc = 0;
-		char *argv[MAX_ARGC] = {0};
-		parse_args(&argc, argv, ctlstr);
-		xfav(argc, argv);
+		/// One ctl write holds one command, up to the size of a 9P message
+		ctl = emalloc9p(count + 1);
+		memmove(ctl, r->ifcall.data, count);
+		ctl[count] = '\0';
+		LOG("session %s ctl: %.*s", s->uname, MAX_CTLLOG, ctl);
+		/// Args are separated by at least one char
+		maxargc = count / 2 + 1;
+		argv = emalloc9p(maxargc * sizeof(char*));
+		parse_args(&argc, argv, maxargc, ctl);
+		err = xfav(s, argc, argv);
+		free(argv);
+		free(ctl);
 		break;
 	}
 	r->ofcall.count = count;
-	respond(r, nil);
+	oprespond(r, err, OPwrite, start);
+}
+
+
+/// Fids cloned by a walk reference the session of the attach
+static char*
+srvclone(Fid *oldfid, Fid *newfid)
+{
+	refsession(newfid);
+	return nil;
 }
 
 
 static void
 srvdestroyfid(Fid *fid)
 {
+	putsession(fid);
 	if(!fid->aux)
 		return;
+	if (QTYPE(fid->qid.path) == Qroot) {
+		freeauxroot(fid->aux);
+		fid->aux = nil;
+		return;
+	}
+	if (QTYPE(fid->qid.path) == Qindex) {
+		freeauxindex(fid->aux);
+		fid->aux = nil;
+		return;
+	}
 	AuxObj *ao = (AuxObj*)(fid->aux);
-	free(ao->objpath);
-	switch (ao->ot) {
-	case OTfile:
-		LOG("closing file data handle");
-		close(ao->od.fh);
-		break;
-	case OTdvb:
-		LOG("closing dvb data handle");
-		// FIXME this cause a double free
-		dvb_free_stream(ao->od.st);
-		break;
+	if (ao->reader) {
+		stopreader(ao);
+	} else {
+		freeauxobj(ao);
 	}
-	free(fid->aux);
 	fid->aux = nil;
 }
 
@@ -605,6 +1704,7 @@ srvdestroyfid(Fid *fid)
 Srv server = {
 	.attach     = srvattach,
 	.walk1      = srvwalk1,
+	.clone      = srvclone,
 	.stat       = srvstat,
 	.open       = srvopen,
 	.read       = srvread,
@@ -641,37 +1741,83 @@ stopserver(void)
 }
 
 
+/// checkplans() warns about hot queries that scan a whole table instead of searching
+/// an index, e.g. when the db was scanned by an ommscan without the secondary indexes
+static void
+checkplans(sqlite3 *db)
+{
+	struct { const char *qry; bool scanok; } plans[] = {
+		{ allidqry,                          true },
+		{ favallidqry,                       false },
+		{ hasfts ? idqry : likeidqry,        !hasfts },
+		{ hasfts ? favidqry : likefavidqry,  false },
+		{ metaqry,                           false },
+		{ favaddqry,                         false },
+		{ favdelqry,                         false },
+	};
+	sqlite3_stmt *stmt;
+	for (int i = 0; i < nelem(plans); ++i) {
+		if (plans[i].scanok) {
+			continue;
+		}
+		char *qry = sqlite3_mprintf(planqry, plans[i].qry);
+		int rc = sqlite3_prepare_v2(db, qry, -1, &stmt, NULL);
+		sqlite3_free(qry);
+		if (rc) {
+			LOG("failed to check query plan: %s", sqlite3_errmsg(db));
+			continue;
+		}
+		/// Detail is the 4th column, full text matches are done by the virtual table
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			const char *detail = (const char*)sqlite3_column_text(stmt, 3);
+			if (detail && strncmp(detail, "SCAN ", 5) == 0 && !strstr(detail, "VIRTUAL TABLE")) {
+				LOG("warning: query does a full scan (%s), rescan db with ommscan to add indexes: %s", detail, plans[i].qry);
+			}
+		}
+		sqlite3_finalize(stmt);
+	}
+}
+
+
+/// opendb() checks the db and its schema and opens the connection of the obj cache,
+/// clients connect to the db when attaching
 static void
 opendb(char *dbfile)
 {
 	LOG("opening db: %s", dbfile);
+	sqlite3 *db;
+	sqlite3_stmt *stmt;
 	if (sqlite3_open(dbfile, &db)) {
+		sqlite3_close(db);
 		sysfatal("failed to open db");
 	}
-	sprintf(qrootstr, countqry, querystr, querystr);
-	LOG("count query: %s", qrootstr);
-	if (sqlite3_prepare_v2(db, qrootstr, -1, &countstmt, NULL)) {
-		closedb();
+	if (!tunedb(db)) {
+		LOG("failed to switch db to WAL mode, scanning will block clients");
+	}
+	if (sqlite3_prepare_v2(db, countqry, -1, &stmt, NULL)) {
+		sqlite3_close(db);
 		sysfatal("failed to prepare sql count statement");
 	}
-	int ret = sqlite3_step(countstmt);
-	if (ret == SQLITE_ROW) {
-		objcount = sqlite3_column_int(countstmt, 0);
-		LOG("objcount: %d", objcount);
+	if (sqlite3_step(stmt) == SQLITE_ROW) {
+		LOG("objcount: %d", sqlite3_column_int(stmt, 0));
 	}
-	sqlite3_reset(countstmt);
-	if (sqlite3_prepare_v2(db, metaqry, -1, &metastmt, NULL)) {
-		closedb();
-		sysfatal("failed to prepare sql obj meta data statement");
+	sqlite3_finalize(stmt);
+	if (sqlite3_prepare_v2(db, hasftsqry, -1, &stmt, NULL) == SQLITE_OK) {
+		hasfts = sqlite3_step(stmt) == SQLITE_ROW;
+		sqlite3_finalize(stmt);
 	}
-	if (sqlite3_prepare_v2(db, favaddqry, -1, &favaddstmt, NULL)) {
-		closedb();
-		sysfatal("failed to prepare fav insert statement");
+	if (!hasfts) {
+		LOG("db has no full text index, falling back to slow search (rescan db with ommscan)");
 	}
-	if (sqlite3_prepare_v2(db, favdelqry, -1, &favdelstmt, NULL)) {
+	checkplans(db);
+	/// Keep the connection for the obj cache
+	metadb = db;
+	if (sqlite3_prepare_v2(metadb, metaqry, -1, &metastmt, NULL) ||
+		sqlite3_prepare_v2(metadb, dbverqry, -1, &metaverstmt, NULL)) {
 		closedb();
-		sysfatal("failed to prepare fav delete statement");
+		sysfatal("failed to prepare sql obj meta data statement");
 	}
+	dbpath = estrdup9p(dbfile);
 }
 
 
@@ -679,7 +1825,21 @@ static void
 closedb(void)
 {
 	LOG("closing db ...");
-	sqlite3_close(db);
+	qlock(&sessionlock);
+	Session *s = sessions;
+	sessions = nil;
+	nsessions = 0;
+	qunlock(&sessionlock);
+	while (s) {
+		Session *next = s->next;
+		closesession(s);
+		s = next;
+	}
+	clearobjcache();
+	sqlite3_finalize(metastmt);
+	sqlite3_finalize(metaverstmt);
+	sqlite3_close(metadb);
+	metadb = NULL;
 	LOG("db closed");
 }
 
@@ -699,28 +1859,25 @@ closedvb(void)
 }
 
 
+/// parse_args() splits cmd in place at blanks and newlines, so obj ids can also be
+/// written one per line
 static void
-parse_args(int *argc, char *argv[MAX_ARGC], char *cmd)
+parse_args(int *argc, char *argv[], int maxargc, char *cmd)
 {
-	int len = strlen(cmd);
-	argv[0] = cmd;
-	*argc = 1;
-	char *del = cmd;
-	while (*argc < 5) {
-		del = strchr(del, ' ');
-		if (!del) break;
-		del++;
-		// LOG("argc: %d, argv: %s", *argc, del);
-		argv[*argc] = del;
-		(*argc)++;
-	}
-	for (int i = 0; i < len; ++i) {
-		if (cmd[i] == ' ') cmd[i] = '\0';
+	char *c = cmd;
+	*argc = 0;
+	while (*argc < maxargc) {
+		c += strspn(c, ARG_SEP);
+		if (*c == '\0') break;
+		argv[(*argc)++] = c;
+		c += strcspn(c, ARG_SEP);
+		if (*c == '\0') break;
+		*c++ = '\0';
 	}
 }
 
 
-bool
+static bool
 exec_stmt(sqlite3 *db, const char *stmt)
 {
 	char *err_msg = 0;
@@ -734,64 +1891,107 @@ exec_stmt(sqlite3 *db, const char *stmt)
 }
 
 
-static int
-xfav(int argc, char *argv[])
+/// favupdate() adds objs to or deletes them from a fav list in one transaction,
+/// e.g. when a whole playlist is imported. Returns nil or the error of the rolled back batch
+static char*
+favupdate(Session *s, bool add, char *listid, int nobj, char *objv[])
 {
-	if (argc == 1 && strcmp(argv[0], "fav") != 0) {
-		LOG("fav command expected, skipping");
-		return 0;
+	sqlite3_stmt *stmt = add ? s->favaddstmt : s->favdelstmt;
+	int *ids = emalloc9p(nobj * sizeof(int));
+	int nids = 0;
+	char *err = nil;
+	if (!exec_stmt(s->db, "BEGIN TRANSACTION")) {
+		free(ids);
+		return "failed to begin fav transaction";
 	}
-	if (argc == 4) {
-		if (strcmp(argv[1], "add") == 0) {
-			LOG("adding %s to favlist: %s", argv[3], argv[2]);
-			/// INSERT INTO fav VALUES (?,?,?,?)
+	for (int i = 0; i < nobj; ++i) {
+		char *end;
+		vlong objid = strtoll(objv[i], &end, 10);
+		if (end == objv[i] || *end != '\0') {
+			LOG("invalid obj id: %s, skipping", objv[i]);
+			continue;
+		}
+		if (add) {
 			/// TODO generate a fav entry id
-			sqlite3_bind_int(favaddstmt, 1, 0);
+			sqlite3_bind_int(stmt, 1, 0);
 			/// TODO user specific fav lists
-			sqlite3_bind_text(favaddstmt, 2, NULL, 0, SQLITE_STATIC);
-			sqlite3_bind_text(favaddstmt, 3, argv[2], strlen(argv[2]), SQLITE_STATIC);
-			sqlite3_bind_text(favaddstmt, 4, argv[3], strlen(argv[3]), SQLITE_STATIC);
-			int rc = sqlite3_step(favaddstmt);
-			if (rc != SQLITE_DONE) {
-				LOG("failed to add item to fav list: %d", rc);
-			}
-			sqlite3_reset(favaddstmt);
-		} else if (strcmp(argv[1], "del") == 0) {
-			/// DELETE FROM fav WHERE listid = ? AND objid = ?
-			LOG("del %s from favlist: %s", argv[3], argv[2]);
-			sqlite3_bind_text(favdelstmt, 1, argv[2], strlen(argv[2]), SQLITE_STATIC);
-			sqlite3_bind_text(favdelstmt, 2, argv[3], strlen(argv[3]), SQLITE_STATIC);
-			sqlite3_step(favdelstmt);
-			int rc = sqlite3_step(favdelstmt);
-			if (rc != SQLITE_DONE) {
-				LOG("failed to delete item to fav list: %d", rc);
-			}
-			sqlite3_reset(favdelstmt);
+			sqlite3_bind_null(stmt, 2);
+			sqlite3_bind_text(stmt, 3, listid, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, 4, objid);
 		} else {
-			LOG("fav subcmd unknown, skipping.");
+			sqlite3_bind_text(stmt, 1, listid, -1, SQLITE_STATIC);
+			sqlite3_bind_int64(stmt, 2, objid);
+		}
+		int rc = sqlite3_step(stmt);
+		if (rc != SQLITE_DONE) {
+			LOG("failed to %s obj %lld in fav list: %s", add ? "add" : "delete", objid, sqlite3_errmsg(s->db));
+			/// e.g. SQLITE_BUSY while ommscan writes a batch, the whole batch fails
+			err = rc == SQLITE_BUSY ? "db busy, fav list not changed" : "failed to change fav list";
+			sqlite3_reset(stmt);
+			break;
+		} else if (sqlite3_changes(s->db) > 0) {
+			ids[nids++] = objid;
+		}
+		sqlite3_reset(stmt);
+	}
+	sqlite3_clear_bindings(stmt);
+	if (!err && !exec_stmt(s->db, "COMMIT")) {
+		err = "failed to commit fav list";
+	}
+	if (err) {
+		exec_stmt(s->db, "ROLLBACK");
+		clearqrycache(s);
+		free(ids);
+		return err;
+	}
+	LOG("%s %d of %d objs in favlist: %s", add ? "added" : "deleted", nids, nobj, listid);
+	/// Changes of this connection don't change its db version, the cached listings are updated here
+	if (!add) qsort(ids, nids, sizeof(int), cmpid);
+	updqrycache(s, listid, add, ids, nids);
+	free(ids);
+	return nil;
+}
+
+
+/// xfav() returns nil or the error that the ctl write is answered with
+static char*
+xfav(Session *s, int argc, char *argv[])
+{
+	if (argc < 1 || strcmp(argv[0], "fav") != 0) {
+		LOG("fav command expected, skipping");
+		return "unknown command";
+	}
+	if (argc >= 4) {
+		if (strcmp(argv[1], "add") == 0) {
+			LOG("adding %d objs to favlist: %s", argc - 3, argv[2]);
+			return favupdate(s, true, argv[2], argc - 3, argv + 3);
+		} else if (strcmp(argv[1], "del") == 0) {
+			LOG("del %d objs from favlist: %s", argc - 3, argv[2]);
+			return favupdate(s, false, argv[2], argc - 3, argv + 3);
 		}
-		return 0;
+		LOG("fav subcmd unknown, skipping.");
+		return "unknown fav command";
 	} else if (argc == 3) {
 		if (strcmp(argv[1], "set") == 0) {
 			LOG("setting favlist to: %s", argv[2]);
-			memcpy(favid, argv[2], strlen(argv[2]));
-		} else {
-			LOG("fav subcmd unknown, skipping.");
+			snprint(s->favid, FAVID_MAXLEN, "%s", argv[2]);
+			return nil;
 		}
-		return 0;
+		LOG("fav subcmd unknown, skipping.");
+		return "unknown fav command";
 	} else if (argc == 2) {
 		if (strcmp(argv[1], "set") == 0) {
 			LOG("setting favlist to none");
-			memset(favid, 0, FAVID_MAXLEN);
-		} else {
-			LOG("fav subcmd unknown, skipping.");
+			memset(s->favid, 0, FAVID_MAXLEN);
+			return nil;
 		}
-		return 0;
+		LOG("fav subcmd unknown, skipping.");
+		return "unknown fav command";
 	}
 	// LOG("argc: %d", argc);
 	// if (argc >= 2) LOG("cmd: %s, arg0: %s", argv[0], argv[1]);
 	LOG("suspicious command, skipping");
-	return 0;
+	return "malformed fav command";
 }
 
 
@@ -805,6 +2005,19 @@ threadmain(int argc, char **argv)
 	if (_DEBUG_) {
 		chatty9p = 1;
 	}
+	char *ra = getenv("OMM_SERVE_READAHEAD");
+	if (ra) {
+		rawindow = atoi(ra);
+		if (rawindow < 0) rawindow = 0;
+		if (rawindow > MAX_RAWINDOW) rawindow = MAX_RAWINDOW;
+		LOG("readahead window: %d iounits", rawindow);
+	}
+	char *mm = getenv("OMM_SERVE_MMAP");
+	if (mm) {
+		mmapmin = atoll(mm) * 1024 * 1024;
+		if (mmapmin < 0) mmapmin = 0;
+		LOG("mapping media files larger than: %lld bytes", mmapmin);
+	}
 	opendb(argv[1]);
 	if (argc == 3) {
 		opendvb(argv[2]);